@@ -0,0 +1,509 @@
+/*
+ * Parser and query benchmark suite.
+ *
+ * Parses a set of synthetic corpora (deep nesting, wide sibling lists,
+ * attribute-heavy, script/style-heavy, malformed markup) and the pages in
+ * bench/corpus, then measures per corpus:
+ *
+ *   - parse throughput (MB/s of UTF-8 input, nodes/s) for the default,
+ *     arena, zero-copy, index and threaded modes
+ *   - query latency of SelectElement, GetElementsByClassName and
+ *     GetElementById, without and with a document index
+ *   - OuterHTML, UTF-8 WriteHTML and text() throughput (MB/s of input)
+ *   - how much resident memory the default parse of it added, with the
+ *     heap trimmed first so what earlier corpora freed is not reused
+ *     unseen (Linux only, coarse for pages of a few KB)
+ *
+ * and once for the process, its peak RSS.
+ *
+ * The generators are seeded, so a given --seed and --size-kb always give
+ * the same input. Every timing is the median of --rounds samples, each
+ * sample repeating the operation for at least --min-ms. Results go to
+ * stdout (or --out) as one JSON object. The exit status is 1 when a corpus
+ * parses to fewer nodes than its generator makes (a stray comment or raw
+ * text element swallowing the page), a mode builds another tree than the
+ * default parse or an indexed lookup finds other elements than a plain
+ * one; ctest runs one small round of it.
+ *
+ *   cmake -S . -B build && cmake --build build --target html_bench
+ *   ./build/html_bench --size-kb 1024 --rounds 7 --out bench.json
+ */
+
+#include "html_parser.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>     // malloc_trim
+#endif
+
+#ifndef HTML_BENCH_CORPUS_DIR
+#define HTML_BENCH_CORPUS_DIR "bench/corpus"
+#endif
+
+namespace {
+
+struct Settings {
+    size_t size_kb;
+    int rounds;
+    double min_ms;
+    unsigned seed;
+    std::string corpus_dir;
+    std::string out;
+
+    Settings() : size_kb(512), rounds(5), min_ms(50), seed(1), corpus_dir(HTML_BENCH_CORPUS_DIR) {}
+};
+
+// xorshift32, the same sequence on every platform unlike std distributions
+class Random {
+public:
+    explicit Random(unsigned seed) : state_(seed ? seed : 0x9E3779B9u) {}
+
+    unsigned Next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+
+    unsigned Below(unsigned n) { return Next() % n; }
+
+private:
+    unsigned state_;
+};
+
+const char* const kWords[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit",
+    "sed", "do", "eiusmod", "tempor", "incididunt", "labore", "magna", "aliqua",
+    "caf\xC3\xA9", "na\xC3\xAFve", "\xE6\x97\xA5\xE6\x9C\xAC", "\xD0\xBC\xD0\xB8\xD1\x80"
+};
+
+void Words(Random& rng, std::string& out, int n) {
+    for (int i = 0; i < n; i++) {
+        if (i) out += ' ';
+        out += kWords[rng.Below(sizeof(kWords) / sizeof(kWords[0]))];
+    }
+}
+
+// every corpus has id="main" and class="item" elements for the queries
+
+std::string DeepNesting(Random& rng, size_t bytes) {
+    std::string page = "<html><body><div id=\"main\">";
+    while (page.size() < bytes) {
+        int depth = 200 + static_cast<int>(rng.Below(300));
+        for (int d = 0; d < depth; d++) {
+            page += (d % 3 == 0) ? "<div class=\"item\">" : (d % 3 == 1 ? "<section>" : "<span>");
+        }
+        Words(rng, page, 4);
+        for (int d = depth - 1; d >= 0; d--) {
+            page += (d % 3 == 0) ? "</div>" : (d % 3 == 1 ? "</section>" : "</span>");
+        }
+    }
+    page += "</div></body></html>";
+    return page;
+}
+
+std::string WideSiblings(Random& rng, size_t bytes) {
+    std::string page = "<html><body><ul id=\"main\">";
+    int n = 0;
+    while (page.size() < bytes) {
+        page += (n++ % 4 == 0) ? "<li class=\"item\">" : "<li>";
+        Words(rng, page, 1 + static_cast<int>(rng.Below(4)));
+        page += "</li>";
+    }
+    page += "</ul></body></html>";
+    return page;
+}
+
+std::string AttributeHeavy(Random& rng, size_t bytes) {
+    std::string page = "<html><body><div id=\"main\">";
+    int n = 0;
+    while (page.size() < bytes) {
+        std::ostringstream tag;
+        tag << "<div id=\"n" << n << "\" class=\"item c" << rng.Below(20) << " c" << rng.Below(20) << "\"";
+        tag << " data-sku=\"SKU-" << rng.Next() % 100000 << "\" data-price='" << rng.Below(1000) << ".99'";
+        tag << " title=\"";
+        std::string title;
+        Words(rng, title, 3);
+        tag << title << "\" aria-hidden=false hidden tabindex=" << rng.Below(10);
+        tag << " style=\"color: #" << std::hex << (rng.Next() & 0xFFFFFF) << std::dec << "; margin: 0\"";
+        tag << " data-a=1 data-b=2 data-c=3>";
+        page += tag.str();
+        page += "<a href=\"/p/";
+        page += std::to_string(n);
+        page += "\" rel=\"nofollow noopener\" target=_blank>x</a></div>";
+        n++;
+    }
+    page += "</div></body></html>";
+    return page;
+}
+
+std::string ScriptStyleHeavy(Random& rng, size_t bytes) {
+    std::string page = "<html><head>";
+    while (page.size() < bytes) {
+        page += "<script>var data = [";
+        page += std::to_string(rng.Below(100));
+        page += ", 2, 3]; for (var i = 0; i < data.length; i++) { if (data[i] < 2) "
+            "{ console.log('<b>' + data[i] + '</b>'); } } function f(a, b) { return a < b ? a : b; }</script>\n"
+            "<style>p { margin: 0 } div > span { color: red } a:hover { text-decoration: underline }</style>\n"
+            "<!-- <div class=\"item\">commented out</div> -->\n";
+    }
+    page += "</head><body><div id=\"main\"><p class=\"item\">";
+    Words(rng, page, 8);
+    page += "</p></div></body></html>";
+    return page;
+}
+
+std::string Malformed(Random& rng, size_t bytes) {
+    static const char* const pieces[] = {
+        "<div class=\"item\">", "<p>", "<b>", "<i>", "</div>", "</p>", "</b>", "</span>",
+        "<td>", "</tr>", "<li>", "<br>", "</br>", "<img src=x>", "<a href='broken>",
+        "<div class=item id=\"dup\">", "< notatag", "a < b && c > d", "<!-- c -->",
+        "<table><tr><td>", "</table>", "<p class=\"", "\">", "&amp;&nbsp;&bogus;"
+    };
+    std::string page = "<html><body><div id=\"main\">";
+    while (page.size() < bytes) {
+        page += pieces[rng.Below(sizeof(pieces) / sizeof(pieces[0]))];
+        Words(rng, page, 1 + static_cast<int>(rng.Below(3)));
+    }
+    page += "</body></html>";
+    return page;
+}
+
+struct Corpus {
+    std::string name;
+    std::string html;   // UTF-8
+    size_t min_nodes;   // fewer means the page was swallowed
+};
+
+bool ReadFile(const std::string& path, std::string& out) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) return false;
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    out = buffer.str();
+    return true;
+}
+
+std::vector<Corpus> Corpora(const Settings& settings) {
+    size_t bytes = settings.size_kb * 1024;
+    std::vector<Corpus> corpora;
+    typedef std::string (*Generator)(Random&, size_t);
+    // bytes per node a few times above what each makes
+    static const struct { const char* name; Generator generate; size_t bytes_per_node; } generators[] = {
+        { "deep_nesting", DeepNesting, 64 },
+        { "wide_siblings", WideSiblings, 64 },
+        { "attribute_heavy", AttributeHeavy, 256 },
+        { "script_style_heavy", ScriptStyleHeavy, 512 },
+        { "malformed", Malformed, 64 }
+    };
+    for (size_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++) {
+        Random rng(settings.seed + static_cast<unsigned>(i));
+        Corpus corpus;
+        corpus.name = generators[i].name;
+        corpus.html = generators[i].generate(rng, bytes);
+        corpus.min_nodes = corpus.html.size() / generators[i].bytes_per_node;
+        corpora.push_back(corpus);
+    }
+
+    static const char* const pages[] = { "news_article.html", "product_listing.html", "docs_page.html" };
+    for (size_t i = 0; i < sizeof(pages) / sizeof(pages[0]); i++) {
+        Corpus corpus;
+        corpus.name = pages[i];
+        corpus.name.resize(corpus.name.size() - 5);
+        corpus.min_nodes = 100;
+        if (!ReadFile(settings.corpus_dir + "/" + pages[i], corpus.html)) {
+            fprintf(stderr, "html_bench: cannot read %s/%s, skipped\n", settings.corpus_dir.c_str(), pages[i]);
+            continue;
+        }
+        corpora.push_back(corpus);
+    }
+    return corpora;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+volatile size_t g_sink;
+
+/**
+ * median seconds per call of f: calibrated so each sample runs at least
+ * min_ms, rounds samples
+ */
+template <typename F>
+double Time(const Settings& settings, F f) {
+    Clock::time_point start = Clock::now();
+    f();
+    double once = std::chrono::duration<double>(Clock::now() - start).count();
+    size_t reps = 1;
+    if (once > 0 && once * 1000 < settings.min_ms) reps = static_cast<size_t>(settings.min_ms / (once * 1000)) + 1;
+
+    std::vector<double> samples;
+    for (int r = 0; r < settings.rounds; r++) {
+        start = Clock::now();
+        for (size_t i = 0; i < reps; i++) f();
+        samples.push_back(std::chrono::duration<double>(Clock::now() - start).count() / reps);
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+size_t CountNodes(const HtmlElement& node) {
+    size_t n = 1;
+    for (HtmlElement::ChildIterator it = node.ChildBegin(); it != node.ChildEnd(); ++it) n += CountNodes(**it);
+    return n;
+}
+
+long PeakRssKb() {
+#if defined(__APPLE__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<long>(usage.ru_maxrss / 1024);
+#elif defined(__unix__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<long>(usage.ru_maxrss);
+#else
+    return -1;
+#endif
+}
+
+// -1 where /proc/self/statm is missing
+long CurrentRssKb() {
+#if defined(__linux__)
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file) return -1;
+    long pages = 0, resident = 0;
+    int read = fscanf(file, "%ld %ld", &pages, &resident);
+    fclose(file);
+    return read == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+#else
+    return -1;
+#endif
+}
+
+double MBps(size_t bytes, double secs) {
+    return secs > 0 ? static_cast<double>(bytes) / secs / (1024.0 * 1024.0) : 0;
+}
+
+class Json {
+public:
+    explicit Json(std::string& out) : out_(out), first_(true) {}
+
+    void Open(const char* key, char bracket) {
+        Key(key);
+        out_ += bracket;
+        first_ = true;
+    }
+
+    void Close(char bracket) {
+        out_ += bracket;
+        first_ = false;
+    }
+
+    void String(const char* key, const std::string& value) {
+        Key(key);
+        out_ += '"';
+        for (size_t i = 0; i < value.size(); i++) {
+            char c = value[i];
+            if (c == '"' || c == '\\') out_ += '\\';
+            if (static_cast<unsigned char>(c) < 0x20) continue;
+            out_ += c;
+        }
+        out_ += '"';
+    }
+
+    void Number(const char* key, double value) {
+        Key(key);
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.6g", value);
+        out_ += buffer;
+    }
+
+private:
+    void Key(const char* key) {
+        if (!first_) out_ += ',';
+        first_ = false;
+        if (key) {
+            out_ += '"';
+            out_ += key;
+            out_ += "\":";
+        }
+    }
+
+    std::string& out_;
+    bool first_;
+};
+
+// false when the corpus parses to too few nodes, or a parse mode or an
+// indexed query disagrees with the default
+bool RunCorpus(const Settings& settings, const Corpus& corpus, Json& json) {
+    bool same = true;
+    const std::string& html = corpus.html;
+    json.Open(nullptr, '{');
+    json.String("name", corpus.name);
+    json.Number("bytes", static_cast<double>(html.size()));
+
+    HtmlParser parser;
+#if defined(__GLIBC__)
+    // hand back what earlier corpora freed, or the parse reuses it unseen
+    malloc_trim(0);
+#endif
+    long rssBefore = CurrentRssKb();
+    shared_ptr<HtmlDocument> doc = parser.Parse(html);
+    long rssAfter = CurrentRssKb();
+    size_t nodes = CountNodes(*doc->GetRoot());
+    json.Number("nodes", static_cast<double>(nodes));
+    json.Number("tree_rss_kb", rssBefore < 0 || rssAfter < 0 ? -1 : static_cast<double>(rssAfter - rssBefore));
+    if (nodes < corpus.min_nodes) {
+        fprintf(stderr, "html_bench: %s: %zu nodes, at least %zu expected\n", corpus.name.c_str(), nodes, corpus.min_nodes);
+        same = false;
+    }
+
+    json.Open("parse", '{');
+    static const char* const modes[] = { "default", "arena", "zero_copy", "index", "threads" };
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        HtmlParser modeParser;
+        if (m == 1) modeParser.SetArenaMode(true);
+        if (m == 2) modeParser.SetZeroCopyMode(true);
+        if (m == 3) modeParser.SetIndexMode(true);
+        if (m == 4) modeParser.SetThreads(std::thread::hardware_concurrency());
+        double secs = Time(settings, [&]() {
+            shared_ptr<HtmlDocument> parsed = modeParser.Parse(html);
+            g_sink = parsed->GetRoot()->GetChildren().size();
+        });
+        if (CountNodes(*modeParser.Parse(html)->GetRoot()) != nodes) {
+            fprintf(stderr, "html_bench: %s: %s mode builds another tree\n", corpus.name.c_str(), modes[m]);
+            same = false;
+        }
+        json.Open(modes[m], '{');
+        json.Number("mb_per_s", MBps(html.size(), secs));
+        json.Number("nodes_per_s", secs > 0 ? nodes / secs : 0);
+        json.Close('}');
+    }
+    json.Close('}');
+
+    json.Open("query_us", '{');
+    size_t byClass = doc->GetElementsByClassName(L"item").size();
+    shared_ptr<HtmlElement> byId = doc->GetElementById(L"main");
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            doc->BuildIndex();
+            if (doc->GetElementsByClassName(L"item").size() != byClass || doc->GetElementById(L"main") != byId) {
+                fprintf(stderr, "html_bench: %s: indexed lookups differ\n", corpus.name.c_str());
+                same = false;
+            }
+        }
+        json.Open(indexed ? "indexed" : "plain", '{');
+        json.Number("select_element", 1e6 * Time(settings, [&]() {
+            std::vector<shared_ptr<HtmlElement>> result;
+            doc->SelectElement(L"//div[@class='item']", result);
+            g_sink = result.size();
+        }));
+        json.Number("get_elements_by_class_name", 1e6 * Time(settings, [&]() {
+            g_sink = doc->GetElementsByClassName(L"item").size();
+        }));
+        json.Number("get_element_by_id", 1e6 * Time(settings, [&]() {
+            g_sink = doc->GetElementById(L"main") ? 1 : 0;
+        }));
+        json.Close('}');
+    }
+    json.Close('}');
+
+    json.Open("output_mb_per_s", '{');
+    json.Number("outer_html", MBps(html.size(), Time(settings, [&]() {
+        g_sink = doc->OuterHTML().size();
+    })));
+    json.Number("write_html_utf8", MBps(html.size(), Time(settings, [&]() {
+        std::string out;
+        HtmlStringSink<char> sink(out);
+        doc->WriteHTML(sink);
+        g_sink = out.size();
+    })));
+    json.Number("text", MBps(html.size(), Time(settings, [&]() {
+        g_sink = doc->text().size();
+    })));
+    json.Close('}');
+
+    json.Close('}');
+    return same;
+}
+
+bool ParseArgs(int argc, char** argv, Settings& settings) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--size-kb" && value) settings.size_kb = strtoul(value, nullptr, 10);
+        else if (arg == "--rounds" && value) settings.rounds = atoi(value);
+        else if (arg == "--min-ms" && value) settings.min_ms = atof(value);
+        else if (arg == "--seed" && value) settings.seed = static_cast<unsigned>(strtoul(value, nullptr, 10));
+        else if (arg == "--corpus" && value) settings.corpus_dir = value;
+        else if (arg == "--out" && value) settings.out = value;
+        else {
+            fprintf(stderr, "usage: html_bench [--size-kb N] [--rounds N] [--min-ms MS] [--seed N] [--corpus DIR] [--out FILE]\n");
+            return false;
+        }
+        i++;
+    }
+    if (settings.rounds < 1) settings.rounds = 1;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Settings settings;
+    if (!ParseArgs(argc, argv, settings)) return 2;
+
+    std::string out;
+    Json json(out);
+    json.Open(nullptr, '{');
+    json.Open("settings", '{');
+    json.Number("size_kb", static_cast<double>(settings.size_kb));
+    json.Number("rounds", settings.rounds);
+    json.Number("min_ms", settings.min_ms);
+    json.Number("seed", settings.seed);
+    json.Number("hardware_threads", std::thread::hardware_concurrency());
+#if defined(HTMLPARSER_AVX2)
+    json.String("simd", "avx2");
+#elif defined(HTMLPARSER_SSE2)
+    json.String("simd", "sse2");
+#else
+    json.String("simd", "none");
+#endif
+    json.Close('}');
+
+    json.Open("corpora", '[');
+    std::vector<Corpus> corpora = Corpora(settings);
+    bool same = true;
+    for (size_t i = 0; i < corpora.size(); i++) {
+        fprintf(stderr, "html_bench: %s\n", corpora[i].name.c_str());
+        same = RunCorpus(settings, corpora[i], json) && same;
+    }
+    json.Close(']');
+    json.Number("peak_rss_kb", static_cast<double>(PeakRssKb()));
+    json.Close('}');
+    out += '\n';
+
+    if (settings.out.empty()) {
+        fputs(out.c_str(), stdout);
+        return same ? 0 : 1;
+    }
+    FILE* file = fopen(settings.out.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "html_bench: cannot write %s\n", settings.out.c_str());
+        return 1;
+    }
+    fputs(out.c_str(), file);
+    fclose(file);
+    return same ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Microbenchmark for the tokenizer scanning kernels.
+ *
+ * Compares the per-character loops the tokenizer used to run with the
+ * HtmlScanner kernels on a text-heavy and a script-heavy page, and reports
+ * full parse throughput for both. Build once as-is and once with
+ * -DHTMLPARSER_NO_SIMD to see the vector/scalar split, e.g.
+ *
+ *   g++ -O2 -std=c++11 -I.. scan_bench.cpp -o scan_bench
+ *   g++ -O2 -std=c++11 -mavx2 -I.. scan_bench.cpp -o scan_bench_avx2
+ */
+
+#include "html_parser.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+static std::wstring TextHeavyPage(size_t bytes) {
+    std::wstring page = L"<html><body>";
+    while (page.size() < bytes) {
+        page += L"<p class=\"para\">Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod "
+            L"tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud "
+            L"exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.</p>\n";
+    }
+    page += L"</body></html>";
+    return page;
+}
+
+static std::wstring ScriptHeavyPage(size_t bytes) {
+    std::wstring page = L"<html><head>";
+    while (page.size() < bytes) {
+        page += L"<script>var data = [1, 2, 3]; for (var i = 0; i < data.length; i++) { if (data[i] < 2) "
+            L"{ console.log('<b>' + data[i] + '</b>'); } } function f(a, b) { return a < b ? a : b; }</script>\n"
+            L"<style>p { margin: 0 } div > span { color: red } a:hover { text-decoration: underline }</style>\n";
+    }
+    page += L"</head><body></body></html>";
+    return page;
+}
+
+template <typename F>
+static double MBps(size_t bytes, int rounds, F f) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) f();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<double>(bytes) * rounds / secs / (1024.0 * 1024.0);
+}
+
+// the loops ParseElement ran before the kernels: one character per step
+static size_t NaiveTextBreak(const wchar_t* s, size_t index, size_t length) {
+    while (length > index && s[index] != L'<' && s[index] != L'\r' && s[index] != L'\n' && s[index] != L'\t') index++;
+    return index;
+}
+
+static size_t NaiveSkipUntil(const wchar_t* s, size_t index, size_t length, const wchar_t* data) {
+    while (length > index) {
+        if (wcsncmp(s + index, data, wcslen(data)) == 0) return index + wcslen(data);
+        index++;
+    }
+    return index;
+}
+
+static volatile size_t sink;
+
+static void Report(const char* name, const std::wstring& page) {
+    const wchar_t* s = page.data();
+    size_t n = page.size();
+    size_t bytes = n * sizeof(wchar_t);
+    int rounds = 20;
+
+    double naiveText = MBps(bytes, rounds, [&]() {
+        size_t i = 0, hits = 0;
+        while (i < n) { i = NaiveTextBreak(s, i, n) + 1; hits++; }
+        sink = hits;
+    });
+    double kernelText = MBps(bytes, rounds, [&]() {
+        size_t i = 0, hits = 0;
+        while (i < n) { i = HtmlScanner::FindTextBreak(s, i, n) + 1; hits++; }
+        sink = hits;
+    });
+    double naiveClose = MBps(bytes, rounds, [&]() {
+        size_t i = 0, hits = 0;
+        while (i < n) { i = NaiveSkipUntil(s, i, n, L"</script>"); hits++; }
+        sink = hits;
+    });
+    double kernelClose = MBps(bytes, rounds, [&]() {
+        size_t i = 0, hits = 0;
+        while (i < n) { i = HtmlScanner::FindCloseTag(s, i, n, L"script") + 9; hits++; }
+        sink = hits;
+    });
+
+    std::string utf8 = WideToUtf8(page);
+    HtmlParser parser;
+    double parseWide = MBps(bytes, 5, [&]() { sink = parser.Parse(page)->GetRoot() ? 1 : 0; });
+    double parseUtf8 = MBps(utf8.size(), 5, [&]() { sink = parser.Parse(utf8)->GetRoot() ? 1 : 0; });
+
+    std::printf("%-12s text-break %8.1f -> %8.1f MB/s   close-tag %8.1f -> %8.1f MB/s   parse wide %7.1f MB/s utf8 %7.1f MB/s\n",
+        name, naiveText, kernelText, naiveClose, kernelClose, parseWide, parseUtf8);
+}
+
+int main() {
+#if defined(HTMLPARSER_AVX2)
+    std::printf("kernels: AVX2\n");
+#elif defined(HTMLPARSER_SSE2)
+    std::printf("kernels: SSE2\n");
+#else
+    std::printf("kernels: scalar\n");
+#endif
+    Report("text-heavy", TextHeavyPage(4 << 20));
+    Report("script-heavy", ScriptHeavyPage(4 << 20));
+    return 0;
+}
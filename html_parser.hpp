@@ -28,6 +28,51 @@
 #include <sstream>     // std::wistringstream, std::wostringstream
 #include <cwctype>     // std::towlower
 #include <cwchar>      // wcsncmp, wcslen
+#include <cstdint>     // uintptr_t
+#include <type_traits> // std::is_same
+#include <list>
+#include <iterator>    // HtmlAttributes::const_iterator, HtmlRange
+#include <unordered_map>
+#include <mutex>       // CompiledRuleCache
+#include <thread>      // HtmlParser::SetThreads
+#include <deque>       // HtmlThreadPool
+#include <functional>
+#include <condition_variable>
+#include <atomic>
+#include <future>      // HtmlParser::ParseAsync
+#include <exception>
+#if defined(HTMLPARSER_STATS)
+#include <chrono>      // ParseStats
+#endif
+
+// SIMD scanning kernels; define HTMLPARSER_NO_SIMD to force the scalar ones
+#if !defined(HTMLPARSER_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HTMLPARSER_AVX2 1
+#define HTMLPARSER_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HTMLPARSER_SSE2 1
+#endif
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// HtmlParser::ParseFile maps the file; define HTMLPARSER_NO_MMAP to read it instead
+#if !defined(HTMLPARSER_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HTMLPARSER_MMAP 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>    // HtmlFdSink
+#include <cerrno>
+#define HTMLPARSER_POSIX 1
+#endif
 
 using std::enable_shared_from_this;
 using std::shared_ptr;
@@ -43,6 +88,10 @@ inline static bool EqualIgnoreCase(const std::wstring& a, const std::wstring& b)
 inline static bool StartsWith(const std::wstring& s, const std::wstring& prefix);
 inline static bool EndsWith(const std::wstring& s, const std::wstring& suffix);
 inline std::wstring Trim(const std::wstring& str);
+class HtmlAttributes;
+inline bool AttrContains(const HtmlAttributes& attrs, const std::wstring& name, const std::wstring& substring);
+inline bool AttrStartsWith(const HtmlAttributes& attrs, const std::wstring& name, const std::wstring& prefix);
+inline bool AttrEndsWith(const HtmlAttributes& attrs, const std::wstring& name, const std::wstring& suffix);
 inline bool AttrContains(const std::map<std::wstring, std::wstring>& attrs, const std::wstring& name, const std::wstring& substring);
 inline bool AttrStartsWith(const std::map<std::wstring, std::wstring>& attrs, const std::wstring& name, const std::wstring& prefix);
 inline bool AttrEndsWith(const std::map<std::wstring, std::wstring>& attrs, const std::wstring& name, const std::wstring& suffix);
@@ -50,1053 +99,6874 @@ inline bool ClassStartsWith(const std::vector<std::wstring>& classlist, const st
 inline bool ClassEndsWith(const std::vector<std::wstring>& classlist, const std::wstring& suffix);
 inline bool ClassContains(const std::vector<std::wstring>& classlist, const std::wstring& contains);
 inline std::wstring ClearQuotes(std::wstring val);
+inline void AppendChars(std::wstring& out, const wchar_t* data, size_t len);
+inline void AppendChars(std::wstring& out, const char* data, size_t len);
+inline std::wstring Utf8ToWide(const std::string& str);
+inline std::string WideToUtf8(const std::wstring& str);
+inline size_t EncodeUtf8(const wchar_t* data, size_t len, size_t& i, char* out);
+inline size_t Utf8Length(const wchar_t* data, size_t len);
 
 
 /**
- * class HtmlElement
- * HTML Element struct
+ * class HtmlScanner
+ * scanning kernels used by the tokenizer hot loops. each Find* returns the
+ * first position in [index, length) holding one of the wanted characters,
+ * or length when there is none. works on char (UTF-8) and wchar_t input,
+ * 16/32 characters at a time with SSE2/AVX2, scalar otherwise.
  */
-class HtmlElement : public enable_shared_from_this<HtmlElement> {
-public:
-    friend class HtmlParser;
-
-    friend class HtmlDocument;
-
+class HtmlScanner {
 public:
     /**
-     * for children traversals.
+     * next character that ends a text run: '<', '\r', '\n' or '\t'
      */
-    typedef std::vector<shared_ptr<HtmlElement>>::const_iterator ChildIterator;
+    template <typename CharT>
+    static size_t FindTextBreak(const CharT* s, size_t index, size_t length) {
+        static const CharT set[] = { '<', '\r', '\n', '\t' };
+        return FindAny<4>(s, index, length, set);
+    }
 
-    ChildIterator ChildBegin() const { return children.cbegin(); }
-    ChildIterator ChildEnd()   const { return children.cend(); }
+    template <typename CharT>
+    static size_t Find(const CharT* s, size_t index, size_t length, CharT c) {
+        const CharT set[] = { c };
+        return FindAny<1>(s, index, length, set);
+    }
 
     /**
-     * for attribute traversals.
+     * first occurrence of the sequence data[0, n)
      */
-    typedef std::map<std::wstring, std::wstring>::const_iterator AttributeIterator;
-
-    AttributeIterator AttributeBegin() const { return attribute.cbegin(); }
-    AttributeIterator AttributeEnd()   const { return attribute.cend(); }
-
-public:
-
-    HtmlElement() {}
-
-    HtmlElement(shared_ptr<HtmlElement> p)
-        : parent(p) {
-    }
-
-    std::wstring GetAttribute(const std::wstring& k) {
-        if (attribute.find(k) != attribute.end()) {
-            return attribute[k];
+    template <typename CharT>
+    static size_t Find(const CharT* s, size_t index, size_t length, const CharT* data, size_t n) {
+        while (length > index && length - index >= n) {
+            index = Find(s, index, length - n + 1, data[0]);
+            if (length - n < index) break;
+            size_t i = 1;
+            while (i < n && s[index + i] == data[i]) i++;
+            if (i == n) return index;
+            index++;
         }
-        return L"";
+        return length;
     }
 
-    void SetAttribute(const std::wstring& j, const std::wstring& k) {
-        if (k.empty()) {
-            attribute.erase(j);
-            if (j == L"class") classlist.clear();
-        }
-        else {
-            attribute[j] = k;
-            if (j == L"class") {
-                classlist.clear();
-                std::wistringstream iss(k);
-                std::wstring token;
-                while (iss >> token) {
-                    classlist.push_back(token);
+    /**
+     * position of the '<' of a raw text close tag "</name>", name compared
+     * ignoring ASCII case. name must be lower case.
+     */
+    template <typename CharT>
+    static size_t FindCloseTag(const CharT* s, size_t index, size_t length, const std::wstring& name) {
+        size_t n = name.size() + 3;
+        while (length > index && length - index >= n) {
+            index = Find(s, index, length - n + 1, CharT('<'));
+            if (length - n < index) break;
+            if (s[index + 1] == '/' && s[index + n - 1] == '>') {
+                size_t i = 0;
+                for (; i < name.size(); i++) {
+                    CharT c = s[index + 2 + i];
+                    if (c >= 'A' && c <= 'Z') c = static_cast<CharT>(c + ('a' - 'A'));
+                    if (static_cast<wchar_t>(c) != name[i]) break;
                 }
+                if (i == name.size()) return index;
             }
+            index++;
         }
+        return length;
     }
 
-
-    std::map<std::wstring, std::wstring> GetAttributes() {
-
-        return attribute;
+    template <int N, typename CharT>
+    static size_t FindAny(const CharT* s, size_t index, size_t length, const CharT (&set)[N]) {
+#if defined(HTMLPARSER_AVX2)
+        index = FindAnyAvx2<N>(s, index, length, set);
+#elif defined(HTMLPARSER_SSE2)
+        index = FindAnySse2<N>(s, index, length, set);
+#endif
+        return FindAnyScalar<N>(s, index, length, set);
     }
 
-    shared_ptr<HtmlElement> GetElementById(const std::wstring& id)
-    {
-        for (HtmlElement::ChildIterator it = children.begin(); it != children.end(); ++it) {
-            std::wstring gid = (*it)->GetAttribute(L"id");
-            if ((*it)->GetAttribute(L"id") == id)
-            {
-                return *it;
+    template <int N, typename CharT>
+    static size_t FindAnyScalar(const CharT* s, size_t index, size_t length, const CharT (&set)[N]) {
+        for (; index < length; index++) {
+            for (int k = 0; k < N; k++) {
+                if (s[index] == set[k]) return index;
             }
-            shared_ptr<HtmlElement> r = (*it)->GetElementById(id);
-
-            if (r) return r;
         }
-
-        return shared_ptr<HtmlElement>();
+        return length;
     }
 
-    std::vector<shared_ptr<HtmlElement> > GetElementsById(const std::wstring& id) {
-        std::vector<shared_ptr<HtmlElement> > result;
-        GetElementsById(id, result);
-        return result;
+private:
+    static unsigned FirstBit(unsigned mask) {
+#if defined(_MSC_VER)
+        unsigned long i;
+        _BitScanForward(&i, mask);
+        return static_cast<unsigned>(i);
+#else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
     }
 
-
-    std::vector<shared_ptr<HtmlElement> > GetElementsByClassName(const std::wstring& name, const std::wstring& tag = L"") {
-        std::vector<shared_ptr<HtmlElement> > result;
-        GetElementsByClassName(name, tag, result);
-        return result;
+#if defined(HTMLPARSER_SSE2)
+    static __m128i Splat(char c) { return _mm_set1_epi8(c); }
+    static __m128i Splat(wchar_t c) {
+        return sizeof(wchar_t) == 2 ? _mm_set1_epi16(static_cast<short>(c)) : _mm_set1_epi32(static_cast<int>(c));
+    }
+    static __m128i Equal(__m128i a, __m128i b, char) { return _mm_cmpeq_epi8(a, b); }
+    static __m128i Equal(__m128i a, __m128i b, wchar_t) {
+        return sizeof(wchar_t) == 2 ? _mm_cmpeq_epi16(a, b) : _mm_cmpeq_epi32(a, b);
     }
 
-    // Inside HtmlElement class (public:)
-    std::vector<std::wstring> GetClassList() const {
-        return classlist;
+    // stops at the first hit, or at the last full 16 byte block
+    template <int N, typename CharT>
+    static size_t FindAnySse2(const CharT* s, size_t index, size_t length, const CharT (&set)[N]) {
+        const size_t lanes = 16 / sizeof(CharT);
+        __m128i needle[N];
+        for (int k = 0; k < N; k++) needle[k] = Splat(set[k]);
+        while (length > index && length - index >= lanes) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + index));
+            __m128i hit = Equal(block, needle[0], CharT());
+            for (int k = 1; k < N; k++) hit = _mm_or_si128(hit, Equal(block, needle[k], CharT()));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+            if (mask != 0) return index + FirstBit(mask) / sizeof(CharT);
+            index += lanes;
+        }
+        return index;
     }
+#endif
 
-    bool HasClass(const std::wstring& cls) const {
-        return std::find(classlist.begin(), classlist.end(), cls) != classlist.end();
+#if defined(HTMLPARSER_AVX2)
+    static __m256i Splat256(char c) { return _mm256_set1_epi8(c); }
+    static __m256i Splat256(wchar_t c) {
+        return sizeof(wchar_t) == 2 ? _mm256_set1_epi16(static_cast<short>(c)) : _mm256_set1_epi32(static_cast<int>(c));
+    }
+    static __m256i Equal256(__m256i a, __m256i b, char) { return _mm256_cmpeq_epi8(a, b); }
+    static __m256i Equal256(__m256i a, __m256i b, wchar_t) {
+        return sizeof(wchar_t) == 2 ? _mm256_cmpeq_epi16(a, b) : _mm256_cmpeq_epi32(a, b);
     }
 
-    void AddClass(const std::wstring& cls) {
-        if (!HasClass(cls)) {
-            classlist.push_back(cls);
-            UpdateClassAttribute();
+    template <int N, typename CharT>
+    static size_t FindAnyAvx2(const CharT* s, size_t index, size_t length, const CharT (&set)[N]) {
+        const size_t lanes = 32 / sizeof(CharT);
+        __m256i needle[N];
+        for (int k = 0; k < N; k++) needle[k] = Splat256(set[k]);
+        while (length > index && length - index >= lanes) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + index));
+            __m256i hit = Equal256(block, needle[0], CharT());
+            for (int k = 1; k < N; k++) hit = _mm256_or_si256(hit, Equal256(block, needle[k], CharT()));
+            unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+            if (mask != 0) return index + FirstBit(mask) / sizeof(CharT);
+            index += lanes;
         }
+        return FindAnySse2<N>(s, index, length, set);
     }
+#endif
+};
 
-    void RemoveClass(const std::wstring& cls) {
-        auto it = std::remove(classlist.begin(), classlist.end(), cls);
-        if (it != classlist.end()) {
-            classlist.erase(it, classlist.end());
-            UpdateClassAttribute();
+
+/**
+ * class HtmlSource
+ * input buffer of a document parsed in zero-copy mode. nodes keep
+ * offset/length views into it and only build their strings when first
+ * asked for them. the buffer is either copied once or borrowed from the
+ * caller, who then has to keep it alive as long as any node.
+ */
+class HtmlSource {
+public:
+    HtmlSource(const wchar_t* data, size_t len, bool borrow)
+        : wdata_(data), cdata_(nullptr), length_(len) {
+        if (!borrow) {
+            wide_.assign(data, len);
+            wdata_ = wide_.data();
         }
     }
 
-    void ToggleClass(const std::wstring& cls) {
-        if (HasClass(cls))
-            RemoveClass(cls);
-        else
-            AddClass(cls);
+    HtmlSource(const char* data, size_t len, bool borrow)
+        : wdata_(nullptr), cdata_(data), length_(len) {
+        if (!borrow) {
+            utf8_.assign(data, len);
+            cdata_ = utf8_.data();
+        }
     }
 
-    void ClearClasses() {
-        classlist.clear();
-        attribute.erase(L"class");
+    bool IsWide() const { return wdata_ != nullptr; }
+    size_t Length() const { return length_; }
+
+    /**
+     * keep the storage of a borrowed buffer (e.g. an HtmlFileMapping)
+     * alive as long as the source
+     */
+    void Hold(const shared_ptr<void>& owner) {
+        owner_ = owner;
     }
 
+    template <typename CharT>
+    const CharT* Data() const;
 
-    std::vector<shared_ptr<HtmlElement> > GetElementByTagName(const std::wstring& name) {
-        std::vector<shared_ptr<HtmlElement> > result;
-        GetElementByTagName(name, result);
-        return result;
-    }
- 
-    bool IsLowerAlphaNumeric(const std::wstring& str) {
-        for (wchar_t c : str) {
-            if (!((c >= L'a' && c <= L'z') || (c >= L'0' && c <= L'9')))
-                return false;
-        }
-        return true;
+    /**
+     * append [offset, offset + len) to out, decoding UTF-8 input.
+     * with dropBreaks CR, LF and tab are left out, as the tokenizer
+     * does for text runs.
+     */
+    void Append(std::wstring& out, size_t offset, size_t len, bool dropBreaks) const {
+        if (wdata_) Append(out, wdata_, offset, offset + len, dropBreaks);
+        else Append(out, cdata_, offset, offset + len, dropBreaks);
     }
 
-    bool IsLowerAlphaOnly(const std::wstring& str) {
-        for (wchar_t ch : str) {
-            if (ch < L'a' || ch > L'z')
-                return false;
+private:
+    HtmlSource(const HtmlSource&);
+    HtmlSource& operator=(const HtmlSource&);
+
+    template <typename CharT>
+    static void Append(std::wstring& out, const CharT* s, size_t index, size_t end, bool dropBreaks) {
+        static const CharT breaks[] = { '\r', '\n', '\t' };
+        while (index < end) {
+            size_t stop = dropBreaks ? HtmlScanner::FindAny<3>(s, index, end, breaks) : end;
+            AppendChars(out, s + index, stop - index);
+            index = stop + 1;
         }
-        return !str.empty(); // optional: false if empty
     }
 
-    // --- Entry Point ---
-    void SelectElement(const std::wstring& rule,
-        std::vector<std::shared_ptr<HtmlElement>>& result) {
-        std::vector<std::wstring> ruleTokens = TokenizeXPath(rule);
-      
-       //***************************************************************************
-       //If you need to debug. Uncomment below for a display of tokens.
-       // std::wstring list = L""; for (size_t i = 0; i < ruleTokens.size(); i++)   { list += ruleTokens[i] + L"\n"; if (i == ruleTokens.size() - 1)  myMsg(L"tokens: " + std::to_wstring(ruleTokens.size()), list);   }
-       //***************************************************************************
-       
-        // Enforce rigid structure
-        if (ruleTokens.size() >= 2) ruleTokens[1] = toLower(ruleTokens[1]);
-        if (ruleTokens[0] != L"/" && ruleTokens[0] != L"//") return;
-        if (ruleTokens[1] != L"*" && !IsLowerAlphaNumeric(ruleTokens[1])) return;
-        if (ruleTokens.size() >= 3 && ruleTokens[2] != L"[") return;
-        if (ruleTokens.size() >= 3 && ruleTokens[2] == L"[" && ruleTokens.back() != L"]") return;
-        if (ruleTokens.size() >= 4) ruleTokens[3] = toLower(ruleTokens[3]);
-        if (ruleTokens.size() >= 4 && ruleTokens[3] != L"!" &&
-            ruleTokens[3] != L"@" &&
-            ruleTokens[3] != L"contains" &&
-            ruleTokens[3] != L"text" &&
-            ruleTokens[3] != L"starts-with" &&
-            ruleTokens[3] != L"ends-with") return;
-        this->SelectElement(ruleTokens, 0, result);
-    }
-
-    
-    // --- Recursive selector ---
-    bool SelectElement(const std::vector<std::wstring>& tokens,
-        size_t idx,
-        std::vector<std::shared_ptr<HtmlElement>>& results)
-    {
-        if (idx >= tokens.size()) return false;
-        bool matched = false;
-        const std::wstring& tok = tokens[idx];
-
-        // "/" direct child
-        if (tok == L"/") {
-            for (auto& c : children)
-                matched |= c->SelectElement(tokens, idx + 1, results);
-            return matched;
-        }
-
+    std::wstring wide_;
+    std::string utf8_;
+    const wchar_t* wdata_;
+    const char* cdata_;
+    size_t length_;
+    shared_ptr<void> owner_;
+};
 
-        // "//" descendant-or-self
-        if (tok == L"//") {
-            for (auto& c : children) {
-                matched |= c->SelectElement(tokens, idx + 1, results); // next token
-                matched |= c->SelectElement(tokens, idx, results);     // keep descending
+/**
+ * class HtmlFileMapping
+ * a file mapped read-only, with a sequential access hint, for
+ * HtmlParser::ParseFile. where mmap is not available (or with
+ * HTMLPARSER_NO_MMAP) the file is read into memory instead.
+ */
+class HtmlFileMapping {
+public:
+    explicit HtmlFileMapping(const std::string& path)
+        : data_(nullptr), size_(0), mapped_(false), open_(false) {
+#if defined(HTMLPARSER_MMAP)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && static_cast<unsigned long long>(st.st_size) <= static_cast<size_t>(-1)) {
+            size_ = static_cast<size_t>(st.st_size);
+            open_ = true;
+            if (size_ > 0) {
+                void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ::madvise(p, size_, MADV_SEQUENTIAL);
+                    data_ = static_cast<const char*>(p);
+                    mapped_ = true;
+                }
+                else {
+                    open_ = false;
+                }
             }
-            return matched;
         }
+        ::close(fd);
+#else
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) return;
+        char chunk[64 * 1024];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            buffer_.append(chunk, n);
+        }
+        open_ = !ferror(f);
+        fclose(f);
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
 
-        // Match tag or "*"
-        if (tok == L"*" || EqualIgnoreCase(this->name, tok)) {
-            size_t nextIdx = idx + 1;
-           
-            if (nextIdx < tokens.size() && tokens[nextIdx] == L"[") {
-                size_t closeIdx = tokens.size() - 1; // rigid: last token must be "]"
-
-                std::wstring condType = tokens[3]; // rigid structure: token 3
+    ~HtmlFileMapping() {
+#if defined(HTMLPARSER_MMAP)
+        if (mapped_) ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
 
-                bool condMatched = false;
+    bool IsOpen() const { return open_; }
+    const char* Data() const { return data_; }
+    size_t Size() const { return size_; }
 
-                if (condType == L"@") {
-                    if (tokens[5] == L"=") {
-                        std::wstring name = tokens[4];
-                        std::wstring val = tokens[6];
-                        val = ClearQuotes(val);
+private:
+    HtmlFileMapping(const HtmlFileMapping&);
+    HtmlFileMapping& operator=(const HtmlFileMapping&);
+
+    const char* data_;
+    size_t size_;
+    bool mapped_;
+    bool open_;
+    std::string buffer_;
+};
 
-                        auto it = attribute.find(name);
-                        if (it != attribute.end()) {
-                            if (name == L"class") {
-                                condMatched = HasClass(val);
-                            }
-                            else {
-                                condMatched = (it->second == val);
-                            }
-                        }
-                    }
-                    else if (tokens[5] == L"]")
-                    {
-                        std::wstring name = tokens[4];
-                     
-                        auto it = attribute.find(name);
-                        if (it != attribute.end()) {
-                            condMatched = true;
-                        }
-                    }
-                }
-                else if (condType == L"text") 
-                {
-                    condMatched = false;
-                    if (tokens[6] == L",")
-                    {
-                        std::wstring name = Trim(tokens[5]);
-                        std::wstring val = Trim(tokens[7]);
-                        std::wstring text = this->text();
-                        val = ClearQuotes(val);
-                       // myMsg(name + L" - " + val, text);
-                        if (name == L"equals")
-                        {
-                            if (val == text)
-                                condMatched = true;
-                        }
-                        else if (name == L"contains")
-                        {
-                            if (text.find(val) != std::wstring::npos)
-                                condMatched = true;
-                        }
-                        else if (name == L"starts-with")
-                        {
-                            if (StartsWith(text, val))
-                                condMatched = true;
-                        }
-                        else if (name == L"ends-with")
-                        {
-                            if (EndsWith(text, val))
-                            {
-                                condMatched = true;
-                            }
-                        }
-                    }
-                }
-                else if (condType == L"contains") {
-                    if (tokens[7] == L",")
-                    {
-                        std::wstring name = Trim(tokens[6]); 
-                        std::wstring val = Trim(tokens[8]);
-                        val = ClearQuotes(val);
-                        if (name == L"class") {
-                            condMatched = ClassContains(classlist, val);   
-                        }
-                        else {
-                            condMatched = AttrContains(attribute, name, val);
-                        }
-                    }
-                }
-                else if (condType == L"starts-with") {
-                    if (tokens[7] == L",")
-                    {
-                        std::wstring name = Trim(tokens[6]);
-                        std::wstring val = Trim(tokens[8]);
-                        if (!val.empty() && val.front() == L'\'') val.erase(val.begin());
-                        if (!val.empty() && val.back() == L'\'') val.pop_back();
-
-                        if (name == L"class") {
-                           condMatched = ClassStartsWith(classlist, val);  
-                        }
-                        else {
-                            condMatched = AttrStartsWith(attribute, name, val);
-                        }
-                    }
-                }
-                else if (condType == L"ends-with") {
-                    if (tokens[7] == L",")
-                    {
-                        std::wstring name = Trim(tokens[6]);
-                        std::wstring val = Trim(tokens[8]);
-                        if (!val.empty() && val.front() == L'\'') val.erase(val.begin());
-                        if (!val.empty() && val.back() == L'\'') val.pop_back();
-
-                        if (name == L"class") {
-                            condMatched = ClassEndsWith(classlist, val);  
-                        }
-                        else {
-                            condMatched = AttrEndsWith(attribute, name, val);
-                        }
-                    }
-                }
+template <>
+inline const wchar_t* HtmlSource::Data<wchar_t>() const { return wdata_; }
 
-                if (!condMatched) return false;
+template <>
+inline const char* HtmlSource::Data<char>() const { return cdata_; }
 
-                // If this is the last token, push result
-                if (closeIdx == tokens.size() - 1) {
-                    results.push_back(shared_from_this());
-                    return true;
-                }
 
-                // Else continue recursion after ]
-                for (auto& c : children)
-                    matched |= c->SelectElement(tokens, closeIdx + 1, results);
-                return matched;
-            }
+/**
+ * class HtmlArena
+ * bump allocator that owns the storage of every node of one document.
+ * blocks are only released all at once, when the last node is gone.
+ */
+class HtmlArena {
+public:
+    explicit HtmlArena(size_t hint = 0)
+        : cur_(nullptr), left_(0), next_(hint < kMinBlock ? kMinBlock : (hint > kMaxBlock ? kMaxBlock : hint)), used_(0) {
+    }
 
-            // No condition, check end of tokens
-            if (nextIdx == tokens.size()) {
-                results.push_back(shared_from_this());
-                return true;
-            }
+    ~HtmlArena() {
+        retained_.clear();
+        for (size_t i = 0; i < blocks_.size(); i++) {
+            ::operator delete(blocks_[i]);
+        }
+    }
 
-            // Recurse to children
-            for (auto& c : children)
-                matched |= c->SelectElement(tokens, nextIdx, results);
-            return matched;
+    void* Allocate(size_t size, size_t align) {
+        size_t pad = (align - reinterpret_cast<uintptr_t>(cur_) % align) % align;
+        if (pad + size > left_) {
+            Grow(size + align);
+            pad = (align - reinterpret_cast<uintptr_t>(cur_) % align) % align;
         }
+        char* p = cur_ + pad;
+        cur_ = p + size;
+        left_ -= pad + size;
+        used_ += size;
+        return p;
+    }
 
-        return false;
+    template <typename T>
+    T* New() {
+        return new (Allocate(sizeof(T), alignof(T))) T();
     }
 
-    //********************************************************************************
+    /**
+     * keep an object the nodes point into (e.g. the zero-copy source)
+     * alive for as long as the arena
+     */
+    void Retain(const shared_ptr<void>& object) {
+        retained_.push_back(object);
+    }
 
-    shared_ptr<HtmlElement> GetParent() {
-        return parent.lock();
+    size_t BytesUsed() const { return used_; }
+    size_t BlockCount() const { return blocks_.size(); }
+
+private:
+    HtmlArena(const HtmlArena&);
+    HtmlArena& operator=(const HtmlArena&);
+
+    void Grow(size_t need) {
+        size_t size = next_ < need ? need : next_;
+        cur_ = static_cast<char*>(::operator new(size));
+        blocks_.push_back(cur_);
+        left_ = size;
+        if (next_ < kMaxBlock) next_ *= 2;
     }
 
-    shared_ptr<HtmlElement> GetSiblingNext() {
+    static const size_t kMinBlock = 16 * 1024;
+    static const size_t kMaxBlock = 16 * 1024 * 1024;
 
-        shared_ptr<HtmlElement> el = shared_from_this();
+    std::vector<char*> blocks_;
+    std::vector<shared_ptr<void> > retained_;
+    char* cur_;
+    size_t left_;
+    size_t next_;
+    size_t used_;
+};
 
-        if (el->GetParent()) {
-            auto& children = el->GetParent()->children;
+/**
+ * allocator handed to std::allocate_shared so that a node and its control
+ * block live in the arena. deallocate is a no-op; the arena stays alive as
+ * long as any node allocated from it.
+ */
+template <typename T>
+class HtmlArenaAllocator {
+public:
+    typedef T value_type;
 
-            auto it = std::find(children.begin(), children.end(), el);
+    explicit HtmlArenaAllocator(const shared_ptr<HtmlArena>& arena) : arena_(arena) {}
 
-            if (it != children.end()) {
-                if (it + 1 != children.end()) {
-                    auto nextSibling = *(it + 1);
-                    return nextSibling;
-                }
-            }
-        }
-        return nullptr;
-    }
+    template <typename U>
+    HtmlArenaAllocator(const HtmlArenaAllocator<U>& other) : arena_(other.arena_) {}
 
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+    }
 
-    std::vector<shared_ptr<HtmlElement>> GetChildren() {
+    void deallocate(T*, size_t) {}
 
-        return children;
+    template <typename U>
+    bool operator==(const HtmlArenaAllocator<U>& other) const { return arena_ == other.arena_; }
 
-    }
+    template <typename U>
+    bool operator!=(const HtmlArenaAllocator<U>& other) const { return arena_ != other.arena_; }
 
-    shared_ptr<HtmlElement> GetSiblingPrev() {
+private:
+    template <typename U> friend class HtmlArenaAllocator;
 
-        shared_ptr<HtmlElement> el = shared_from_this();
+    shared_ptr<HtmlArena> arena_;
+};
 
-        if (el->GetParent()) {
-            auto& children = el->GetParent()->children;
 
-            auto it = std::find(children.begin(), children.end(), el);
+/**
+ * struct HtmlDiagnostic
+ * a warning about the input: what was wrong and where
+ */
+struct HtmlDiagnostic {
+    enum Code {
+        UNEXPECTED_CLOSE_TAG,       // a close tag matching no open element, dropped
+        ELEMENT_NOT_CLOSED,         // closed by the close tag of an element around it
+        UNEXPECTED_ATTRIBUTE_CHAR,  // a quote where an attribute name was expected, dropped
+        CANNOT_READ_FILE,           // HtmlParser::ParseFile
+        CODE_COUNT
+    };
+
+    HtmlDiagnostic() : code(UNEXPECTED_CLOSE_TAG), offset(std::wstring::npos) {}
+
+    Code code;
+    size_t offset;      // in the input, in its characters (bytes for UTF-8); npos when unknown
+    std::wstring name;  // the tag, the character or the path
+    std::wstring open;  // UNEXPECTED_CLOSE_TAG: the element that was open
 
-            if (it != children.end()) {
-                if (it != children.begin()) {
-                    auto prevSibling = *(it - 1);
-                    return prevSibling;
-                }
-            }
+    /**
+     * the line the parser used to print to std::wcerr
+     */
+    std::wstring ToString() const {
+        switch (code) {
+        case UNEXPECTED_CLOSE_TAG: return L"WARN : unexpected closed element </" + name + L"> for <" + open + L">";
+        case ELEMENT_NOT_CLOSED: return L"WARN : element not closed <" + name + L">";
+        case UNEXPECTED_ATTRIBUTE_CHAR: return L"WARN : attribute unexpected " + name;
+        case CANNOT_READ_FILE: return L"WARN : cannot read file " + name;
+        default: return L"WARN : " + name;
         }
-        return nullptr;
     }
+};
 
+/**
+ * class HtmlDiagnosticSink
+ * receives the diagnostics of HtmlParser::SetDiagnostics. a parser
+ * shared between threads calls it from all of them
+ */
+class HtmlDiagnosticSink {
+public:
+    virtual ~HtmlDiagnosticSink() {}
 
+    virtual void OnDiagnostic(const HtmlDiagnostic& diagnostic) = 0;
+};
 
-    int SetInnerText(std::wstring text) {
-        auto el = shared_from_this();
+/**
+ * prints diagnostics to std::wcerr as the parser used to, without a
+ * flush per line
+ */
+class HtmlStderrDiagnostics : public HtmlDiagnosticSink {
+public:
+    void OnDiagnostic(const HtmlDiagnostic& diagnostic) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::wcerr << diagnostic.ToString() << L'\n';
+    }
 
-        if (el->children.empty()) {
-            // Create a text node if none exists
-            auto textNode = std::make_shared<HtmlElement>();
-            textNode->value = text;
-            el->children.push_back(textNode);
+private:
+    std::mutex mutex_;
+};
 
-        }
-        else {
-            el->children[0]->value = text;
-        }
+/**
+ * keeps diagnostics, at most limit of them
+ */
+class HtmlDiagnosticLog : public HtmlDiagnosticSink {
+public:
+    explicit HtmlDiagnosticLog(size_t limit = static_cast<size_t>(-1)) : limit_(limit), dropped_(0) {}
 
-        return 0;
+    void OnDiagnostic(const HtmlDiagnostic& diagnostic) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (diagnostics_.size() < limit_) diagnostics_.push_back(diagnostic);
+        else dropped_++;
     }
 
-    int SetInnerHTML(std::shared_ptr<HtmlElement> tempRoot) {
-        auto el = shared_from_this();
+    std::vector<HtmlDiagnostic> Get() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return diagnostics_;
+    }
 
-        // Clear current children
-        el->children.clear();
+    size_t Dropped() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+    }
 
-        // Append parsed children to our element
-        for (auto& child : tempRoot->GetChildren()) {
-            // Make a new HtmlElement with the same data but correct parent
-            child->parent = el;
-            el->children.push_back(child);
-        }
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        diagnostics_.clear();
+        dropped_ = 0;
+    }
 
-        return 0;
+private:
+    mutable std::mutex mutex_;
+    std::vector<HtmlDiagnostic> diagnostics_;
+    size_t limit_;
+    size_t dropped_;
+};
+
+/**
+ * class HtmlDiagnostics
+ * the diagnostics of one parse: every one is counted, the first limit of
+ * them go to the sink. with no sink nothing is built. a deferred one
+ * (parallel parsing fragment) keeps every one, by offset, for Merge
+ * instead; without a sink only its code and offset.
+ */
+class HtmlDiagnostics {
+public:
+    HtmlDiagnostics(HtmlDiagnosticSink* sink, size_t limit)
+        : sink_(sink), limit_(limit), delivered_(0), defer_(false), merged_(0) {
+        std::fill(counts_, counts_ + HtmlDiagnostic::CODE_COUNT, 0);
     }
 
+    void SetDeferred() {
+        defer_ = true;
+    }
 
-    const std::wstring& GetValue() {
-        if (value.empty() && children.size() == 1 && children[0]->GetName() == L"plain") {
-            return children[0]->GetValue();
+    void Report(HtmlDiagnostic::Code code, size_t offset, const std::wstring& name, const std::wstring& open = std::wstring()) {
+        counts_[code]++;
+        if (defer_) {
+            kept_.push_back(HtmlDiagnostic());
+            kept_.back().code = code;
+            kept_.back().offset = offset;
+            if (!sink_) return;
+            kept_.back().name = name;
+            kept_.back().open = open;
+            return;
         }
-
-        return value;
+        if (!sink_ || delivered_ >= limit_) return;
+        delivered_++;
+        HtmlDiagnostic diagnostic;
+        diagnostic.code = code;
+        diagnostic.offset = offset;
+        diagnostic.name = name;
+        diagnostic.open = open;
+        sink_->OnDiagnostic(diagnostic);
     }
 
+    /**
+     * take over what a deferred one reported in [from, to) of the input,
+     * as if reported here; ranges come in input order
+     */
+    void Merge(HtmlDiagnostics& other, size_t from, size_t to) {
+        for (; other.merged_ < other.kept_.size() && other.kept_[other.merged_].offset < to; other.merged_++) {
+            const HtmlDiagnostic& diagnostic = other.kept_[other.merged_];
+            if (diagnostic.offset < from) continue;
+            counts_[diagnostic.code]++;
+            if (defer_) kept_.push_back(diagnostic);
+            else if (sink_ && delivered_ < limit_) {
+                delivered_++;
+                sink_->OnDiagnostic(diagnostic);
+            }
+        }
+    }
+
+    size_t Count(HtmlDiagnostic::Code code) const {
+        return counts_[code];
+    }
+
+    const size_t* Counts() const {
+        return counts_;
+    }
+
+private:
+    HtmlDiagnosticSink* sink_;
+    size_t limit_;
+    size_t delivered_;
+    bool defer_;
+    size_t counts_[HtmlDiagnostic::CODE_COUNT];
+    std::vector<HtmlDiagnostic> kept_;
+    size_t merged_;     // kept_ before it went through Merge
+};
+
+/**
+ * split attribute text into key/value pairs
+ * @param attr text between the tag name and '>'
+ * @param emit called as emit(key, value) for each attribute in order
+ * @param diagnostics null: problems go unreported
+ * @param offset of the start tag, for diagnostics
+ */
+template <typename Callback>
+inline void ParseAttributeText(const std::wstring& attr, Callback emit,
+    HtmlDiagnostics* diagnostics = nullptr, size_t offset = std::wstring::npos) {
+    size_t index = 0;
+    std::wstring k;
+    std::wstring v;
+    wchar_t split = L' ';
+    bool quota = false;
+
+    enum ParseAttrState {
+        PARSE_ATTR_KEY,
+        PARSE_ATTR_VALUE_BEGIN,
+        PARSE_ATTR_VALUE_END,
+    };
+
+    ParseAttrState state = PARSE_ATTR_KEY;
+
+    while (attr.size() > index) {
+        wchar_t input = attr.at(index);
+        switch (state) {
+        case PARSE_ATTR_KEY: {
+            if (input == L'\t' || input == L'\r' || input == L'\n') {
+            }
+            else if (input == L'\'' || input == L'"') {
+                if (diagnostics) diagnostics->Report(HtmlDiagnostic::UNEXPECTED_ATTRIBUTE_CHAR, offset, std::wstring(1, input));
+            }
+            else if (input == L' ') {
+                if (!k.empty()) {
+                    emit(k, v);
+                    k.clear();
+                }
+            }
+            else if (input == L'=') {
+                state = PARSE_ATTR_VALUE_BEGIN;
+            }
+            else {
+                k.append(attr.c_str() + index, 1);
+            }
+        }
+                           break;
+
+        case PARSE_ATTR_VALUE_BEGIN: {
+            if (input == L'\t' || input == L'\r' || input == L'\n' || input == L' ') {
+                if (!k.empty()) {
+                    emit(k, v);
+                    k.clear();
+                }
+                state = PARSE_ATTR_KEY;
+            }
+            else if (input == L'\'' || input == L'"') {
+                split = input;
+                quota = true;
+                state = PARSE_ATTR_VALUE_END;
+            }
+            else {
+                v.append(attr.c_str() + index, 1);
+                quota = false;
+                state = PARSE_ATTR_VALUE_END;
+            }
+        }
+                                   break;
+
+        case PARSE_ATTR_VALUE_END: {
+            if ((quota && input == split) || (!quota && (input == L'\t' || input == L'\r' || input == L'\n' || input == L' '))) {
+                emit(k, v);
+                k.clear();
+                v.clear();
+                state = PARSE_ATTR_KEY;
+            }
+            else {
+                v.append(attr.c_str() + index, 1);
+            }
+        }
+                                 break;
+        }
+
+        index++;
+    }
+
+    if (!k.empty()) {
+        emit(k, v);
+    }
+}
+
+/**
+ * class HtmlAtom
+ * tag names as small integers, equal when the names are equal ignoring
+ * case. the HTML tags have fixed atoms, found through a perfect hash of
+ * the length and the first, second and last letters; any other name of
+ * up to kMaxInternedLength characters is interned the first time it is
+ * seen. longer names, and any once kMaxInterned names are interned, get
+ * OTHER and are compared as strings (Equal), so the table, which lives as
+ * long as the process, stays small. the void, raw text and text()
+ * separator flags of each tag are kept with its atom. lookups are safe
+ * from several threads.
+ */
+class HtmlAtom {
+public:
+    enum {
+        NONE = 0,       // no name: the document root, a bare text node
+        OTHER = 1,      // not interned, compare the names
+        PLAIN = 2,      // text node
+        KNOWN_FIRST = 2
+    };
+
+    enum Flag {
+        FLAG_VOID = 1,      // no content, no close tag: <br>, <img>, ...
+        FLAG_RAW = 2,       // content up to the close tag is text: <script>, ...
+        FLAG_NO_TEXT = 4,   // left out of text()
+        FLAG_TAB = 8,       // text() puts a tab before it
+        FLAG_LINE = 16      // text() puts a line break before it
+    };
+
+    static const uint32_t kMaxInterned = 1 << 16;
+    static const size_t kMaxInternedLength = 32;
+
+    /**
+     * @param name any case
+     */
+    static uint32_t Of(const std::wstring& name) {
+        return Of(name.data(), name.size());
+    }
+
+    template <typename CharT>
+    static uint32_t Of(const CharT* name, size_t len) {
+        if (len == 0) return NONE;
+        uint32_t known = Known(name, len);
+        return known != NONE ? known : Intern(name, len);
+    }
+
+    static unsigned Flags(uint32_t atom) {
+        return atom - KNOWN_FIRST < kKnownCount ? Table().flags[atom - KNOWN_FIRST] : 0;
+    }
+
+    static bool Is(uint32_t atom, Flag flag) {
+        return (Flags(atom) & flag) != 0;
+    }
+
+    /**
+     * whether two names are equal ignoring case, from their atoms
+     */
+    static bool Equal(uint32_t a, const std::wstring& aName, uint32_t b, const std::wstring& bName) {
+        return a == b && (a != OTHER || EqualIgnoreCase(aName, bName));
+    }
+
+private:
+    static const size_t kKnownCount = 121;
+    static const size_t kSeenSlots = 256;
+    static const uint32_t kHashMultiplier = 0x37af304f;   // no two known names share a slot
+    static const unsigned kHashBits = 10;
+
+    struct KnownTable {
+        const wchar_t* names[kKnownCount];
+        unsigned char lengths[kKnownCount];
+        unsigned char flags[kKnownCount];
+        unsigned char slots[1 << kHashBits];  // known index + 1, 0 for none
+        uint32_t multiplier;
+    };
+
+    static const KnownTable& Table() {
+        static const KnownTable table = BuildTable();
+        return table;
+    }
+
+    static KnownTable BuildTable() {
+        static const wchar_t* const names[kKnownCount] = {
+            L"plain", L"a", L"abbr", L"address", L"area", L"article", L"aside", L"audio", L"b", L"base",
+            L"bdi", L"bdo", L"blockquote", L"body", L"br", L"button", L"canvas", L"caption", L"center", L"cite",
+            L"code", L"col", L"colgroup", L"command", L"data", L"datalist", L"dd", L"del", L"details", L"dfn",
+            L"dialog", L"div", L"dl", L"dt", L"em", L"embed", L"fieldset", L"figcaption", L"figure", L"font",
+            L"footer", L"form", L"frame", L"frameset", L"h1", L"h2", L"h3", L"h4", L"h5", L"h6",
+            L"h7", L"head", L"header", L"hgroup", L"hr", L"html", L"i", L"iframe", L"img", L"input",
+            L"ins", L"kbd", L"keygen", L"label", L"legend", L"li", L"link", L"main", L"map", L"mark",
+            L"menu", L"meta", L"meter", L"nav", L"noscript", L"object", L"ol", L"optgroup", L"option", L"output",
+            L"p", L"param", L"picture", L"pre", L"progress", L"q", L"rp", L"rt", L"ruby", L"s",
+            L"samp", L"script", L"section", L"select", L"slot", L"small", L"source", L"span", L"strong", L"style",
+            L"sub", L"summary", L"sup", L"svg", L"table", L"tbody", L"td", L"template", L"textarea", L"tfoot",
+            L"th", L"thead", L"time", L"title", L"tr", L"track", L"u", L"ul", L"var", L"video",
+            L"wbr"
+        };
+        static const wchar_t* const voids[] = { L"br", L"hr", L"img", L"input", L"link", L"meta",
+            L"area", L"base", L"col", L"command", L"embed", L"keygen", L"param", L"source", L"track", L"wbr" };
+        static const wchar_t* const raws[] = { L"script", L"noscript", L"style" };
+        static const wchar_t* const noText[] = { L"head", L"meta", L"style", L"script", L"link" };
+        // h7 is no tag, text() has always broken the line before it
+        static const wchar_t* const lines[] = { L"tr", L"br", L"div", L"p", L"hr", L"area",
+            L"h1", L"h2", L"h3", L"h4", L"h5", L"h6", L"h7" };
+        static const wchar_t* const tabs[] = { L"td" };
+
+        KnownTable table;
+        std::memset(&table, 0, sizeof(table));
+        for (size_t i = 0; i < kKnownCount; i++) {
+            table.names[i] = names[i];
+            table.lengths[i] = static_cast<unsigned char>(std::wcslen(names[i]));
+        }
+        // kHashMultiplier places every name on its own slot; should an edit
+        // of the names break that, the next odd multipliers are tried
+        // rather than letting a name silently take another's slot
+        table.multiplier = kHashMultiplier;
+        while (!PlaceNames(table)) {
+            table.multiplier += 2;
+        }
+        SetFlag(table, voids, sizeof(voids) / sizeof(voids[0]), FLAG_VOID);
+        SetFlag(table, raws, sizeof(raws) / sizeof(raws[0]), FLAG_RAW);
+        SetFlag(table, noText, sizeof(noText) / sizeof(noText[0]), FLAG_NO_TEXT);
+        SetFlag(table, lines, sizeof(lines) / sizeof(lines[0]), FLAG_LINE);
+        SetFlag(table, tabs, sizeof(tabs) / sizeof(tabs[0]), FLAG_TAB);
+        return table;
+    }
+
+    static bool PlaceNames(KnownTable& table) {
+        std::memset(table.slots, 0, sizeof(table.slots));
+        for (size_t i = 0; i < kKnownCount; i++) {
+            unsigned char& slot = table.slots[Slot(table.names[i], table.lengths[i], table.multiplier)];
+            if (slot != 0) return false;
+            slot = static_cast<unsigned char>(i + 1);
+        }
+        return true;
+    }
+
+    static void SetFlag(KnownTable& table, const wchar_t* const* names, size_t n, Flag flag) {
+        for (size_t i = 0; i < n; i++) {
+            size_t known = table.slots[Slot(names[i], std::wcslen(names[i]), table.multiplier)] - 1;
+            table.flags[known] |= flag;
+        }
+    }
+
+    template <typename CharT>
+    static uint32_t Fold(CharT c) {
+        uint32_t u = static_cast<uint32_t>(c);
+        return u >= 'A' && u <= 'Z' ? u + ('a' - 'A') : u;
+    }
+
+    template <typename CharT>
+    static size_t Slot(const CharT* name, size_t len, uint32_t multiplier) {
+        uint32_t key = static_cast<uint32_t>(len) | (Fold(name[0]) & 0xFF) << 8 |
+            (len > 1 ? Fold(name[1]) & 0xFF : 0) << 16 | (Fold(name[len - 1]) & 0xFF) << 24;
+        return static_cast<uint32_t>(key * multiplier) >> (32 - kHashBits);
+    }
+
+    template <typename CharT>
+    static uint32_t Known(const CharT* name, size_t len) {
+        if (len > 10) return NONE;
+        const KnownTable& table = Table();
+        size_t entry = table.slots[Slot(name, len, table.multiplier)];
+        if (entry == 0 || table.lengths[entry - 1] != len) return NONE;
+        const wchar_t* known = table.names[entry - 1];
+        for (size_t i = 0; i < len; i++) {
+            if (Fold(name[i]) != static_cast<uint32_t>(known[i])) return NONE;
+        }
+        return static_cast<uint32_t>(KNOWN_FIRST + entry - 1);
+    }
+
+    template <typename CharT>
+    static uint32_t Intern(const CharT* name, size_t len) {
+        if (len > kMaxInternedLength) return OTHER;
+
+        // folded as EqualIgnoreCase does
+        static thread_local std::wstring key;
+        key.clear();
+        AppendChars(key, name, len);
+        for (size_t i = 0; i < key.size(); i++) key[i] = static_cast<wchar_t>(std::towlower(key[i]));
+        uint32_t known = Known(key.data(), key.size());
+        if (known != NONE) return known;
+
+        // each thread keeps the last atoms it has seen, by hash, pointing
+        // at the names in the shared table; that is locked on a miss
+        struct Seen {
+            const std::wstring* name;
+            uint32_t atom;
+        };
+        static thread_local Seen seen[kSeenSlots];
+        Seen& slot = seen[std::hash<std::wstring>()(key) % kSeenSlots];
+        if (slot.name && *slot.name == key) return slot.atom;
+
+        static std::mutex mutex;
+        static std::unordered_map<std::wstring, uint32_t> interned;   // nodes never move
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<std::wstring, uint32_t>::const_iterator found = interned.find(key);
+        if (found == interned.end()) {
+            if (interned.size() == kMaxInterned) return OTHER;
+            uint32_t atom = static_cast<uint32_t>(KNOWN_FIRST + kKnownCount + interned.size());
+            found = interned.insert(std::make_pair(key, atom)).first;
+        }
+        slot.name = &found->first;
+        slot.atom = found->second;
+        return slot.atom;
+    }
+};
+
+/**
+ * class HtmlAttributes
+ * the attributes of one element in source order, in one flat array. keys
+ * of up to kMaxInternedLength characters are interned, so a key costs a
+ * pointer per element instead of a string; longer keys, and any once
+ * kMaxInterned keys are interned, are kept by the element itself. lookups
+ * scan the array comparing key lengths first, which for the usual zero to
+ * five attributes beats any tree or hash; past kIndexFrom a hash of key to
+ * position is kept beside it, so a tag with thousands of attributes still
+ * parses in linear time. setting an existing key changes its value in place.
+ */
+class HtmlAttributes {
+public:
+    static const size_t kMaxInterned = 1 << 16;
+    static const size_t kMaxInternedLength = 32;
+    static const size_t kIndexFrom = 16;
+
+    /**
+     * an attribute as iteration yields it, names as std::map's did
+     */
+    struct Attribute {
+        Attribute(const std::wstring& k, const std::wstring& v) : first(k), second(v) {}
+
+        const std::wstring& first;   // key
+        const std::wstring& second;  // value
+    };
+
+private:
+    class Entry {
+    public:
+        Entry(const std::wstring& k, const std::wstring& v) : key(Intern(k)), value(v), owned(!key) {
+            if (owned) key = new std::wstring(k);
+        }
+
+        Entry(const Entry& other) : key(other.key), value(other.value), owned(other.owned) {
+            if (owned) key = new std::wstring(*other.key);
+        }
+
+        Entry(Entry&& other) noexcept : key(other.key), value(std::move(other.value)), owned(other.owned) {
+            other.owned = false;
+        }
+
+        Entry& operator=(Entry other) noexcept {
+            std::swap(key, other.key);
+            value.swap(other.value);
+            std::swap(owned, other.owned);
+            return *this;
+        }
+
+        ~Entry() {
+            if (owned) delete key;
+        }
+
+        const std::wstring* key;
+        std::wstring value;
+        bool owned;     // key not interned
+    };
+
+    typedef std::vector<Entry> Entries;
+
+    // keys point at the entries' own, which never move
+    struct KeyHash {
+        size_t operator()(const std::wstring* key) const { return std::hash<std::wstring>()(*key); }
+    };
+    struct KeyEqual {
+        bool operator()(const std::wstring* a, const std::wstring* b) const { return *a == *b; }
+    };
+    typedef std::unordered_map<const std::wstring*, size_t, KeyHash, KeyEqual> Positions;
+
+    static const size_t npos = static_cast<size_t>(-1);
+
+public:
+    HtmlAttributes() {}
+
+    HtmlAttributes(const HtmlAttributes& other) : entries_(other.entries_) {
+        if (other.positions_) Index();
+    }
+
+    HtmlAttributes(HtmlAttributes&& other) noexcept : entries_(std::move(other.entries_)), positions_(std::move(other.positions_)) {}
+
+    HtmlAttributes& operator=(HtmlAttributes other) noexcept {
+        entries_.swap(other.entries_);
+        positions_.swap(other.positions_);
+        return *this;
+    }
+
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Attribute value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Attribute* pointer;
+        typedef Attribute reference;
+
+        struct Arrow {
+            Attribute attribute;
+            const Attribute* operator->() const { return &attribute; }
+        };
+
+        const_iterator() {}
+        explicit const_iterator(Entries::const_iterator it) : it_(it) {}
+
+        Attribute operator*() const { return Attribute(*it_->key, it_->value); }
+        Arrow operator->() const { Arrow arrow = { **this }; return arrow; }
+        const_iterator& operator++() { ++it_; return *this; }
+        const_iterator operator++(int) { const_iterator old(*this); ++it_; return old; }
+        bool operator==(const const_iterator& other) const { return it_ == other.it_; }
+        bool operator!=(const const_iterator& other) const { return it_ != other.it_; }
+
+    private:
+        Entries::const_iterator it_;
+    };
+
+    const_iterator begin() const { return const_iterator(entries_.begin()); }
+    const_iterator end() const { return const_iterator(entries_.end()); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    /**
+     * @return the value, null if there is no such key
+     */
+    const std::wstring* Find(const std::wstring& key) const {
+        size_t i = Position(key);
+        return i == npos ? nullptr : &entries_[i].value;
+    }
+
+    const std::wstring* FindIgnoreCase(const std::wstring& key) const {
+        for (size_t i = 0; i < entries_.size(); i++) {
+            if (EqualIgnoreCase(*entries_[i].key, key)) return &entries_[i].value;
+        }
+        return nullptr;
+    }
+
+    bool Has(const std::wstring& key) const {
+        return Find(key) != nullptr;
+    }
+
+    void Set(const std::wstring& key, const std::wstring& value) {
+        size_t i = Position(key);
+        if (i != npos) {
+            entries_[i].value = value;
+            return;
+        }
+        if (entries_.empty()) entries_.reserve(4);
+        entries_.push_back(Entry(key, value));
+        if (positions_) positions_->insert(std::make_pair(entries_.back().key, entries_.size() - 1));
+        else if (entries_.size() > kIndexFrom) Index();
+    }
+
+    void Erase(const std::wstring& key) {
+        size_t i = Position(key);
+        if (i == npos) return;
+        if (positions_) {
+            positions_->erase(entries_[i].key);
+            for (Positions::iterator it = positions_->begin(); it != positions_->end(); ++it) {
+                if (it->second > i) it->second--;
+            }
+        }
+        entries_.erase(entries_.begin() + i);
+        if (entries_.size() <= kIndexFrom) positions_.reset();
+    }
+
+    void Clear() {
+        entries_.clear();
+        positions_.reset();
+    }
+
+    std::map<std::wstring, std::wstring> ToMap() const {
+        std::map<std::wstring, std::wstring> map;
+        for (size_t i = 0; i < entries_.size(); i++) map[*entries_[i].key] = entries_[i].value;
+        return map;
+    }
+
+private:
+    // npos if there is no such key
+    size_t Position(const std::wstring& key) const {
+        if (positions_) {
+            Positions::const_iterator at = positions_->find(&key);
+            return at == positions_->end() ? npos : at->second;
+        }
+        for (size_t i = 0; i < entries_.size(); i++) {
+            const std::wstring& k = *entries_[i].key;
+            if (k.size() == key.size() && k == key) return i;
+        }
+        return npos;
+    }
+
+    // built eagerly, never from a const lookup, so reading one element
+    // from several threads stays safe
+    void Index() {
+        positions_.reset(new Positions());
+        positions_->reserve(entries_.size() * 2);
+        for (size_t i = 0; i < entries_.size(); i++) positions_->insert(std::make_pair(entries_[i].key, i));
+    }
+
+    // null for a long key and once the table is full
+    static const std::wstring* Intern(const std::wstring& key) {
+        if (key.size() > kMaxInternedLength) return nullptr;
+
+        // each thread keeps the last keys it has seen, by hash, pointing
+        // into the shared table; that is locked on a miss
+        static const size_t kSeenSlots = 256;
+        static thread_local const std::wstring* seen[kSeenSlots];
+        const std::wstring*& slot = seen[std::hash<std::wstring>()(key) % kSeenSlots];
+        if (slot && *slot == key) return slot;
+
+        static std::mutex mutex;
+        static std::unordered_set<std::wstring> interned;   // nodes never move
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_set<std::wstring>::const_iterator at = interned.find(key);
+        if (at == interned.end()) {
+            if (interned.size() == kMaxInterned) return nullptr;
+            at = interned.insert(key).first;
+        }
+        slot = &*at;
+        return slot;
+    }
+
+    Entries entries_;
+    std::unique_ptr<Positions> positions_;  // null up to kIndexFrom entries
+};
+
+class HtmlElement;
+
+template <typename Iterator> class HtmlRange;
+class HtmlChildIterator;
+class HtmlAncestorIterator;
+class HtmlDescendantIterator;
+class HtmlXPathIterator;
+
+/**
+ * class CompiledXPath
+ * an XPath rule parsed once into a program of steps: an axis ("/" or
+ * "//"), a node test (a tag name or "*") and any number of predicates,
+ * whose function, attribute name and unquoted literal are decided at
+ * compile time. evaluation is set at a time: each step makes one pass in
+ * document order over the subtree being searched, so it is linear in the
+ * tree size per step, and the result comes out in document order without
+ * duplicates. no tokens are compared and no strings built per node.
+ * First, Any, Count and Select instead match one node at a time, see
+ * HtmlXPathIterator, and stop at the match asked for.
+ * immutable once built, so one object can serve any number of threads;
+ * see CompiledXPathCache.
+ */
+class CompiledXPath {
+public:
+    friend class HtmlXPathIterator;
+
+    enum Axis {
+        AXIS_CHILD,             // "/", or a leading name: relative to the context
+        AXIS_DESCENDANT,        // "//"
+        AXIS_FOLLOWING_SIBLING, // "/following-sibling::"
+        AXIS_PRECEDING_SIBLING  // "/preceding-sibling::", results still in document order
+    };
+
+    enum Test {
+        TEST_ANY,        // "*"
+        TEST_NAME        // tag name, ignoring case
+    };
+
+    enum Predicate {
+        PRED_FALSE,            // not understood, never true
+        PRED_ATTR_EXISTS,      // [@a]
+        PRED_ATTR_EQUALS,      // [@a='v'], [@class='v'] tests one class
+        PRED_ATTR_CONTAINS,    // [contains(@a, 'v')]
+        PRED_ATTR_STARTS_WITH, // [starts-with(@a, 'v')]
+        PRED_ATTR_ENDS_WITH,   // [ends-with(@a, 'v')]
+        PRED_TEXT_EQUALS,      // [text(equals, 'v')]
+        PRED_TEXT_CONTAINS,    // [text(contains, 'v')]
+        PRED_TEXT_STARTS_WITH, // [text(starts-with, 'v')]
+        PRED_TEXT_ENDS_WITH    // [text(ends-with, 'v')]
+    };
+
+    struct Condition {
+        Condition() : predicate(PRED_FALSE), classTest(false) {}
+
+        Predicate predicate;
+        std::wstring key;       // attribute name
+        std::wstring literal;   // unquoted value
+        bool classTest;         // key is "class": test the class list
+    };
+
+    struct Step {
+        Step() : axis(AXIS_CHILD), test(TEST_ANY), atom(HtmlAtom::NONE) {}
+
+        Axis axis;
+        Test test;
+        std::wstring name;                  // TEST_NAME, lower case
+        uint32_t atom;                      // of name
+        std::vector<Condition> conditions;  // all must hold
+    };
+
+    explicit CompiledXPath(const std::wstring& rule)
+        : rule_(rule) {
+        Compile(TokenizeXPath(rule));
+    }
+
+    explicit CompiledXPath(const std::vector<std::wstring>& tokens) {
+        for (size_t i = 0; i < tokens.size(); i++) rule_ += tokens[i];
+        Compile(tokens);
+    }
+
+    const std::wstring& GetRule() const {
+        return rule_;
+    }
+
+    const std::vector<Step>& GetSteps() const {
+        return steps_;
+    }
+
+    /**
+     * the rule parsed: steps of an optional axis and a node test, each
+     * followed by bracketed predicates. an invalid rule selects nothing.
+     */
+    bool IsValid() const {
+        return !steps_.empty();
+    }
+
+    /**
+     * select relative to scope: "/x" are the x children of scope, "//x"
+     * its x descendants
+     * @param scope
+     * @param result matches are appended, in document order
+     * @return whether anything matched
+     */
+    bool Evaluate(HtmlElement& scope, std::vector<shared_ptr<HtmlElement>>& result) const;
+
+    /**
+     * @return the first match in document order, or null; the tree is
+     * walked only up to it
+     */
+    shared_ptr<HtmlElement> First(HtmlElement& scope) const;
+
+    /**
+     * First without making a shared_ptr
+     */
+    bool Any(HtmlElement& scope) const;
+
+    /**
+     * the number of matches, none of them collected
+     */
+    size_t Count(HtmlElement& scope) const;
+
+    /**
+     * the matches in document order, found as the range is walked; the
+     * rule and the tree must outlive it
+     */
+    HtmlRange<HtmlXPathIterator> Select(HtmlElement& scope) const;
+
+private:
+    void Compile(const std::vector<std::wstring>& tokens) {
+        if (!CompileSteps(tokens)) steps_.clear();
+    }
+
+    bool CompileSteps(const std::vector<std::wstring>& tokens) {
+        size_t n = tokens.size();
+        size_t i = 0;
+        while (i < n) {
+            Step step;
+            if (tokens[i] == L"/") {
+                i++;
+            }
+            else if (tokens[i] == L"//") {
+                step.axis = AXIS_DESCENDANT;
+                i++;
+            }
+            else if (!steps_.empty()) {
+                return false; // two node tests in a row
+            }
+            if (i >= n) return false;
+
+            if (i + 1 < n && tokens[i + 1] == L"::") {
+                std::wstring axis = toLower(tokens[i]);
+                if (axis == L"following-sibling" || axis == L"preceding-sibling") {
+                    if (step.axis != AXIS_CHILD) return false;
+                    step.axis = axis[0] == L'f' ? AXIS_FOLLOWING_SIBLING : AXIS_PRECEDING_SIBLING;
+                }
+                else if (axis != L"child") {
+                    return false;
+                }
+                i += 2;
+                if (i >= n) return false;
+            }
+
+            const std::wstring& tok = tokens[i++];
+            if (tok == L"/" || tok == L"//" || tok == L"[" || tok == L"]" || tok == L"::") return false;
+            if (tok != L"*") {
+                step.test = TEST_NAME;
+                step.name = toLower(tok);
+                step.atom = HtmlAtom::Of(step.name);
+            }
+
+            while (i < n && tokens[i] == L"[") {
+                size_t close = i + 1;
+                while (close < n && tokens[close] != L"]") close++;
+                if (close == n) return false;
+                step.conditions.push_back(CompileCondition(tokens, i, close));
+                i = close + 1;
+            }
+            steps_.push_back(step);
+        }
+        return true;
+    }
+
+    // tokens[open] is "[" and tokens[close] its "]"
+    static Condition CompileCondition(const std::vector<std::wstring>& tokens, size_t open, size_t close) {
+        Condition cond;
+        if (open + 1 >= close) return cond;
+
+        std::wstring fn = toLower(tokens[open + 1]);
+        if (fn == L"@") {
+            if (open + 3 > close) return cond;
+            cond.key = tokens[open + 2];
+            cond.classTest = cond.key == L"class";
+            if (open + 3 == close) {
+                cond.predicate = PRED_ATTR_EXISTS;
+            }
+            else if (tokens[open + 3] == L"=" && open + 4 < close) {
+                cond.predicate = PRED_ATTR_EQUALS;
+                cond.literal = ClearQuotes(tokens[open + 4]);
+            }
+        }
+        else if (fn == L"text") {
+            // text(equals, 'v')
+            if (open + 5 >= close || tokens[open + 4] != L",") return cond;
+            std::wstring how = Trim(tokens[open + 3]);
+            cond.literal = ClearQuotes(Trim(tokens[open + 5]));
+            if (how == L"equals") cond.predicate = PRED_TEXT_EQUALS;
+            else if (how == L"contains") cond.predicate = PRED_TEXT_CONTAINS;
+            else if (how == L"starts-with") cond.predicate = PRED_TEXT_STARTS_WITH;
+            else if (how == L"ends-with") cond.predicate = PRED_TEXT_ENDS_WITH;
+        }
+        else if (fn == L"contains" || fn == L"starts-with" || fn == L"ends-with") {
+            // contains(@a, 'v')
+            if (open + 6 >= close || tokens[open + 5] != L",") return cond;
+            cond.key = Trim(tokens[open + 4]);
+            cond.classTest = cond.key == L"class";
+            std::wstring val = Trim(tokens[open + 6]);
+            if (fn == L"contains") {
+                cond.predicate = PRED_ATTR_CONTAINS;
+                cond.literal = ClearQuotes(val);
+            }
+            else {
+                // only single quotes come off here
+                if (!val.empty() && val.front() == L'\'') val.erase(val.begin());
+                if (!val.empty() && val.back() == L'\'') val.pop_back();
+                cond.predicate = fn == L"starts-with" ? PRED_ATTR_STARTS_WITH : PRED_ATTR_ENDS_WITH;
+                cond.literal = val;
+            }
+        }
+        return cond;
+    }
+
+    // state of one pass: the context nodes of the step in document order,
+    // matched against the walk by position instead of by lookup
+    struct Pass {
+        const Step* step;
+        const std::vector<HtmlElement*>* context;
+        size_t next;
+        std::vector<HtmlElement*>* out;
+        std::wstring* text;
+    };
+
+    void Walk(HtmlElement& node, bool inContext, bool underContext, Pass& pass) const;
+
+    // first (following) or last (preceding) context child of each parent
+    typedef std::unordered_map<const HtmlElement*, size_t> Bounds;
+
+    void Siblings(HtmlElement& root, Pass& pass) const;
+
+    void WalkSiblings(HtmlElement& node, const Bounds& bounds, Pass& pass) const;
+
+    bool Match(HtmlElement& node, const Step& step, std::wstring& text) const;
+
+    static bool Test(HtmlElement& node, const Condition& cond, std::wstring& text);
+
+    std::wstring rule_;
+    std::vector<Step> steps_;
+};
+
+/**
+ * class CompiledSelector
+ * a CSS selector list parsed once. a selector is a chain of compounds
+ * (a type or "*", #id, .class, [a], [a=v], [a^=v], [a$=v], [a*=v],
+ * [a~=v], :nth-child(an+b), :first-child) joined by the descendant, ">",
+ * "+" and "~" combinators; a list is comma separated. matching runs right
+ * to left as in browser engines: each node below the scope is tried on
+ * the last compound, and only then are its ancestors and siblings checked
+ * leftwards, after a Bloom filter of the tags, ids and classes on the
+ * ancestor path has rejected chains that cannot match. classes are tested
+ * on the class list and attributes on the attribute map, no strings are
+ * built per node. immutable once built; see CompiledSelectorCache.
+ */
+class CompiledSelector {
+public:
+    enum Combinator {
+        COMB_NONE,        // the leftmost compound
+        COMB_DESCENDANT,  // "a b"
+        COMB_CHILD,       // "a > b"
+        COMB_ADJACENT,    // "a + b"
+        COMB_SIBLING      // "a ~ b"
+    };
+
+    enum AttrOp {
+        ATTR_EXISTS,      // [a]
+        ATTR_EQUALS,      // [a=v]
+        ATTR_PREFIX,      // [a^=v]
+        ATTR_SUFFIX,      // [a$=v]
+        ATTR_SUBSTRING,   // [a*=v]
+        ATTR_WORD         // [a~=v], v one of the space separated words
+    };
+
+    struct AttrTest {
+        AttrOp op;
+        std::wstring key;    // matched ignoring case when not found as is
+        std::wstring value;
+    };
+
+    struct Compound {
+        Compound() : combinator(COMB_NONE), atom(HtmlAtom::NONE) {}
+
+        Combinator combinator;                 // to the compound on the left
+        std::wstring name;                     // lower case, empty for "*"
+        uint32_t atom;                         // of name
+        std::wstring id;                       // a second #id is an AttrTest
+        std::vector<std::wstring> classes;
+        std::vector<AttrTest> attrs;
+        std::vector<std::pair<int, int>> nth;  // :nth-child(an+b) as (a, b)
+    };
+
+    struct Selector {
+        std::vector<Compound> compounds;       // left to right
+        std::vector<uint32_t> ancestorKeys;    // Bloom keys every match has above it
+    };
+
+    explicit CompiledSelector(const std::wstring& selector)
+        : selector_(selector), bloom_(false) {
+        if (!Compile()) selectors_.clear();
+        for (size_t i = 0; i < selectors_.size(); i++) {
+            if (!selectors_[i].ancestorKeys.empty()) bloom_ = true;
+        }
+    }
+
+    const std::wstring& GetSelector() const {
+        return selector_;
+    }
+
+    const std::vector<Selector>& GetSelectors() const {
+        return selectors_;
+    }
+
+    /**
+     * an invalid selector, or one using what is not supported, matches
+     * nothing
+     */
+    bool IsValid() const {
+        return !selectors_.empty();
+    }
+
+    /**
+     * the elements below scope matching any selector of the list.
+     * ancestors and siblings above scope may take part in the match.
+     * @param scope
+     * @param result matches are appended, in document order
+     * @return whether anything matched
+     */
+    bool Evaluate(HtmlElement& scope, std::vector<shared_ptr<HtmlElement>>& result) const;
+
+    /**
+     * @param scope
+     * @return the first match below scope in document order, or null
+     */
+    shared_ptr<HtmlElement> First(HtmlElement& scope) const;
+
+private:
+    bool Compile() {
+        const std::wstring& s = selector_;
+        size_t i = 0;
+        Selector sel;
+        Combinator pending = COMB_NONE;
+        for (;;) {
+            bool space = false;
+            while (i < s.size() && iswspace(s[i])) {
+                space = true;
+                i++;
+            }
+            if (i == s.size() || s[i] == L',') {
+                if (sel.compounds.empty() || pending != COMB_NONE) return false;
+                Finish(sel);
+                selectors_.push_back(sel);
+                sel = Selector();
+                if (i++ == s.size()) return true;
+                continue;
+            }
+
+            wchar_t c = s[i];
+            if (c == L'>' || c == L'+' || c == L'~') {
+                if (sel.compounds.empty() || pending != COMB_NONE) return false;
+                pending = c == L'>' ? COMB_CHILD : c == L'+' ? COMB_ADJACENT : COMB_SIBLING;
+                i++;
+                continue;
+            }
+            if (!sel.compounds.empty() && pending == COMB_NONE) {
+                if (!space) return false;
+                pending = COMB_DESCENDANT;
+            }
+
+            Compound compound;
+            if (!CompileCompound(s, i, compound)) return false;
+            compound.combinator = pending;
+            sel.compounds.push_back(compound);
+            pending = COMB_NONE;
+        }
+    }
+
+    static bool CompileCompound(const std::wstring& s, size_t& i, Compound& compound) {
+        bool any = false;
+        if (i < s.size() && s[i] == L'*') {
+            i++;
+            any = true;
+        }
+        else if (ReadIdent(s, i, compound.name)) {
+            compound.name = toLower(compound.name);
+            compound.atom = HtmlAtom::Of(compound.name);
+            any = true;
+        }
+
+        while (i < s.size()) {
+            wchar_t c = s[i];
+            if (c == L'#') {
+                std::wstring id;
+                if (!ReadIdent(s, ++i, id)) return false;
+                if (compound.id.empty()) {
+                    compound.id = id;
+                }
+                else {
+                    AttrTest test = { ATTR_EQUALS, L"id", id };
+                    compound.attrs.push_back(test);
+                }
+            }
+            else if (c == L'.') {
+                std::wstring cls;
+                if (!ReadIdent(s, ++i, cls)) return false;
+                compound.classes.push_back(cls);
+            }
+            else if (c == L'[') {
+                AttrTest test;
+                if (!CompileAttr(s, ++i, test)) return false;
+                compound.attrs.push_back(test);
+            }
+            else if (c == L':') {
+                std::wstring pseudo;
+                if (!ReadIdent(s, ++i, pseudo)) return false;
+                pseudo = toLower(pseudo);
+                if (pseudo == L"first-child") {
+                    compound.nth.push_back(std::make_pair(0, 1));
+                }
+                else if (pseudo == L"nth-child" && i < s.size() && s[i] == L'(') {
+                    size_t close = s.find(L')', i);
+                    if (close == std::wstring::npos) return false;
+                    std::pair<int, int> ab;
+                    if (!CompileNth(s.substr(i + 1, close - i - 1), ab)) return false;
+                    compound.nth.push_back(ab);
+                    i = close + 1;
+                }
+                else {
+                    return false;
+                }
+            }
+            else {
+                break;
+            }
+            any = true;
+        }
+        return any;
+    }
+
+    // s[i] follows the "["
+    static bool CompileAttr(const std::wstring& s, size_t& i, AttrTest& test) {
+        SkipSpace(s, i);
+        if (!ReadIdent(s, i, test.key)) return false;
+        SkipSpace(s, i);
+        if (i >= s.size()) return false;
+        if (s[i] == L']') {
+            test.op = ATTR_EXISTS;
+            i++;
+            return true;
+        }
+
+        switch (s[i]) {
+        case L'=': test.op = ATTR_EQUALS; break;
+        case L'^': test.op = ATTR_PREFIX; break;
+        case L'$': test.op = ATTR_SUFFIX; break;
+        case L'*': test.op = ATTR_SUBSTRING; break;
+        case L'~': test.op = ATTR_WORD; break;
+        default: return false;
+        }
+        if (test.op != ATTR_EQUALS && (++i >= s.size() || s[i] != L'=')) return false;
+        SkipSpace(s, ++i);
+        if (i >= s.size()) return false;
+
+        if (s[i] == L'"' || s[i] == L'\'') {
+            wchar_t quote = s[i++];
+            for (;;) {
+                if (i >= s.size()) return false;
+                if (s[i] == quote) break;
+                if (s[i] == L'\\' && i + 1 < s.size()) i++;
+                test.value += s[i++];
+            }
+            i++;
+        }
+        else if (!ReadIdent(s, i, test.value)) {
+            return false;
+        }
+        SkipSpace(s, i);
+        if (i >= s.size() || s[i] != L']') return false;
+        i++;
+        return true;
+    }
+
+    // "odd", "even", "b", "an", "an+b", spaces allowed around the sign
+    static bool CompileNth(const std::wstring& arg, std::pair<int, int>& ab) {
+        std::wstring t;
+        for (size_t i = 0; i < arg.size(); i++) {
+            if (!iswspace(arg[i])) t += static_cast<wchar_t>(std::towlower(arg[i]));
+        }
+        if (t == L"odd") {
+            ab = std::make_pair(2, 1);
+            return true;
+        }
+        if (t == L"even") {
+            ab = std::make_pair(2, 0);
+            return true;
+        }
+
+        size_t n = t.find(L'n');
+        if (n == std::wstring::npos) {
+            ab.first = 0;
+            return ReadInt(t, ab.second);
+        }
+        std::wstring a = t.substr(0, n);
+        std::wstring b = t.substr(n + 1);
+        if (a.empty() || a == L"+") ab.first = 1;
+        else if (a == L"-") ab.first = -1;
+        else if (!ReadInt(a, ab.first)) return false;
+        ab.second = 0;
+        if (b.empty()) return true;
+        return (b[0] == L'+' || b[0] == L'-') && ReadInt(b, ab.second);
+    }
+
+    static bool ReadInt(const std::wstring& t, int& value) {
+        size_t i = t.empty() || (t[0] != L'+' && t[0] != L'-') ? 0 : 1;
+        if (i >= t.size()) return false;
+        long v = 0;
+        for (; i < t.size(); i++) {
+            if (t[i] < L'0' || t[i] > L'9' || v > 100000000) return false;
+            v = v * 10 + (t[i] - L'0');
+        }
+        value = static_cast<int>(t[0] == L'-' ? -v : v);
+        return true;
+    }
+
+    // name characters, a backslash takes the next one as it is
+    static bool ReadIdent(const std::wstring& s, size_t& i, std::wstring& ident) {
+        size_t start = i;
+        while (i < s.size()) {
+            wchar_t c = s[i];
+            if (c == L'\\' && i + 1 < s.size()) {
+                ident += s[i + 1];
+                i += 2;
+            }
+            else if (iswalnum(c) || c == L'-' || c == L'_' || c >= 0x80) {
+                ident += c;
+                i++;
+            }
+            else {
+                break;
+            }
+        }
+        return i > start;
+    }
+
+    static void SkipSpace(const std::wstring& s, size_t& i) {
+        while (i < s.size() && iswspace(s[i])) i++;
+    }
+
+    // a compound left of " " or ">" must match an ancestor of every match,
+    // so its keys are on the ancestor path
+    static void Finish(Selector& sel) {
+        for (size_t k = 1; k < sel.compounds.size(); k++) {
+            Combinator comb = sel.compounds[k].combinator;
+            if (comb != COMB_DESCENDANT && comb != COMB_CHILD) continue;
+            const Compound& left = sel.compounds[k - 1];
+            if (!left.name.empty()) sel.ancestorKeys.push_back(Key(L'<', left.name.data(), left.name.size()));
+            if (!left.id.empty()) sel.ancestorKeys.push_back(Key(L'#', left.id.data(), left.id.size()));
+            for (size_t j = 0; j < left.classes.size(); j++) {
+                sel.ancestorKeys.push_back(Key(L'.', left.classes[j].data(), left.classes[j].size()));
+            }
+        }
+    }
+
+    // FNV-1a of kind and text; tags are hashed lower case
+    static uint32_t Key(wchar_t kind, const wchar_t* s, size_t n) {
+        uint32_t h = 2166136261u ^ static_cast<uint32_t>(kind);
+        for (size_t i = 0; i < n; i++) {
+            wchar_t c = kind == L'<' ? static_cast<wchar_t>(std::towlower(s[i])) : s[i];
+            h = (h ^ static_cast<uint32_t>(c)) * 16777619u;
+        }
+        return h;
+    }
+
+    /**
+     * counting Bloom filter of the keys on the ancestor path, two probes
+     * of 12 bits per key; a saturated counter stays set
+     */
+    struct Bloom {
+        enum { kBits = 12, kSize = 1 << kBits, kMask = kSize - 1 };
+
+        Bloom() {
+            memset(counts, 0, sizeof(counts));
+        }
+
+        void Add(uint32_t key) {
+            Bump(key & kMask, 1);
+            Bump((key >> kBits) & kMask, 1);
+        }
+
+        void Remove(uint32_t key) {
+            Bump(key & kMask, -1);
+            Bump((key >> kBits) & kMask, -1);
+        }
+
+        bool MayContain(uint32_t key) const {
+            return counts[key & kMask] && counts[(key >> kBits) & kMask];
+        }
+
+        void Bump(uint32_t slot, int delta) {
+            if (counts[slot] != 0xff) counts[slot] = static_cast<uint8_t>(counts[slot] + delta);
+        }
+
+        uint8_t counts[kSize];
+    };
+
+    // the path from the top of the tree down to the node being tried.
+    // an element is children[child] of the frame above it, position is
+    // its 1-based place among the element children (0 at the top)
+    struct Frame {
+        HtmlElement* node;
+        size_t child;
+        size_t position;
+        size_t keys;      // Bloom keys it added
+    };
+
+    struct Walk {
+        std::vector<shared_ptr<HtmlElement>> above;  // ancestors of the scope
+        std::vector<Frame> path;
+        std::vector<uint32_t> keys;
+        Bloom* bloom;
+        std::vector<shared_ptr<HtmlElement>>* out;
+        bool first;
+    };
+
+    void Run(HtmlElement& scope, Walk& walk) const;
+
+    bool Visit(HtmlElement& node, Walk& walk) const;
+
+    static void Push(HtmlElement& node, size_t child, size_t position, Walk& walk);
+
+    static void AddKeys(Walk& walk);
+
+    static void Pop(Walk& walk);
+
+    bool Matches(const Walk& walk) const;
+
+    static bool MatchLeft(const Selector& sel, size_t k, const Walk& walk, size_t depth, size_t child, size_t position);
+
+    static bool MatchCompound(const Compound& compound, HtmlElement& node, size_t position);
+
+    static bool MatchAttr(const AttrTest& test, HtmlElement& node);
+
+    static bool IsElement(const HtmlElement& node);
+
+    std::wstring selector_;
+    std::vector<Selector> selectors_;
+    bool bloom_;      // some selector has ancestor keys
+};
+
+/**
+ * class CompiledRuleCache
+ * compiled rules (CompiledXPath, CompiledSelector) by rule string, least
+ * recently used dropped first. safe to share between threads;
+ * SelectElement uses CompiledXPathCache::Global() and QuerySelector
+ * CompiledSelectorCache::Global().
+ */
+template <typename Compiled>
+class CompiledRuleCache {
+public:
+    explicit CompiledRuleCache(size_t capacity = 256) : capacity_(capacity) {}
+
+    /**
+     * the compiled form of rule, compiled now if not cached
+     * @param rule
+     * @return never null
+     */
+    shared_ptr<const Compiled> Get(const std::wstring& rule) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            typename Index::iterator it = index_.find(rule);
+            if (it != index_.end()) {
+                entries_.splice(entries_.begin(), entries_, it->second);
+                return it->second->second;
+            }
+        }
+
+        // compile outside the lock, a racing thread may do the same
+        shared_ptr<const Compiled> compiled = std::make_shared<Compiled>(rule);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        typename Index::iterator it = index_.find(rule);
+        if (it != index_.end()) {
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->second;
+        }
+        if (capacity_ == 0) return compiled;
+        entries_.push_front(Entry(rule, compiled));
+        index_[rule] = entries_.begin();
+        Trim();
+        return compiled;
+    }
+
+    void SetCapacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+        Trim();
+    }
+
+    size_t GetCapacity() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity_;
+    }
+
+    size_t Size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        index_.clear();
+    }
+
+    /**
+     * the process wide cache
+     */
+    static CompiledRuleCache& Global() {
+        static CompiledRuleCache cache;
+        return cache;
+    }
+
+private:
+    typedef std::pair<std::wstring, shared_ptr<const Compiled>> Entry;
+    typedef std::list<Entry> Entries;
+    typedef std::unordered_map<std::wstring, typename Entries::iterator> Index;
+
+    void Trim() {
+        while (entries_.size() > capacity_) {
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+
+    CompiledRuleCache(const CompiledRuleCache&);
+    CompiledRuleCache& operator=(const CompiledRuleCache&);
+
+    mutable std::mutex mutex_;
+    Entries entries_;
+    Index index_;
+    size_t capacity_;
+};
+
+typedef CompiledRuleCache<CompiledXPath> CompiledXPathCache;
+
+typedef CompiledRuleCache<CompiledSelector> CompiledSelectorCache;
+
+/**
+ * struct ParseStats
+ * what one parse did, see HtmlDocument::GetStats and HtmlParseHook. only
+ * filled in when HTMLPARSER_STATS is defined; without it the parser has
+ * no instrumentation at all. times are summed over the threads of a
+ * parallel parse, where warnings and raw text of a piece that is read
+ * again also count again.
+ */
+struct ParseStats {
+    size_t bytes;               // input consumed
+    size_t elements;            // element nodes in the tree
+    size_t text_nodes;
+    size_t attributes;          // zero-copy mode parses them on first use, not counted
+    size_t max_depth;           // children of the root are at 1
+    size_t raw_text_bytes;      // script, style, ... content
+    size_t recovered_tags;      // close tags taken as closing more than one element or none, elements left open
+    size_t allocations;         // heap blocks the tree holds: nodes, child and attribute arrays, strings past the small string buffer, arena blocks
+    double tokenize_seconds;
+    double attribute_seconds;   // HtmlElement::ParseAttributes
+    double build_seconds;       // the rest of building the tree
+    double total_seconds;       // start of the parse to the document, for a push parser including the time between chunks
+
+    ParseStats() {
+        Clear();
+    }
+
+    void Clear() {
+        bytes = elements = text_nodes = attributes = max_depth = 0;
+        raw_text_bytes = recovered_tags = allocations = 0;
+        tokenize_seconds = attribute_seconds = build_seconds = total_seconds = 0;
+    }
+};
+
+/**
+ * class HtmlParseHook
+ * gets the ParseStats of every document an HtmlParser builds (see
+ * HtmlParser::SetParseHook), on the thread that parsed it; a parser
+ * shared between threads calls it from all of them
+ */
+class HtmlParseHook {
+public:
+    virtual ~HtmlParseHook() {}
+
+    virtual void OnParsed(const ParseStats& stats) = 0;
+};
+
+#if defined(HTMLPARSER_STATS)
+/**
+ * adds the time until it goes out of scope to seconds
+ */
+class HtmlStatsTimer {
+public:
+    explicit HtmlStatsTimer(double& seconds)
+        : seconds_(seconds), start_(std::chrono::steady_clock::now()) {
+    }
+
+    ~HtmlStatsTimer() {
+        seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    double& seconds_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#define HTMLPARSER_STATS_TIME(seconds) HtmlStatsTimer statsTimer(seconds)
+#define HTMLPARSER_STATS_ADD(counter, n) ((counter) += (n))
+#else
+#define HTMLPARSER_STATS_TIME(seconds)
+#define HTMLPARSER_STATS_ADD(counter, n)
+#endif
+
+template <typename CharT> class HtmlTreeBuilder;
+template <typename CharT> class HtmlParseContext;
+
+/**
+ * class HtmlIndex
+ * id, class token and tag lookups for one document, each key mapping to
+ * its elements in document order. built while parsing (see
+ * HtmlParser::SetIndexMode) or by HtmlDocument::BuildIndex. attribute and
+ * class edits relink the element in place; SetInnerHTML, ParseInnerHTML
+ * and InsertAdjacentHTML cut the nodes they remove out of the lists and
+ * splice the new ones in, by their order labels. a tree grafted in from
+ * another document leaves that document's index stale, rebuilt by its
+ * next lookup, so lookups are not safe to run from several threads at
+ * once.
+ */
+class HtmlIndex {
+public:
+    typedef std::vector<HtmlElement*> Nodes;
+
+    explicit HtmlIndex(HtmlElement* root) : root_(root), stale_(false) {}
+
+    // the elements still pointing at this index are detached
+    ~HtmlIndex();
+
+    const Nodes& GetById(const std::wstring& id) {
+        return Find(ids_, id);
+    }
+
+    const Nodes& GetByClass(const std::wstring& cls) {
+        return Find(classes_, cls);
+    }
+
+    /**
+     * @param tag any case
+     */
+    const Nodes& GetByTag(const std::wstring& tag) {
+        if (stale_) Rebuild(); // before key_, Add uses it too
+        key_.assign(tag);
+        for (size_t i = 0; i < key_.size(); i++) key_[i] = static_cast<wchar_t>(std::towlower(key_[i]));
+        return Find(tags_, key_);
+    }
+
+    bool IsRoot(const HtmlElement* element) const {
+        return element == root_;
+    }
+
+    void Invalidate() {
+        stale_ = true;
+    }
+
+    void Rebuild();
+
+    /**
+     * append element, the next one in document order; the lists are kept
+     * sorted by the order labels of the elements
+     */
+    void Add(HtmlElement* element);
+
+    /**
+     * take element out of the id and class lists, before its id or
+     * classes change
+     */
+    void Unlink(HtmlElement* element);
+
+    /**
+     * put element back into the id and class lists, after the change
+     */
+    void Link(HtmlElement* element);
+
+    /**
+     * list children [from, to) of parent and what is below them, once
+     * they are in the tree and labeled
+     */
+    void InsertChildren(HtmlElement* parent, size_t from, size_t to);
+
+    /**
+     * take children [from, to) of parent and what is below them out of
+     * the lists, while they still are in the tree
+     */
+    void RemoveChildren(HtmlElement* parent, size_t from, size_t to);
+
+    /**
+     * set the index of element and everything below it
+     */
+    static void Attach(HtmlElement* element, HtmlIndex* index);
+
+private:
+    typedef std::unordered_map<std::wstring, Nodes> Map;
+
+    // a run of nodes in document order, by key
+    struct Run {
+        Map ids, classes, tags;
+    };
+
+    const Nodes& Find(Map& map, const std::wstring& key) {
+        static const Nodes none;
+        if (stale_) Rebuild();
+        Map::const_iterator it = map.find(key);
+        return it == map.end() ? none : it->second;
+    }
+
+    void Collect(HtmlElement* element);
+
+    void Gather(HtmlElement* element, Run& run);
+
+    void AddTo(HtmlElement* element, Map& ids, Map& classes, Map& tags);
+
+    static void Insert(Map& map, const std::wstring& key, HtmlElement* element);
+
+    // the nodes of run go in as a block, no node of the map lies between them
+    static void Splice(Map& map, const Map& run);
+
+    // the same block comes out again
+    static void Cut(Map& map, const Map& run);
+
+    static void Erase(Map& map, const std::wstring& key, HtmlElement* element);
+
+    static bool Before(const HtmlElement* a, const HtmlElement* b);
+
+    HtmlIndex(const HtmlIndex&);
+    HtmlIndex& operator=(const HtmlIndex&);
+
+    HtmlElement* root_;
+    bool stale_;
+    Map ids_, classes_, tags_;
+    std::wstring key_;
+};
+
+/**
+ * class HtmlElement
+ * HTML Element struct
+ */
+class HtmlElement : public enable_shared_from_this<HtmlElement> {
+public:
+    friend class HtmlParser;
+
+    friend class HtmlDocument;
+
+    template <typename CharT> friend class HtmlTreeBuilder;
+
+    friend class CompiledXPath;
+
+    friend class CompiledSelector;
+
+    friend class HtmlIndex;
+
+    friend class HtmlSerializer;
+
+    friend class HtmlTextExtractor;
+
+    friend class HtmlChildIterator;
+
+    friend class HtmlAncestorIterator;
+
+    friend class HtmlDescendantIterator;
+
+    friend class HtmlXPathIterator;
+
+public:
+    /**
+     * for children traversals.
+     */
+    typedef std::vector<shared_ptr<HtmlElement>>::const_iterator ChildIterator;
+
+    ChildIterator ChildBegin() const { return children.cbegin(); }
+    ChildIterator ChildEnd()   const { return children.cend(); }
+
+    /**
+     * for attribute traversals.
+     */
+    typedef HtmlAttributes::const_iterator AttributeIterator;
+
+    AttributeIterator AttributeBegin() const { EnsureAttributes(); return attribute.cbegin(); }
+    AttributeIterator AttributeEnd()   const { EnsureAttributes(); return attribute.cend(); }
+
+    /**
+     * views for range-for: nothing is copied and no reference counts are
+     * touched. element ranges yield HtmlElement&; changing the tree while
+     * one is walked invalidates it.
+     */
+    typedef HtmlRange<HtmlChildIterator> ChildRange;
+    typedef HtmlRange<HtmlAttributes::const_iterator> AttributeRange;
+    typedef HtmlRange<std::vector<std::wstring>::const_iterator> ClassRange;
+    typedef HtmlRange<HtmlAncestorIterator> AncestorRange;
+    typedef HtmlRange<HtmlDescendantIterator> DescendantRange;
+    typedef HtmlRange<HtmlXPathIterator> XPathRange;
+
+    enum Order {
+        PRE_ORDER,      // a node before what is below it
+        POST_ORDER      // a node after what is below it
+    };
+
+    ChildRange Children() const;
+
+    AttributeRange Attributes() const;
+
+    ClassRange Classes() const;
+
+    /**
+     * the parent, its parent and so on up to the root
+     */
+    AncestorRange Ancestors() const;
+
+    /**
+     * everything below this element, this one excluded, walked with an
+     * explicit stack so depth costs no recursion
+     */
+    DescendantRange Descendants(Order order = PRE_ORDER) const;
+
+    size_t GetChildCount() const {
+        return children.size();
+    }
+
+    /**
+     * what a Visit visitor returns for each node
+     */
+    enum VisitResult {
+        VISIT_CONTINUE, // go on, below this node too
+        VISIT_SKIP,     // go on, but not below this node
+        VISIT_STOP      // end the walk
+    };
+
+    /**
+     * calls visitor(HtmlElement&) for this element and everything below it
+     * in document order; the visitor returns a VisitResult
+     * @return false if the visitor stopped the walk
+     */
+    template <typename Visitor>
+    bool Visit(Visitor&& visitor) {
+        VisitResult result = visitor(*this);
+        if (result != VISIT_CONTINUE) return result != VISIT_STOP;
+
+        // children of each open node and the next one to visit
+        std::vector<std::pair<HtmlElement*, size_t>> stack;
+        stack.reserve(32);
+        stack.push_back(std::make_pair(this, size_t(0)));
+        while (!stack.empty()) {
+            std::pair<HtmlElement*, size_t>& top = stack.back();
+            if (top.second == top.first->children.size()) {
+                stack.pop_back();
+                continue;
+            }
+            HtmlElement* node = top.first->children[top.second++].get();
+            result = visitor(*node);
+            if (result == VISIT_STOP) return false;
+            if (result == VISIT_CONTINUE && !node->children.empty()) stack.push_back(std::make_pair(node, size_t(0)));
+        }
+        return true;
+    }
+
+public:
+
+    HtmlElement() : atom(HtmlAtom::NONE), lazy(nullptr), index(nullptr), order(0), orderEnd(0), position(0) {}
+
+    HtmlElement(shared_ptr<HtmlElement> p)
+        : atom(HtmlAtom::NONE), lazy(nullptr), index(nullptr), order(0), orderEnd(0), position(0), parent(p) {
+    }
+
+    std::wstring GetAttribute(const std::wstring& k) {
+        EnsureAttributes();
+        const std::wstring* v = attribute.Find(k);
+        return v ? *v : std::wstring();
+    }
+
+    void SetAttribute(const std::wstring& j, const std::wstring& k) {
+        EnsureAttributes();
+        bool indexed = index && (j == L"id" || j == L"class");
+        if (indexed) index->Unlink(this);
+        if (k.empty()) {
+            attribute.Erase(j);
+            if (j == L"class") classlist.clear();
+        }
+        else {
+            attribute.Set(j, k);
+            if (j == L"class") {
+                classlist.clear();
+                std::wistringstream iss(k);
+                std::wstring token;
+                while (iss >> token) {
+                    classlist.push_back(token);
+                }
+            }
+        }
+        if (indexed) index->Link(this);
+    }
+
+
+    /**
+     * a copy, sorted by key; GetAttributeList is the attributes themselves
+     */
+    std::map<std::wstring, std::wstring> GetAttributes() {
+        EnsureAttributes();
+        return attribute.ToMap();
+    }
+
+    /**
+     * the attributes in source order, without a copy
+     */
+    const HtmlAttributes& GetAttributeList() const {
+        EnsureAttributes();
+        return attribute;
+    }
+
+    shared_ptr<HtmlElement> GetElementById(const std::wstring& id)
+    {
+        if (IsIndexRoot()) {
+            const HtmlIndex::Nodes& nodes = index->GetById(id);
+            return nodes.empty() ? shared_ptr<HtmlElement>() : nodes[0]->shared_from_this();
+        }
+
+        for (HtmlElement::ChildIterator it = children.begin(); it != children.end(); ++it) {
+            if ((*it)->HasAttribute(L"id", id))
+            {
+                return *it;
+            }
+            shared_ptr<HtmlElement> r = (*it)->GetElementById(id);
+
+            if (r) return r;
+        }
+
+        return shared_ptr<HtmlElement>();
+    }
+
+    std::vector<shared_ptr<HtmlElement> > GetElementsById(const std::wstring& id) {
+        std::vector<shared_ptr<HtmlElement> > result;
+        GetElementsById(id, result);
+        return result;
+    }
+
+
+    std::vector<shared_ptr<HtmlElement> > GetElementsByClassName(const std::wstring& name, const std::wstring& tag = L"") {
+        std::vector<shared_ptr<HtmlElement> > result;
+        GetElementsByClassName(name, tag, result);
+        return result;
+    }
+
+    /**
+     * a copy, Classes() walks them without one
+     */
+    std::vector<std::wstring> GetClassList() const {
+        EnsureAttributes();
+        return classlist;
+    }
+
+    bool HasClass(const std::wstring& cls) const {
+        EnsureAttributes();
+        return std::find(classlist.begin(), classlist.end(), cls) != classlist.end();
+    }
+
+    void AddClass(const std::wstring& cls) {
+        if (!HasClass(cls)) {
+            if (index) index->Unlink(this);
+            classlist.push_back(cls);
+            UpdateClassAttribute();
+            if (index) index->Link(this);
+        }
+    }
+
+    void RemoveClass(const std::wstring& cls) {
+        if (HasClass(cls)) {
+            if (index) index->Unlink(this);
+            classlist.erase(std::remove(classlist.begin(), classlist.end(), cls), classlist.end());
+            UpdateClassAttribute();
+            if (index) index->Link(this);
+        }
+    }
+
+    void ToggleClass(const std::wstring& cls) {
+        if (HasClass(cls))
+            RemoveClass(cls);
+        else
+            AddClass(cls);
+    }
+
+    void ClearClasses() {
+        EnsureAttributes();
+        if (index) index->Unlink(this);
+        classlist.clear();
+        attribute.Erase(L"class");
+        if (index) index->Link(this);
+    }
+
+
+    std::vector<shared_ptr<HtmlElement> > GetElementByTagName(const std::wstring& name) {
+        std::vector<shared_ptr<HtmlElement> > result;
+        GetElementByTagName(name, result);
+        return result;
+    }
+ 
+    bool IsLowerAlphaNumeric(const std::wstring& str) {
+        for (wchar_t c : str) {
+            if (!((c >= L'a' && c <= L'z') || (c >= L'0' && c <= L'9')))
+                return false;
+        }
+        return true;
+    }
+
+    bool IsLowerAlphaOnly(const std::wstring& str) {
+        for (wchar_t ch : str) {
+            if (ch < L'a' || ch > L'z')
+                return false;
+        }
+        return !str.empty(); // optional: false if empty
+    }
+
+    // --- Entry Point ---
+    void SelectElement(const std::wstring& rule,
+        std::vector<std::shared_ptr<HtmlElement>>& result) {
+        SelectElement(*CompiledXPathCache::Global().Get(rule), result);
+    }
+
+    /**
+     * select with a rule compiled beforehand
+     * @param xpath
+     * @param result matches are appended
+     */
+    void SelectElement(const CompiledXPath& xpath,
+        std::vector<std::shared_ptr<HtmlElement>>& result) {
+        xpath.Evaluate(*this, result);
+    }
+
+    /**
+     * the first match of an XPath rule, or null; the walk stops there
+     */
+    shared_ptr<HtmlElement> SelectFirst(const std::wstring& rule) {
+        return CompiledXPathCache::Global().Get(rule)->First(*this);
+    }
+
+    shared_ptr<HtmlElement> SelectFirst(const CompiledXPath& xpath) {
+        return xpath.First(*this);
+    }
+
+    /**
+     * whether an XPath rule matches anything, as early as SelectFirst
+     */
+    bool SelectAny(const std::wstring& rule) {
+        return CompiledXPathCache::Global().Get(rule)->Any(*this);
+    }
+
+    bool SelectAny(const CompiledXPath& xpath) {
+        return xpath.Any(*this);
+    }
+
+    /**
+     * the number of matches of an XPath rule, without collecting them
+     */
+    size_t SelectCount(const std::wstring& rule) {
+        return CompiledXPathCache::Global().Get(rule)->Count(*this);
+    }
+
+    size_t SelectCount(const CompiledXPath& xpath) {
+        return xpath.Count(*this);
+    }
+
+    /**
+     * the matches of an XPath rule found one at a time as the range is
+     * walked, as HtmlElement&; leaving the loop ends the search
+     */
+    XPathRange Select(const std::wstring& rule);
+
+    XPathRange Select(const CompiledXPath& xpath);
+
+    // --- Token entry, the rule starts at tokens[idx] ---
+    bool SelectElement(const std::vector<std::wstring>& tokens,
+        size_t idx,
+        std::vector<std::shared_ptr<HtmlElement>>& results)
+    {
+        if (idx >= tokens.size()) return false;
+        std::vector<std::wstring> rule(tokens.begin() + idx, tokens.end());
+        return CompiledXPath(rule).Evaluate(*this, results);
+    }
+
+    /**
+     * first element below this one matching a CSS selector, see
+     * CompiledSelector for what is supported
+     * @param selector e.g. "div.item > a[href^='https']"
+     * @return null if nothing matches or the selector is invalid
+     */
+    shared_ptr<HtmlElement> QuerySelector(const std::wstring& selector) {
+        return QuerySelector(*CompiledSelectorCache::Global().Get(selector));
+    }
+
+    shared_ptr<HtmlElement> QuerySelector(const CompiledSelector& selector) {
+        return selector.First(*this);
+    }
+
+    /**
+     * every element below this one matching a CSS selector
+     * @param selector
+     * @return the matches in document order
+     */
+    std::vector<shared_ptr<HtmlElement>> QuerySelectorAll(const std::wstring& selector) {
+        return QuerySelectorAll(*CompiledSelectorCache::Global().Get(selector));
+    }
+
+    std::vector<shared_ptr<HtmlElement>> QuerySelectorAll(const CompiledSelector& selector) {
+        std::vector<shared_ptr<HtmlElement>> result;
+        selector.Evaluate(*this, result);
+        return result;
+    }
+
+    //********************************************************************************
+
+    shared_ptr<HtmlElement> GetParent() {
+        return parent.lock();
+    }
+
+    /**
+     * the next child of the parent, in constant time
+     */
+    shared_ptr<HtmlElement> GetSiblingNext() {
+        shared_ptr<HtmlElement> p = parent.lock();
+        if (!p || position + 1 >= p->children.size()) return nullptr;
+        return p->children[position + 1];
+    }
+
+
+    /**
+     * a copy, Children() walks them without one
+     */
+    std::vector<shared_ptr<HtmlElement>> GetChildren() {
+
+        return children;
+
+    }
+
+    /**
+     * the previous child of the parent, in constant time
+     */
+    shared_ptr<HtmlElement> GetSiblingPrev() {
+        shared_ptr<HtmlElement> p = parent.lock();
+        if (!p || position == 0 || position > p->children.size()) return nullptr;
+        return p->children[position - 1];
+    }
+
+    /**
+     * index among the children of the parent
+     */
+    size_t GetPosition() const {
+        return position;
+    }
+
+    /**
+     * whether other is below this element, in constant time. every node
+     * has an interval of order labels holding those of its subtree; the
+     * labels are given while parsing and kept valid by SetInnerHTML,
+     * SetInnerText, ParseInnerHTML and InsertAdjacentHTML. both nodes must
+     * be in one tree.
+     */
+    bool IsAncestorOf(const HtmlElement& other) const {
+        return order < other.order && other.order <= orderEnd;
+    }
+
+    /**
+     * whether this node comes before other in document order, in
+     * constant time; both must be in one tree
+     */
+    bool IsBefore(const HtmlElement& other) const {
+        return order < other.order;
+    }
+
+    /**
+     * the pre-order label, larger further on in document order; labels
+     * are sparse and change when the tree does
+     */
+    uint64_t GetOrder() const {
+        return order;
+    }
+
+
+
+    int SetInnerText(std::wstring text) {
+        auto el = shared_from_this();
+
+        if (el->children.empty()) {
+            // Create a text node if none exists
+            auto textNode = std::make_shared<HtmlElement>();
+            textNode->value = text;
+            textNode->parent = el;
+            el->children.push_back(textNode);
+            el->LabelChildren(0, 1);
+            // a text node has no tag, id or class to list
+            textNode->index = index;
+
+        }
+        else {
+            el->children[0]->EnsureValue();
+            el->children[0]->value = text;
+        }
+
+        return 0;
+    }
+
+    int SetInnerHTML(std::shared_ptr<HtmlElement> tempRoot) {
+        auto el = shared_from_this();
+
+        el->ClearChildren();
+
+        // Append parsed children to our element
+        for (auto& child : tempRoot->children) {
+            // Make a new HtmlElement with the same data but correct parent
+            child->parent = el;
+            if (child->index != index) {
+                // an index of the tree it came from is stale now
+                if (child->index) child->index->Invalidate();
+                HtmlIndex::Attach(child.get(), index);
+            }
+            child->position = el->children.size();
+            el->children.push_back(child);
+        }
+        el->LabelChildren(0, el->children.size());
+
+        if (index) index->InsertChildren(el.get(), 0, el->children.size());
+        return 0;
+    }
+
+    /**
+     * where InsertAdjacentHTML puts what it parses
+     */
+    enum AdjacentPosition {
+        BEFORE_BEGIN,   // before this element, in its parent
+        AFTER_BEGIN,    // before the first child
+        BEFORE_END,     // after the last child
+        AFTER_END       // after this element, in its parent
+    };
+
+    /**
+     * replace the children with html parsed as the content of this
+     * element, straight into it (no document in between): text at the
+     * top is kept, close tags for elements html did not open are ignored
+     * and what is still open at the end is closed. the content of a raw
+     * text element (<script>, <style>, ...) is its text. labels and the
+     * index are kept as SetInnerHTML keeps them.
+     * @param data
+     * @param len
+     */
+    int ParseInnerHTML(const wchar_t* data, size_t len);
+
+    int ParseInnerHTML(const std::wstring& html) {
+        return ParseInnerHTML(html.data(), html.size());
+    }
+
+    /**
+     * parse html as ParseInnerHTML does and insert the nodes at where,
+     * without touching the nodes already there; BEFORE_BEGIN and
+     * AFTER_END parse in the context of the parent
+     * @return -1, nothing inserted, for BEFORE_BEGIN or AFTER_END without
+     *         a parent
+     */
+    int InsertAdjacentHTML(AdjacentPosition where, const wchar_t* data, size_t len);
+
+    int InsertAdjacentHTML(AdjacentPosition where, const std::wstring& html) {
+        return InsertAdjacentHTML(where, html.data(), html.size());
+    }
+
+
+    const std::wstring& GetValue() {
+        EnsureValue();
+        if (value.empty() && children.size() == 1 && children[0]->atom == HtmlAtom::PLAIN) {
+            return children[0]->GetValue();
+        }
+
+        return value;
+    }
+
+
+    const std::wstring& GetName() {
+        return name;
+    }
+
+    /**
+     * the name as an HtmlAtom
+     */
+    uint32_t GetAtom() const {
+        return atom;
+    }
+
+    /**
+     * text of this element and what is below it, see HtmlTextExtractor
+     * for collapsing white space, a length limit or writing to a sink
+     */
+    std::wstring text();
+
+    /**
+     * appends text() to str
+     */
+    void PlainStylize(std::wstring& str);
+
+    /**
+     * markup of this element and what is below it, see HtmlSerializer
+     * for writing it to a file or a callback, or as UTF-8
+     */
+    std::wstring OuterHTML();
+
+    /**
+     * markup of what is below this element
+     */
+    std::wstring InnerHTML();
+
+    /**
+     * appends OuterHTML() to str
+     */
+    void HtmlStylize(std::wstring& str);
+
+    /**
+     * writes the markup to a sink, see HtmlSerializer
+     * @param outer false: only what is below this element
+     */
+    template <typename Sink>
+    void WriteHTML(Sink& sink, bool outer = true) const;
+
+private:
+
+
+    // the walks below visit every node once, results need no duplicate check
+
+    void GetElementsByClassName(const std::wstring& cls, const std::wstring& tag, std::vector<std::shared_ptr<HtmlElement>>& result)
+    {
+        if (IsIndexRoot()) {
+            uint32_t tagAtom = HtmlAtom::Of(tag);
+            const HtmlIndex::Nodes& nodes = index->GetByClass(cls);
+            for (size_t i = 0; i < nodes.size(); i++) {
+                if (tag.empty() || HtmlAtom::Equal(nodes[i]->atom, nodes[i]->name, tagAtom, tag)) result.push_back(nodes[i]->shared_from_this());
+            }
+            return;
+        }
+
+        GetElementsByClassName(cls, tag, HtmlAtom::Of(tag), result);
+    }
+
+    void GetElementsByClassName(const std::wstring& cls, const std::wstring& tag, uint32_t tagAtom, std::vector<std::shared_ptr<HtmlElement>>& result)
+    {
+        if (HasClass(cls))
+        {
+            if (tag.empty() || HtmlAtom::Equal(tagAtom, tag, atom, name))
+                result.push_back(shared_from_this());
+        }
+        for (ChildIterator it = ChildBegin(); it != ChildEnd(); ++it) {
+            (*it)->GetElementsByClassName(cls, tag, tagAtom, result);
+        }
+    }
+
+
+    void GetElementsById(const std::wstring& id, std::vector<shared_ptr<HtmlElement> >& result) {
+        if (IsIndexRoot()) {
+            AppendNodes(index->GetById(id), result);
+            return;
+        }
+
+        for (HtmlElement::ChildIterator it = children.begin(); it != children.end(); ++it) {
+            if ((*it)->HasAttribute(L"id", id))
+                result.push_back(*it);
+
+            (*it)->GetElementsById(id, result);
+        }
+    }
+
+    void GetElementByTagName(const std::wstring& name, std::vector<shared_ptr<HtmlElement>>& result) {
+        // text nodes are not indexed
+        uint32_t tag = HtmlAtom::Of(name);
+        if (IsIndexRoot() && tag != HtmlAtom::NONE && tag != HtmlAtom::PLAIN) {
+            AppendNodes(index->GetByTag(name), result);
+            return;
+        }
+
+        GetElementByTagName(name, tag, result);
+    }
+
+    void GetElementByTagName(const std::wstring& name, uint32_t tag, std::vector<shared_ptr<HtmlElement>>& result) {
+        for (HtmlElement::ChildIterator it = children.begin(); it != children.end(); ++it) {
+            if (HtmlAtom::Equal((*it)->atom, (*it)->name, tag, name))
+                result.push_back(*it);
+            
+            (*it)->GetElementByTagName(name, tag, result);
+        }
+    }
+
+
+    void GetAllElement(std::vector<shared_ptr<HtmlElement> >& result) {
+        for (size_t i = 0; i < children.size(); ++i) {
+            result.push_back(children[i]);
+            children[i]->GetAllElement(result);
+        }
+    }
+
+    /**
+     * the document index answers lookups made from the root only
+     */
+    bool IsIndexRoot() const {
+        return index && index->IsRoot(this);
+    }
+
+    static void AppendNodes(const HtmlIndex::Nodes& nodes, std::vector<shared_ptr<HtmlElement>>& result) {
+        result.reserve(result.size() + nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            result.push_back(nodes[i]->shared_from_this());
+        }
+    }
+
+    bool HasAttribute(const std::wstring& k, const std::wstring& v) const {
+        EnsureAttributes();
+        const std::wstring* value = attribute.Find(k);
+        return value && *value == v;
+    }
+
+    void Parse(const std::wstring& attr) {
+        ParseAttributes(attr);
+        TrimValue();
+    }
+
+    /**
+     * @param diagnostics null: problems go unreported
+     * @param offset of the start tag, for diagnostics
+     */
+    void ParseAttributes(const std::wstring& attr, HtmlDiagnostics* diagnostics = nullptr, size_t offset = std::wstring::npos) {
+        ParseAttributeText(attr, [this](const std::wstring& k, const std::wstring& v) {
+            attribute.Set(k, v);
+        }, diagnostics, offset);
+
+        // After parsing attributes into `attribute`
+        const std::wstring* cls = attribute.Find(L"class");
+        if (cls) {
+            classlist.clear();
+            std::wistringstream iss(*cls);
+            std::wstring token;
+            while (iss >> token) {
+                classlist.push_back(token);
+            }
+        }
+
+    }
+
+
+    void TrimValue() {
+        if (!value.empty()) {
+            value.erase(0, value.find_first_not_of(L" "));
+            value.erase(value.find_last_not_of(L" ") + 1);
+        }
+    }
+
+    /**
+     * zero-copy mode: value and attribute text still held as views into
+     * the document source, materialized on first use
+     */
+    struct LazyFields {
+        const HtmlSource* source;
+        size_t value_offset;
+        size_t value_length;
+        size_t attr_offset;
+        size_t attr_length;
+        bool value_pending;
+        bool attr_pending;
+        bool raw_value;
+    };
+
+    void EnsureValue() const {
+        if (lazy && lazy->value_pending) {
+            lazy->value_pending = false;
+            lazy->source->Append(value, lazy->value_offset, lazy->value_length, !lazy->raw_value);
+            if (lazy->raw_value) const_cast<HtmlElement*>(this)->TrimValue();
+        }
+    }
+
+    void EnsureAttributes() const {
+        if (lazy && lazy->attr_pending) {
+            lazy->attr_pending = false;
+            std::wstring attr;
+            lazy->source->Append(attr, lazy->attr_offset, lazy->attr_length, false);
+            const_cast<HtmlElement*>(this)->ParseAttributes(attr);
+        }
+    }
+
+    // the children leave this element, and the index with the tree; with
+    // no parent left, sibling steps from one of them find nothing
+    void ClearChildren() {
+        if (index) index->RemoveChildren(this, 0, children.size());
+        for (size_t i = 0; i < children.size(); i++) {
+            HtmlElement& child = *children[i];
+            child.parent.reset();
+            child.position = 0;
+            if (index) HtmlIndex::Attach(&child, nullptr);
+        }
+        children.clear();
+    }
+
+    // order labels: per input character while parsing, the interval of a root
+    static const uint64_t kOrderSpacing = uint64_t(1) << 24;
+    static const uint64_t kOrderMax = (uint64_t(1) << 63) - 1;
+
+    /**
+     * labels what is below this element anew, spread over its interval;
+     * below the nearest element up with room when it is too narrow (the
+     * root has the widest)
+     */
+    void Relabel();
+
+    static void Label(HtmlElement& top, uint64_t step);
+
+    /**
+     * labels children [from, to) and what is below them in the gap the
+     * children around them leave
+     */
+    void LabelChildren(size_t from, size_t to);
+
+    // the gap around children [from, to) and the nodes they hold
+    uint64_t ChildGap(size_t from, size_t to, uint64_t& low, uint64_t& high) const;
+
+    // html parsed as the content of this element into the children at at
+    void ParseChildren(size_t at, const wchar_t* data, size_t len);
+
+    // Private helper to sync classlist attribute["class"]
+private:
+    void UpdateClassAttribute() {
+        if (classlist.empty()) {
+            attribute.Erase(L"class");
+            return;
+        }
+        std::wstring combined;
+        for (size_t i = 0; i < classlist.size(); ++i) {
+            if (i > 0) combined += L" ";
+            combined += classlist[i];
+        }
+        attribute.Set(L"class", combined);
+    }
+private:
+    std::wstring name;
+    uint32_t atom;          // of name, see HtmlAtom
+    mutable std::wstring value;
+    mutable HtmlAttributes attribute;
+    mutable std::vector<std::wstring> classlist;
+    mutable LazyFields* lazy;
+    HtmlIndex* index;       // document index, null when there is none
+    uint64_t order;         // pre-order label, sparse, see IsBefore
+    uint64_t orderEnd;      // largest label the subtree may hold
+    size_t position;        // index in parent->children
+    weak_ptr<HtmlElement> parent;
+    std::vector<shared_ptr<HtmlElement> > children;
+};
+
+/**
+ * class HtmlRange
+ * a begin / end pair for range-for, see HtmlElement::Children and the
+ * other views
+ */
+template <typename Iterator>
+class HtmlRange {
+public:
+    typedef Iterator iterator;
+    typedef Iterator const_iterator;
+
+    HtmlRange(Iterator begin, Iterator end) : begin_(begin), end_(end) {}
+
+    Iterator begin() const { return begin_; }
+    Iterator end() const { return end_; }
+
+    bool empty() const { return begin_ == end_; }
+
+    /**
+     * counted by walking the range
+     */
+    size_t size() const { return static_cast<size_t>(std::distance(begin_, end_)); }
+
+private:
+    Iterator begin_;
+    Iterator end_;
+};
+
+/**
+ * class HtmlChildIterator
+ * the children of an element as HtmlElement&
+ */
+class HtmlChildIterator {
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef HtmlElement value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef HtmlElement* pointer;
+    typedef HtmlElement& reference;
+
+    HtmlChildIterator() {}
+    explicit HtmlChildIterator(HtmlElement::ChildIterator it) : it_(it) {}
+
+    HtmlElement& operator*() const { return **it_; }
+    HtmlElement* operator->() const { return it_->get(); }
+    HtmlChildIterator& operator++() { ++it_; return *this; }
+    HtmlChildIterator operator++(int) { HtmlChildIterator old(*this); ++it_; return old; }
+    bool operator==(const HtmlChildIterator& other) const { return it_ == other.it_; }
+    bool operator!=(const HtmlChildIterator& other) const { return it_ != other.it_; }
+
+private:
+    HtmlElement::ChildIterator it_;
+};
+
+/**
+ * class HtmlAncestorIterator
+ * from the parent of an element up to the root
+ */
+class HtmlAncestorIterator {
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef HtmlElement value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef HtmlElement* pointer;
+    typedef HtmlElement& reference;
+
+    HtmlAncestorIterator() : node_(nullptr) {}
+    explicit HtmlAncestorIterator(HtmlElement* node) : node_(node) {}
+
+    HtmlElement& operator*() const { return *node_; }
+    HtmlElement* operator->() const { return node_; }
+
+    HtmlAncestorIterator& operator++() {
+        // the ancestors own what is below them, they outlive the lock
+        node_ = node_->parent.lock().get();
+        return *this;
+    }
+
+    HtmlAncestorIterator operator++(int) { HtmlAncestorIterator old(*this); ++*this; return old; }
+    bool operator==(const HtmlAncestorIterator& other) const { return node_ == other.node_; }
+    bool operator!=(const HtmlAncestorIterator& other) const { return node_ != other.node_; }
+
+private:
+    HtmlElement* node_;     // null at the end
+};
+
+/**
+ * class HtmlDescendantIterator
+ * everything below an element in pre-order or post-order. the path from
+ * the root is kept on an explicit stack, one entry per level, so a copy
+ * of the iterator costs the depth of the tree.
+ */
+class HtmlDescendantIterator {
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef HtmlElement value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef HtmlElement* pointer;
+    typedef HtmlElement& reference;
+
+    HtmlDescendantIterator() : node_(nullptr), post_(false) {}
+
+    HtmlDescendantIterator(const HtmlElement& root, HtmlElement::Order order)
+        : node_(nullptr), post_(order == HtmlElement::POST_ORDER) {
+        if (root.children.empty()) return;
+        path_.reserve(16);
+        path_.push_back(Frame(&root, 0));
+        node_ = root.children[0].get();
+        if (post_) Descend();
+    }
+
+    HtmlElement& operator*() const { return *node_; }
+    HtmlElement* operator->() const { return node_; }
+
+    HtmlDescendantIterator& operator++() {
+        if (!post_ && !node_->children.empty()) {
+            path_.push_back(Frame(node_, 0));
+            node_ = node_->children[0].get();
+            return *this;
+        }
+        while (!path_.empty()) {
+            Frame& top = path_.back();
+            if (++top.index < top.parent->children.size()) {
+                node_ = top.parent->children[top.index].get();
+                if (post_) Descend();
+                return *this;
+            }
+            path_.pop_back();
+            if (post_) {
+                // every child done, the parent comes next unless it is the root
+                node_ = path_.empty() ? nullptr : path_.back().parent->children[path_.back().index].get();
+                return *this;
+            }
+        }
+        node_ = nullptr;
+        return *this;
+    }
+
+    HtmlDescendantIterator operator++(int) { HtmlDescendantIterator old(*this); ++*this; return old; }
+    bool operator==(const HtmlDescendantIterator& other) const { return node_ == other.node_; }
+    bool operator!=(const HtmlDescendantIterator& other) const { return node_ != other.node_; }
+
+private:
+    struct Frame {
+        Frame(const HtmlElement* p, size_t i) : parent(p), index(i) {}
+
+        const HtmlElement* parent;
+        size_t index;       // of the child being walked
+    };
+
+    // post-order starts at the first leaf below node_
+    void Descend() {
+        while (!node_->children.empty()) {
+            path_.push_back(Frame(node_, 0));
+            node_ = node_->children[0].get();
+        }
+    }
+
+    std::vector<Frame> path_;
+    HtmlElement* node_;     // null at the end
+    bool post_;
+};
+
+/**
+ * class HtmlXPathIterator
+ * the matches of a CompiledXPath one at a time. a walk in document order
+ * tests each node on the last step and only then the steps before it on
+ * the path above, right to left as CompiledSelector matches; what the
+ * path nodes and the siblings on it gave for each step is kept until the
+ * walk leaves them, so a node costs the number of steps at most. rules of
+ * child and sibling steps only are not walked below the depth of their
+ * matches. nothing past the current match is looked at.
+ */
+class HtmlXPathIterator {
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef HtmlElement value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef HtmlElement* pointer;
+    typedef HtmlElement& reference;
+
+    HtmlXPathIterator() : xpath_(nullptr), scope_(nullptr), node_(nullptr), limit_(0) {}
+
+    /**
+     * @param hold keeps a cached rule alive, may be null
+     */
+    HtmlXPathIterator(const CompiledXPath& xpath, HtmlElement& scope, shared_ptr<const CompiledXPath> hold = shared_ptr<const CompiledXPath>())
+        : hold_(hold), xpath_(&xpath), scope_(&scope), node_(nullptr), limit_(0) {
+        const std::vector<CompiledXPath::Step>& steps = xpath.steps_;
+        if (steps.empty()) return;
+
+        // siblings of scope are walked from its parent
+        HtmlElement* root = &scope;
+        if (IsSibling(steps[0].axis)) {
+            root = scope.parent.lock().get();
+            if (!root) return;
+            limit_ = 1;
+        }
+        for (size_t i = 0; i < steps.size(); i++) {
+            if (steps[i].axis == CompiledXPath::AXIS_DESCENDANT) {
+                limit_ = std::wstring::npos;
+                break;
+            }
+            if (steps[i].axis == CompiledXPath::AXIS_CHILD) limit_++;
+        }
+        Push(root);
+        ++*this;
+    }
+
+    HtmlElement& operator*() const { return *node_; }
+    HtmlElement* operator->() const { return node_; }
+
+    HtmlXPathIterator& operator++() {
+        size_t last = xpath_->steps_.size() - 1;
+        while (!path_.empty()) {
+            // the children of the top frame are one deeper
+            size_t depth = path_.size();
+            Frame& top = path_.back();
+            if (top.next == top.node->children.size()) {
+                Pop();
+                continue;
+            }
+            HtmlElement* child = top.node->children[top.next++].get();
+            bool match = (limit_ == std::wstring::npos || depth == limit_) && MatchAt(*child, depth, last);
+            if (!child->children.empty() && depth < limit_) Push(child);
+            if (match) {
+                node_ = child;
+                return *this;
+            }
+        }
+        node_ = nullptr;
+        return *this;
+    }
+
+    HtmlXPathIterator operator++(int) { HtmlXPathIterator old(*this); ++*this; return old; }
+    bool operator==(const HtmlXPathIterator& other) const { return node_ == other.node_; }
+    bool operator!=(const HtmlXPathIterator& other) const { return node_ != other.node_; }
+
+private:
+    struct Frame {
+        HtmlElement* node;
+        size_t next;        // child to visit
+    };
+
+    enum { kUnknown = -1 };
+
+    static bool IsSibling(CompiledXPath::Axis axis) {
+        return axis == CompiledXPath::AXIS_FOLLOWING_SIBLING || axis == CompiledXPath::AXIS_PRECEDING_SIBLING;
+    }
+
+    // per frame and step: path_[d] matches, path_[1..d] has a match, and
+    // for the children of path_[d] the first match and how far it was
+    // looked for, and the last match
+    void Push(HtmlElement* node) {
+        Frame frame = { node, 0 };
+        path_.push_back(frame);
+        size_t slots = path_.size() * xpath_->steps_.size();
+        matches_.resize(slots, kUnknown);
+        above_.resize(slots, kUnknown);
+        first_.resize(slots, std::wstring::npos);
+        scanned_.resize(slots, 0);
+        last_.resize(slots, std::wstring::npos);
+    }
+
+    void Pop() {
+        path_.pop_back();
+        size_t slots = path_.size() * xpath_->steps_.size();
+        matches_.resize(slots);
+        above_.resize(slots);
+        first_.resize(slots);
+        scanned_.resize(slots);
+        last_.resize(slots);
+    }
+
+    // node is at depth, below path_[depth - 1]
+    bool MatchAt(HtmlElement& node, size_t depth, size_t k) {
+        size_t slot = depth * xpath_->steps_.size() + k;
+        bool onPath = depth < path_.size() && path_[depth].node == &node;
+        if (onPath && matches_[slot] != kUnknown) return matches_[slot] != 0;
+
+        bool match = xpath_->Match(node, xpath_->steps_[k], text_) && MatchLeft(node, depth, k);
+        if (onPath) matches_[slot] = match;
+        return match;
+    }
+
+    bool MatchLeft(HtmlElement& node, size_t depth, size_t k) {
+        const CompiledXPath::Step& step = xpath_->steps_[k];
+        HtmlElement* parent = path_[depth - 1].node;
+        switch (step.axis) {
+        case CompiledXPath::AXIS_CHILD:
+            if (k == 0) return parent == scope_;
+            return depth > 1 && MatchAt(*parent, depth - 1, k - 1);
+
+        case CompiledXPath::AXIS_DESCENDANT:
+            // everything walked is below scope
+            return k == 0 || MatchAbove(depth - 1, k - 1);
+
+        default: {
+            bool following = step.axis == CompiledXPath::AXIS_FOLLOWING_SIBLING;
+            if (k == 0) return depth == 1 && (following ? node.position > scope_->position : node.position < scope_->position);
+            return following ? MatchBefore(*parent, depth, node.position, k - 1) : MatchAfter(*parent, depth, node.position, k - 1);
+        }
+        }
+    }
+
+    // any of path_[1..depth] matches step k, filled in top down without recursion
+    bool MatchAbove(size_t depth, size_t k) {
+        size_t steps = xpath_->steps_.size();
+        size_t known = depth;
+        while (known > 0 && above_[known * steps + k] == kUnknown) known--;
+        bool match = known > 0 && above_[known * steps + k] != 0;
+        for (size_t d = known + 1; d <= depth; d++) {
+            match = match || MatchAt(*path_[d].node, d, k);
+            above_[d * steps + k] = match;
+        }
+        return match;
+    }
+
+    // a child of parent before position matches step k
+    bool MatchBefore(HtmlElement& parent, size_t depth, size_t position, size_t k) {
+        size_t slot = (depth - 1) * xpath_->steps_.size() + k;
+        while (first_[slot] == std::wstring::npos && scanned_[slot] < position) {
+            size_t i = scanned_[slot]++;
+            if (MatchAt(*parent.children[i], depth, k)) first_[slot] = i;
+        }
+        return first_[slot] < position;
+    }
+
+    // a child of parent after position matches step k
+    bool MatchAfter(HtmlElement& parent, size_t depth, size_t position, size_t k) {
+        static const size_t kNone = std::wstring::npos - 1;
+        size_t slot = (depth - 1) * xpath_->steps_.size() + k;
+        if (last_[slot] == std::wstring::npos) {
+            last_[slot] = kNone;
+            for (size_t i = parent.children.size(); i-- > 0;) {
+                if (MatchAt(*parent.children[i], depth, k)) {
+                    last_[slot] = i;
+                    break;
+                }
+            }
+        }
+        return last_[slot] != kNone && last_[slot] > position;
+    }
+
+    shared_ptr<const CompiledXPath> hold_;
+    const CompiledXPath* xpath_;
+    HtmlElement* scope_;
+    HtmlElement* node_;     // null at the end
+    size_t limit_;          // depth of every match below the walk root, npos with "//"
+    std::vector<Frame> path_;
+    std::vector<signed char> matches_;
+    std::vector<signed char> above_;
+    std::vector<size_t> first_;
+    std::vector<size_t> scanned_;
+    std::vector<size_t> last_;
+    std::wstring text_;     // text() of a node, reused across nodes
+};
+
+inline shared_ptr<HtmlElement> CompiledXPath::First(HtmlElement& scope) const {
+    HtmlXPathIterator it(*this, scope);
+    return it == HtmlXPathIterator() ? shared_ptr<HtmlElement>() : it->shared_from_this();
+}
+
+inline bool CompiledXPath::Any(HtmlElement& scope) const {
+    return HtmlXPathIterator(*this, scope) != HtmlXPathIterator();
+}
+
+inline size_t CompiledXPath::Count(HtmlElement& scope) const {
+    size_t count = 0;
+    for (HtmlXPathIterator it(*this, scope), end; it != end; ++it) count++;
+    return count;
+}
+
+inline HtmlRange<HtmlXPathIterator> CompiledXPath::Select(HtmlElement& scope) const {
+    return HtmlRange<HtmlXPathIterator>(HtmlXPathIterator(*this, scope), HtmlXPathIterator());
+}
+
+inline HtmlElement::XPathRange HtmlElement::Select(const std::wstring& rule) {
+    shared_ptr<const CompiledXPath> xpath = CompiledXPathCache::Global().Get(rule);
+    return XPathRange(HtmlXPathIterator(*xpath, *this, xpath), HtmlXPathIterator());
+}
+
+inline HtmlElement::XPathRange HtmlElement::Select(const CompiledXPath& xpath) {
+    return xpath.Select(*this);
+}
+
+inline HtmlElement::ChildRange HtmlElement::Children() const {
+    return ChildRange(HtmlChildIterator(children.cbegin()), HtmlChildIterator(children.cend()));
+}
+
+inline HtmlElement::AttributeRange HtmlElement::Attributes() const {
+    EnsureAttributes();
+    return AttributeRange(attribute.cbegin(), attribute.cend());
+}
+
+inline HtmlElement::ClassRange HtmlElement::Classes() const {
+    EnsureAttributes();
+    return ClassRange(classlist.cbegin(), classlist.cend());
+}
+
+inline HtmlElement::AncestorRange HtmlElement::Ancestors() const {
+    return AncestorRange(HtmlAncestorIterator(parent.lock().get()), HtmlAncestorIterator());
+}
+
+inline HtmlElement::DescendantRange HtmlElement::Descendants(Order order) const {
+    return DescendantRange(HtmlDescendantIterator(*this, order), HtmlDescendantIterator());
+}
+
+inline void HtmlElement::Relabel() {
+    // up from here to an element whose interval holds its subtree at
+    // the spacing parsing gives, so what is added next has room again;
+    // each node is counted once on the way
+    shared_ptr<HtmlElement> top = shared_from_this();
+    size_t count = Descendants().size();
+    while ((top->orderEnd - top->order) / (count + 1) < kOrderSpacing) {
+        shared_ptr<HtmlElement> p = top->parent.lock();
+        if (!p) {
+            top->order = 0;
+            top->orderEnd = kOrderMax;
+            break;
+        }
+        size_t below = count + p->children.size();
+        for (size_t i = 0; i < p->children.size(); i++) {
+            if (p->children[i] != top) below += p->children[i]->Descendants().size();
+        }
+        top = p;
+        count = below;
+    }
+    Label(*top, (top->orderEnd - top->order) / (count + 1));
+}
+
+inline uint64_t HtmlElement::ChildGap(size_t from, size_t to, uint64_t& low, uint64_t& high) const {
+    // from the last label below the child before (or this element) up to
+    // the child after (or the end of this interval)
+    low = order;
+    if (from > 0) {
+        const HtmlElement* last = children[from - 1].get();
+        while (!last->children.empty()) last = last->children.back().get();
+        low = last->order;
+    }
+    high = to < children.size() ? children[to]->order : orderEnd + 1;
+
+    uint64_t count = to - from;
+    for (size_t i = from; i < to; i++) count += children[i]->Descendants().size();
+    return count;
+}
+
+inline void HtmlElement::LabelChildren(size_t from, size_t to) {
+    if (from >= to) return;
+    uint64_t low, high;
+    uint64_t count = ChildGap(from, to, low, high);
+    uint64_t gap = high - low;
+    uint64_t step, label;
+    if (from == 0 && to == children.size()) {
+        // all the children, spread over the interval
+        step = gap / (count + 1);
+        label = low + step;
+    }
+    else {
+        // among others: the spacing parsing gives, at most a sixteenth of
+        // the gap, most of it left for what is added at the same place
+        step = gap / 16 / (count + 1);
+        if (step > kOrderSpacing) step = kOrderSpacing;
+        if (from == 0) label = high - count * step;
+        else if (to == children.size()) label = low + step;
+        else label = low + (gap - count * step) / 2;
+    }
+    while (step == 0) {
+        // too narrow: the children around too, twice as many each time,
+        // until the gap around them holds them at that spacing
+        if (from == 0 && to == children.size()) {
+            Relabel();
+            return;
+        }
+        size_t more = to - from;
+        from = from > more ? from - more : 0;
+        to = children.size() - to > more ? to + more : children.size();
+        count = ChildGap(from, to, low, high);
+        if ((high - low) / (count + 1) >= kOrderSpacing) {
+            step = (high - low) / (count + 1);
+            label = low + step;
+        }
+    }
+
+    for (size_t i = from; i < to; i++) {
+        HtmlElement& child = *children[i];
+        child.order = label;
+        Label(child, step);
+        const HtmlElement* last = &child;
+        while (!last->children.empty()) last = last->children.back().get();
+        child.orderEnd = last->order + step - 1;
+        label = child.orderEnd + 1;
+    }
+    // the intervals ending the subtree before now end where the run starts
+    HtmlElement* left = from > 0 ? children[from - 1].get() : nullptr;
+    for (HtmlElement* node = left; node; node = node->children.empty() ? nullptr : node->children.back().get()) {
+        node->orderEnd = children[from]->order - 1;
+    }
+}
+
+// the nodes below top get labels step apart in pre-order, each interval
+// reaching up to the label of the node after its subtree
+inline void HtmlElement::Label(HtmlElement& top, uint64_t step) {
+    uint64_t label = top.order;
+    std::vector<std::pair<HtmlElement*, size_t>> stack(1, std::make_pair(&top, size_t(0)));
+    while (!stack.empty()) {
+        std::pair<HtmlElement*, size_t>& frame = stack.back();
+        if (frame.second == frame.first->children.size()) {
+            if (frame.first != &top) frame.first->orderEnd = label + step - 1;
+            stack.pop_back();
+            continue;
+        }
+        HtmlElement* child = frame.first->children[frame.second++].get();
+        label += step;
+        child->order = label;
+        stack.push_back(std::make_pair(child, size_t(0)));
+    }
+}
+
+/**
+ * document order on the nodes of one tree, for std::sort and the like
+ */
+struct HtmlDocumentOrder {
+    bool operator()(const HtmlElement* a, const HtmlElement* b) const {
+        return a->IsBefore(*b);
+    }
+
+    bool operator()(const shared_ptr<HtmlElement>& a, const shared_ptr<HtmlElement>& b) const {
+        return a->IsBefore(*b);
+    }
+};
+
+/**
+ * whether nodes are in document order without duplicates
+ */
+inline bool IsDocumentOrder(const std::vector<shared_ptr<HtmlElement>>& nodes) {
+    for (size_t i = 1; i < nodes.size(); i++) {
+        if (!nodes[i - 1]->IsBefore(*nodes[i])) return false;
+    }
+    return true;
+}
+
+/**
+ * sort nodes of one tree into document order and drop duplicates, in
+ * O(k log k); query results are in order already and only checked
+ */
+inline void SortDocumentOrder(std::vector<shared_ptr<HtmlElement>>& nodes) {
+    if (IsDocumentOrder(nodes)) return;
+    std::sort(nodes.begin(), nodes.end(), HtmlDocumentOrder());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+}
+
+// nodes itself when in document order, else a sorted copy in storage
+inline const std::vector<shared_ptr<HtmlElement>>& InDocumentOrder(const std::vector<shared_ptr<HtmlElement>>& nodes,
+    std::vector<shared_ptr<HtmlElement>>& storage) {
+    if (IsDocumentOrder(nodes)) return nodes;
+    storage = nodes;
+    SortDocumentOrder(storage);
+    return storage;
+}
+
+/**
+ * set operations on nodes of one tree, e.g. the results of two queries;
+ * the result is in document order without duplicates. O(k) for inputs in
+ * document order, O(k log k) otherwise
+ */
+inline std::vector<shared_ptr<HtmlElement>> NodeUnion(const std::vector<shared_ptr<HtmlElement>>& a,
+    const std::vector<shared_ptr<HtmlElement>>& b) {
+    std::vector<shared_ptr<HtmlElement>> sortedA, sortedB, result;
+    const std::vector<shared_ptr<HtmlElement>>& x = InDocumentOrder(a, sortedA);
+    const std::vector<shared_ptr<HtmlElement>>& y = InDocumentOrder(b, sortedB);
+    std::set_union(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(result), HtmlDocumentOrder());
+    return result;
+}
+
+inline std::vector<shared_ptr<HtmlElement>> NodeIntersect(const std::vector<shared_ptr<HtmlElement>>& a,
+    const std::vector<shared_ptr<HtmlElement>>& b) {
+    std::vector<shared_ptr<HtmlElement>> sortedA, sortedB, result;
+    const std::vector<shared_ptr<HtmlElement>>& x = InDocumentOrder(a, sortedA);
+    const std::vector<shared_ptr<HtmlElement>>& y = InDocumentOrder(b, sortedB);
+    std::set_intersection(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(result), HtmlDocumentOrder());
+    return result;
+}
+
+/**
+ * the nodes of a not in b
+ */
+inline std::vector<shared_ptr<HtmlElement>> NodeExcept(const std::vector<shared_ptr<HtmlElement>>& a,
+    const std::vector<shared_ptr<HtmlElement>>& b) {
+    std::vector<shared_ptr<HtmlElement>> sortedA, sortedB, result;
+    const std::vector<shared_ptr<HtmlElement>>& x = InDocumentOrder(a, sortedA);
+    const std::vector<shared_ptr<HtmlElement>>& y = InDocumentOrder(b, sortedB);
+    std::set_difference(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(result), HtmlDocumentOrder());
+    return result;
+}
+
+inline bool CompiledXPath::Evaluate(HtmlElement& scope, std::vector<shared_ptr<HtmlElement>>& result) const {
+    if (steps_.empty()) return false;
+
+    // a rule starting with siblings of scope goes on below its parent
+    HtmlElement* root = &scope;
+    shared_ptr<HtmlElement> parent;
+    if (steps_[0].axis == AXIS_FOLLOWING_SIBLING || steps_[0].axis == AXIS_PRECEDING_SIBLING) {
+        parent = scope.parent.lock();
+        if (!parent) return false;
+        root = parent.get();
+    }
+
+    std::vector<HtmlElement*> context(1, &scope);
+    std::vector<HtmlElement*> out;
+    std::wstring text; // text() of a node, reused across nodes
+    for (size_t i = 0; i < steps_.size() && !context.empty(); i++) {
+        Pass pass = { &steps_[i], &context, 0, &out, &text };
+        out.clear();
+        bool inContext = context[0] == root;
+        if (inContext) pass.next = 1;
+        if (steps_[i].axis == AXIS_FOLLOWING_SIBLING || steps_[i].axis == AXIS_PRECEDING_SIBLING) Siblings(*root, pass);
+        else Walk(*root, inContext, inContext, pass);
+        context.swap(out);
+    }
+
+    for (size_t i = 0; i < context.size(); i++) {
+        result.push_back(context[i]->shared_from_this());
+    }
+    return !context.empty();
+}
+
+inline void CompiledXPath::Walk(HtmlElement& node, bool inContext, bool underContext, Pass& pass) const {
+    const std::vector<HtmlElement*>& context = *pass.context;
+    bool candidates = pass.step->axis == AXIS_CHILD ? inContext : underContext;
+    for (size_t i = 0; i < node.children.size(); i++) {
+        // past the last context node nothing outside it can match
+        if (pass.next == context.size() && !underContext) return;
+
+        HtmlElement* child = node.children[i].get();
+        bool childInContext = pass.next < context.size() && context[pass.next] == child;
+        if (childInContext) pass.next++;
+        if (candidates && Match(*child, *pass.step, *pass.text)) {
+            pass.out->push_back(child);
+        }
+        if (!child->children.empty()) {
+            Walk(*child, childInContext, underContext || childInContext, pass);
+        }
+    }
+}
+
+// siblings come from the position in the parent: scope's own from root,
+// its parent, the others through one walk in document order
+inline void CompiledXPath::Siblings(HtmlElement& root, Pass& pass) const {
+    const std::vector<HtmlElement*>& context = *pass.context;
+    bool following = pass.step->axis == AXIS_FOLLOWING_SIBLING;
+    if (pass.step == &steps_[0]) {
+        // the context of the first step is scope alone
+        const HtmlElement& scope = *context[0];
+        size_t begin = following ? scope.position + 1 : 0;
+        size_t end = following ? root.children.size() : std::min(scope.position, root.children.size());
+        for (size_t i = begin; i < end; i++) {
+            HtmlElement* sibling = root.children[i].get();
+            if (Match(*sibling, *pass.step, *pass.text)) pass.out->push_back(sibling);
+        }
+        return;
+    }
+
+    Bounds bounds;
+    for (size_t i = 0; i < context.size(); i++) {
+        shared_ptr<HtmlElement> parent = context[i]->parent.lock();
+        if (!parent) continue;
+        std::pair<Bounds::iterator, bool> it = bounds.insert(Bounds::value_type(parent.get(), context[i]->position));
+        // context is in document order: the first child seen is the first
+        if (!following) it.first->second = std::max(it.first->second, context[i]->position);
+    }
+    WalkSiblings(root, bounds, pass);
+}
+
+inline void CompiledXPath::WalkSiblings(HtmlElement& node, const Bounds& bounds, Pass& pass) const {
+    Bounds::const_iterator bound = bounds.find(&node);
+    bool following = pass.step->axis == AXIS_FOLLOWING_SIBLING;
+    for (size_t i = 0; i < node.children.size(); i++) {
+        HtmlElement* child = node.children[i].get();
+        if (bound != bounds.end() && (following ? i > bound->second : i < bound->second) && Match(*child, *pass.step, *pass.text)) {
+            pass.out->push_back(child);
+        }
+        if (!child->children.empty()) WalkSiblings(*child, bounds, pass);
+    }
+}
+
+inline bool CompiledXPath::Match(HtmlElement& node, const Step& step, std::wstring& text) const {
+    if (step.test == TEST_NAME && !HtmlAtom::Equal(node.atom, node.name, step.atom, step.name)) return false;
+    for (size_t i = 0; i < step.conditions.size(); i++) {
+        if (!Test(node, step.conditions[i], text)) return false;
+    }
+    return true;
+}
+
+inline bool CompiledXPath::Test(HtmlElement& node, const Condition& cond, std::wstring& text) {
+    node.EnsureAttributes();
+    switch (cond.predicate) {
+    case PRED_ATTR_EXISTS:
+        return node.attribute.Has(cond.key);
+
+    case PRED_ATTR_EQUALS: {
+        const std::wstring* value = node.attribute.Find(cond.key);
+        if (!value) return false;
+        if (cond.classTest) return std::find(node.classlist.begin(), node.classlist.end(), cond.literal) != node.classlist.end();
+        return *value == cond.literal;
+    }
+
+    case PRED_ATTR_CONTAINS:
+        return cond.classTest ? ClassContains(node.classlist, cond.literal) : AttrContains(node.attribute, cond.key, cond.literal);
+
+    case PRED_ATTR_STARTS_WITH:
+        return cond.classTest ? ClassStartsWith(node.classlist, cond.literal) : AttrStartsWith(node.attribute, cond.key, cond.literal);
+
+    case PRED_ATTR_ENDS_WITH:
+        return cond.classTest ? ClassEndsWith(node.classlist, cond.literal) : AttrEndsWith(node.attribute, cond.key, cond.literal);
+
+    case PRED_TEXT_EQUALS:
+    case PRED_TEXT_CONTAINS:
+    case PRED_TEXT_STARTS_WITH:
+    case PRED_TEXT_ENDS_WITH:
+        text.clear();
+        node.PlainStylize(text);
+        if (cond.predicate == PRED_TEXT_EQUALS) return text == cond.literal;
+        if (cond.predicate == PRED_TEXT_CONTAINS) return text.find(cond.literal) != std::wstring::npos;
+        if (cond.predicate == PRED_TEXT_STARTS_WITH) return StartsWith(text, cond.literal);
+        return EndsWith(text, cond.literal);
+
+    default:
+        return false;
+    }
+}
+
+inline bool CompiledSelector::Evaluate(HtmlElement& scope, std::vector<shared_ptr<HtmlElement>>& result) const {
+    size_t before = result.size();
+    Walk walk;
+    walk.out = &result;
+    walk.first = false;
+    Run(scope, walk);
+    return result.size() > before;
+}
+
+inline shared_ptr<HtmlElement> CompiledSelector::First(HtmlElement& scope) const {
+    std::vector<shared_ptr<HtmlElement>> result;
+    Walk walk;
+    walk.out = &result;
+    walk.first = true;
+    Run(scope, walk);
+    return result.empty() ? shared_ptr<HtmlElement>() : result[0];
+}
+
+inline void CompiledSelector::Run(HtmlElement& scope, Walk& walk) const {
+    if (selectors_.empty()) return;
+    Bloom bloom;
+    walk.bloom = bloom_ ? &bloom : nullptr;
+
+    // the path starts at the top of the tree, above the scope
+    for (shared_ptr<HtmlElement> p = scope.parent.lock(); p; p = p->parent.lock()) {
+        walk.above.push_back(p);
+    }
+    HtmlElement* parent = nullptr;
+    for (size_t i = walk.above.size() + 1; i-- > 0;) {
+        HtmlElement* node = i ? walk.above[i - 1].get() : &scope;
+        size_t child = std::wstring::npos, position = 0;
+        if (parent) {
+            for (size_t j = 0; j < parent->children.size(); j++) {
+                if (IsElement(*parent->children[j])) position++;
+                if (parent->children[j].get() == node) {
+                    child = j;
+                    break;
+                }
+            }
+            if (!IsElement(*node)) position = 0;
+        }
+        Push(*node, child, position, walk);
+        AddKeys(walk);
+        parent = node;
+    }
+    Visit(scope, walk);
+}
+
+inline bool CompiledSelector::Visit(HtmlElement& node, Walk& walk) const {
+    size_t position = 0;
+    for (size_t i = 0; i < node.children.size(); i++) {
+        HtmlElement& child = *node.children[i];
+        if (!IsElement(child)) continue;
+
+        Push(child, i, ++position, walk);
+        bool done = false;
+        if (Matches(walk)) {
+            walk.out->push_back(node.children[i]);
+            done = walk.first;
+        }
+        if (!done && !child.children.empty()) {
+            AddKeys(walk);
+            done = Visit(child, walk);
+        }
+        Pop(walk);
+        if (done) return true;
+    }
+    return false;
+}
+
+inline void CompiledSelector::Push(HtmlElement& node, size_t child, size_t position, Walk& walk) {
+    Frame frame = { &node, child, position, 0 };
+    walk.path.push_back(frame);
+}
+
+// the keys of the last frame go into the filter once it is an ancestor
+inline void CompiledSelector::AddKeys(Walk& walk) {
+    Frame& frame = walk.path.back();
+    if (!walk.bloom || !IsElement(*frame.node)) return;
+
+    HtmlElement& node = *frame.node;
+    node.EnsureAttributes();
+    size_t before = walk.keys.size();
+    walk.keys.push_back(Key(L'<', node.name.data(), node.name.size()));
+    const std::wstring* id = node.attribute.Find(L"id");
+    if (id) walk.keys.push_back(Key(L'#', id->data(), id->size()));
+    for (size_t i = 0; i < node.classlist.size(); i++) {
+        walk.keys.push_back(Key(L'.', node.classlist[i].data(), node.classlist[i].size()));
+    }
+    for (size_t i = before; i < walk.keys.size(); i++) walk.bloom->Add(walk.keys[i]);
+    frame.keys = walk.keys.size() - before;
+}
+
+inline void CompiledSelector::Pop(Walk& walk) {
+    for (size_t i = walk.path.back().keys; i > 0; i--) {
+        walk.bloom->Remove(walk.keys.back());
+        walk.keys.pop_back();
+    }
+    walk.path.pop_back();
+}
+
+inline bool CompiledSelector::Matches(const Walk& walk) const {
+    const Frame& frame = walk.path.back();
+    for (size_t i = 0; i < selectors_.size(); i++) {
+        const Selector& sel = selectors_[i];
+        if (!MatchCompound(sel.compounds.back(), *frame.node, frame.position)) continue;
+
+        bool possible = true;
+        for (size_t j = 0; walk.bloom && possible && j < sel.ancestorKeys.size(); j++) {
+            possible = walk.bloom->MayContain(sel.ancestorKeys[j]);
+        }
+        if (possible && MatchLeft(sel, sel.compounds.size() - 1, walk, walk.path.size() - 1, frame.child, frame.position)) return true;
+    }
+    return false;
+}
+
+// compound k matched the element children[child] of path[depth - 1]
+inline bool CompiledSelector::MatchLeft(const Selector& sel, size_t k, const Walk& walk, size_t depth, size_t child, size_t position) {
+    if (k == 0) return true;
+    const Compound& left = sel.compounds[k - 1];
+    Combinator comb = sel.compounds[k].combinator;
+    if (depth == 0) return false;
+
+    if (comb == COMB_CHILD || comb == COMB_DESCENDANT) {
+        for (size_t a = depth; a-- > 0;) {
+            const Frame& up = walk.path[a];
+            if (MatchCompound(left, *up.node, up.position) && MatchLeft(sel, k - 1, walk, a, up.child, up.position)) return true;
+            if (comb == COMB_CHILD) break;
+        }
+        return false;
+    }
+
+    const std::vector<shared_ptr<HtmlElement>>& siblings = walk.path[depth - 1].node->children;
+    for (size_t j = child; j-- > 0;) {
+        HtmlElement& sibling = *siblings[j];
+        if (!IsElement(sibling)) continue;
+        position--;
+        if (MatchCompound(left, sibling, position) && MatchLeft(sel, k - 1, walk, depth, j, position)) return true;
+        if (comb == COMB_ADJACENT) break;
+    }
+    return false;
+}
+
+inline bool CompiledSelector::MatchCompound(const Compound& compound, HtmlElement& node, size_t position) {
+    if (!IsElement(node)) return false;
+    if (!compound.name.empty() && !HtmlAtom::Equal(node.atom, node.name, compound.atom, compound.name)) return false;
+
+    if (!compound.id.empty() || !compound.classes.empty() || !compound.attrs.empty()) {
+        node.EnsureAttributes();
+    }
+    if (!compound.id.empty()) {
+        const std::wstring* id = node.attribute.Find(L"id");
+        if (!id || *id != compound.id) return false;
+    }
+    for (size_t i = 0; i < compound.classes.size(); i++) {
+        if (std::find(node.classlist.begin(), node.classlist.end(), compound.classes[i]) == node.classlist.end()) return false;
+    }
+    for (size_t i = 0; i < compound.attrs.size(); i++) {
+        if (!MatchAttr(compound.attrs[i], node)) return false;
+    }
+    for (size_t i = 0; i < compound.nth.size(); i++) {
+        long a = compound.nth[i].first, b = compound.nth[i].second;
+        long p = static_cast<long>(position);
+        if (p == 0) return false;
+        if (a == 0 ? p != b : (p - b) % a != 0 || (p - b) / a < 0) return false;
+    }
+    return true;
+}
+
+inline bool CompiledSelector::MatchAttr(const AttrTest& test, HtmlElement& node) {
+    const std::wstring* found = node.attribute.Find(test.key);
+    if (!found) found = node.attribute.FindIgnoreCase(test.key);
+    if (!found) return false;
+
+    const std::wstring& v = *found;
+    const std::wstring& want = test.value;
+    switch (test.op) {
+    case ATTR_EXISTS:
+        return true;
+
+    case ATTR_EQUALS:
+        return v == want;
+
+    case ATTR_PREFIX:
+        return !want.empty() && StartsWith(v, want);
+
+    case ATTR_SUFFIX:
+        return !want.empty() && EndsWith(v, want);
+
+    case ATTR_SUBSTRING:
+        return !want.empty() && v.find(want) != std::wstring::npos;
+
+    case ATTR_WORD: {
+        if (want.empty()) return false;
+        if (found == node.attribute.Find(L"class")) {
+            return std::find(node.classlist.begin(), node.classlist.end(), want) != node.classlist.end();
+        }
+        for (size_t i = 0; i < v.size();) {
+            while (i < v.size() && iswspace(v[i])) i++;
+            size_t start = i;
+            while (i < v.size() && !iswspace(v[i])) i++;
+            if (i - start == want.size() && v.compare(start, want.size(), want) == 0) return true;
+        }
+        return false;
+    }
+    }
+    return false;
+}
+
+inline bool CompiledSelector::IsElement(const HtmlElement& node) {
+    return node.atom != HtmlAtom::NONE && node.atom != HtmlAtom::PLAIN;
+}
+
+inline HtmlIndex::~HtmlIndex() {
+    Attach(root_, nullptr);
+}
+
+inline void HtmlIndex::Rebuild() {
+    ids_.clear();
+    classes_.clear();
+    tags_.clear();
+    stale_ = false;
+    root_->index = this;
+    for (size_t i = 0; i < root_->children.size(); i++) {
+        Collect(root_->children[i].get());
+    }
+}
+
+inline void HtmlIndex::Collect(HtmlElement* element) {
+    element->index = this;
+    Add(element);
+    for (size_t i = 0; i < element->children.size(); i++) {
+        Collect(element->children[i].get());
+    }
+}
+
+inline void HtmlIndex::Add(HtmlElement* element) {
+    AddTo(element, ids_, classes_, tags_);
+}
+
+inline void HtmlIndex::AddTo(HtmlElement* element, Map& ids, Map& classes, Map& tags) {
+    if (element->atom != HtmlAtom::NONE && element->atom != HtmlAtom::PLAIN) {
+        key_.assign(element->name);
+        for (size_t i = 0; i < key_.size(); i++) key_[i] = static_cast<wchar_t>(std::towlower(key_[i]));
+        tags[key_].push_back(element);
+    }
+
+    element->EnsureAttributes();
+    const std::wstring* id = element->attribute.Find(L"id");
+    if (id) ids[*id].push_back(element);
+    const std::vector<std::wstring>& classlist = element->classlist;
+    for (size_t i = 0; i < classlist.size(); i++) {
+        Nodes& nodes = classes[classlist[i]];
+        if (nodes.empty() || nodes.back() != element) nodes.push_back(element);
+    }
+}
+
+inline void HtmlIndex::Gather(HtmlElement* element, Run& run) {
+    AddTo(element, run.ids, run.classes, run.tags);
+    for (size_t i = 0; i < element->children.size(); i++) {
+        Gather(element->children[i].get(), run);
+    }
+}
+
+// the children are one run in document order, so are their labels:
+// a key gets one insert or erase, whatever the number of nodes
+inline void HtmlIndex::InsertChildren(HtmlElement* parent, size_t from, size_t to) {
+    if (stale_) return;
+    Run run;
+    for (size_t i = from; i < to; i++) Gather(parent->children[i].get(), run);
+    Splice(ids_, run.ids);
+    Splice(classes_, run.classes);
+    Splice(tags_, run.tags);
+}
+
+inline void HtmlIndex::RemoveChildren(HtmlElement* parent, size_t from, size_t to) {
+    if (stale_) return;
+    Run run;
+    for (size_t i = from; i < to; i++) Gather(parent->children[i].get(), run);
+    Cut(ids_, run.ids);
+    Cut(classes_, run.classes);
+    Cut(tags_, run.tags);
+}
+
+inline void HtmlIndex::Unlink(HtmlElement* element) {
+    if (stale_) return;
+    const std::wstring* id = element->attribute.Find(L"id");
+    if (id) Erase(ids_, *id, element);
+    for (size_t i = 0; i < element->classlist.size(); i++) {
+        Erase(classes_, element->classlist[i], element);
+    }
+}
+
+inline void HtmlIndex::Link(HtmlElement* element) {
+    if (stale_) return;
+    const std::wstring* id = element->attribute.Find(L"id");
+    if (id) Insert(ids_, *id, element);
+    for (size_t i = 0; i < element->classlist.size(); i++) {
+        Insert(classes_, element->classlist[i], element);
+    }
+}
+
+inline void HtmlIndex::Attach(HtmlElement* element, HtmlIndex* index) {
+    element->index = index;
+    for (size_t i = 0; i < element->children.size(); i++) {
+        Attach(element->children[i].get(), index);
+    }
+}
+
+inline void HtmlIndex::Insert(Map& map, const std::wstring& key, HtmlElement* element) {
+    Nodes& nodes = map[key];
+    Nodes::iterator it = std::lower_bound(nodes.begin(), nodes.end(), element, Before);
+    if (it == nodes.end() || *it != element) nodes.insert(it, element);
+}
+
+inline void HtmlIndex::Splice(Map& map, const Map& run) {
+    for (Map::const_iterator it = run.begin(); it != run.end(); ++it) {
+        Nodes& nodes = map[it->first];
+        Nodes::iterator at = std::lower_bound(nodes.begin(), nodes.end(), it->second.front(), Before);
+        nodes.insert(at, it->second.begin(), it->second.end());
+    }
+}
+
+inline void HtmlIndex::Cut(Map& map, const Map& run) {
+    for (Map::const_iterator it = run.begin(); it != run.end(); ++it) {
+        Map::iterator found = map.find(it->first);
+        if (found == map.end()) continue;
+        Nodes& nodes = found->second;
+        Nodes::iterator first = std::lower_bound(nodes.begin(), nodes.end(), it->second.front(), Before);
+        Nodes::iterator last = std::upper_bound(first, nodes.end(), it->second.back(), Before);
+        nodes.erase(first, last);
+        if (nodes.empty()) map.erase(found);
+    }
+}
+
+inline void HtmlIndex::Erase(Map& map, const std::wstring& key, HtmlElement* element) {
+    Map::iterator found = map.find(key);
+    if (found == map.end()) return;
+    Nodes& nodes = found->second;
+    Nodes::iterator it = std::lower_bound(nodes.begin(), nodes.end(), element, Before);
+    if (it != nodes.end() && *it == element) nodes.erase(it);
+    if (nodes.empty()) map.erase(found);
+}
+
+inline bool HtmlIndex::Before(const HtmlElement* a, const HtmlElement* b) {
+    return a->order < b->order;
+}
+
+/**
+ * sinks for HtmlSerializer. a sink has a char_type (wchar_t, or char for
+ * UTF-8), Write(const char_type*, size_t) and Flush()
+ */
+template <typename CharT>
+class HtmlStringSink {
+public:
+    typedef CharT char_type;
+
+    /**
+     * @param out written to at its end, not cleared first
+     */
+    explicit HtmlStringSink(std::basic_string<CharT>& out) : out_(out) {}
+
+    void Write(const CharT* data, size_t len) { out_.append(data, len); }
+    void Flush() {}
+
+private:
+    std::basic_string<CharT>& out_;
+};
+
+/**
+ * UTF-8 to a stdio stream, stdio does the buffering
+ */
+class HtmlFileSink {
+public:
+    typedef char char_type;
+
+    explicit HtmlFileSink(FILE* file) : file_(file), failed_(false) {}
+
+    void Write(const char* data, size_t len) {
+        if (!failed_ && fwrite(data, 1, len, file_) != len) failed_ = true;
+    }
+
+    void Flush() {
+        if (!failed_ && fflush(file_) != 0) failed_ = true;
+    }
+
+    /**
+     * a write failed, what followed it was dropped
+     */
+    bool Failed() const { return failed_; }
+
+private:
+    FILE* file_;
+    bool failed_;
+};
+
+#if defined(HTMLPARSER_POSIX)
+/**
+ * UTF-8 to a file descriptor. HtmlSerializer hands it whole buffers, so
+ * it writes straight through; the descriptor stays open
+ */
+class HtmlFdSink {
+public:
+    typedef char char_type;
+
+    explicit HtmlFdSink(int fd) : fd_(fd), failed_(false) {}
+
+    void Write(const char* data, size_t len) {
+        while (len > 0 && !failed_) {
+            ssize_t n = ::write(fd_, data, len);
+            if (n < 0) {
+                if (errno != EINTR) failed_ = true;
+                continue;
+            }
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+
+    void Flush() {}
+
+    bool Failed() const { return failed_; }
+
+private:
+    int fd_;
+    bool failed_;
+};
+#endif
+
+/**
+ * hands the output over in chunks of up to chunk characters. what is
+ * left goes out on Flush or when the sink is destroyed
+ */
+template <typename CharT>
+class HtmlCallbackSink {
+public:
+    typedef CharT char_type;
+    typedef std::function<void(const CharT*, size_t)> Callback;
+
+    explicit HtmlCallbackSink(Callback callback, size_t chunk = 16384)
+        : callback_(callback), chunk_(chunk ? chunk : 1) {
+        buffer_.reserve(chunk_);
+    }
+
+    ~HtmlCallbackSink() {
+        Flush();
+    }
+
+    void Write(const CharT* data, size_t len) {
+        if (buffer_.size() + len > chunk_) {
+            Flush();
+            if (len >= chunk_) {
+                callback_(data, len);
+                return;
+            }
+        }
+        buffer_.insert(buffer_.end(), data, data + len);
+    }
+
+    void Flush() {
+        if (buffer_.empty()) return;
+        callback_(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+private:
+    HtmlCallbackSink(const HtmlCallbackSink&);
+    HtmlCallbackSink& operator=(const HtmlCallbackSink&);
+
+    Callback callback_;
+    size_t chunk_;
+    std::vector<CharT> buffer_;
+};
+
+/**
+ * puts HtmlSerializer output into a sink: wide text as it is, UTF-8
+ * encoded through a buffer so the sink sees few large writes
+ */
+template <typename CharT, typename Sink>
+class HtmlSinkWriter;
+
+template <typename Sink>
+class HtmlSinkWriter<wchar_t, Sink> {
+public:
+    explicit HtmlSinkWriter(Sink& sink) : sink_(sink) {}
+
+    void Put(const wchar_t* data, size_t len) {
+        if (len) sink_.Write(data, len);
+    }
+
+    void Finish() { sink_.Flush(); }
+
+    static size_t Length(const wchar_t*, size_t len) { return len; }
+
+private:
+    Sink& sink_;
+};
+
+template <typename Sink>
+class HtmlSinkWriter<char, Sink> {
+public:
+    explicit HtmlSinkWriter(Sink& sink) : sink_(sink), used_(0) {}
+
+    void Put(const wchar_t* data, size_t len) {
+        size_t i = 0;
+        while (i < len) {
+            if (used_ + 4 > sizeof(buffer_)) Drain();
+            unsigned int c = static_cast<unsigned int>(data[i]);
+            if (c < 0x80) {
+                // ASCII stretch, as much of it as fits
+                size_t end = std::min(len, i + sizeof(buffer_) - used_);
+                do {
+                    buffer_[used_++] = static_cast<char>(c);
+                    if (++i == end) break;
+                    c = static_cast<unsigned int>(data[i]);
+                } while (c < 0x80);
+                continue;
+            }
+            used_ += EncodeUtf8(data, len, i, buffer_ + used_);
+        }
+    }
+
+    void Finish() {
+        Drain();
+        sink_.Flush();
+    }
+
+    static size_t Length(const wchar_t* data, size_t len) {
+        return Utf8Length(data, len);
+    }
+
+private:
+    void Drain() {
+        if (used_) sink_.Write(buffer_, used_);
+        used_ = 0;
+    }
+
+    Sink& sink_;
+    size_t used_;
+    char buffer_[8192];
+};
+
+/**
+ * class HtmlSerializer
+ * writes the markup of a subtree to a sink (see HtmlStringSink,
+ * HtmlFileSink, HtmlFdSink, HtmlCallbackSink) with no string built per
+ * node, wide or UTF-8 as the sink takes it. Size gives the exact length
+ * beforehand, for a single reservation
+ */
+class HtmlSerializer {
+public:
+    enum Scope {
+        OUTER,  // the element and what is below it
+        INNER   // only what is below it
+    };
+
+    template <typename Sink>
+    static void Write(const HtmlElement& node, Sink& sink, Scope scope = OUTER) {
+        typedef HtmlSinkWriter<typename Sink::char_type, Sink> Writer;
+        Writer writer(sink);
+        if (scope == OUTER) Outer(node, writer);
+        else Inner(node, writer);
+        writer.Finish();
+    }
+
+    /**
+     * length of the output in CharT: wchar_t, or char for UTF-8 bytes
+     */
+    template <typename CharT>
+    static size_t Size(const HtmlElement& node, Scope scope = OUTER) {
+        typedef HtmlSinkWriter<CharT, HtmlStringSink<CharT> > Writer;
+        return scope == OUTER ? OuterSize<Writer>(node) : InnerSize<Writer>(node);
+    }
+
+    /**
+     * the output as one string, allocated once
+     */
+    template <typename CharT>
+    static std::basic_string<CharT> ToString(const HtmlElement& node, Scope scope = OUTER) {
+        std::basic_string<CharT> str;
+        Append(node, str, scope);
+        return str;
+    }
+
+    template <typename CharT>
+    static void Append(const HtmlElement& node, std::basic_string<CharT>& str, Scope scope = OUTER) {
+        str.reserve(str.size() + Size<CharT>(node, scope));
+        HtmlStringSink<CharT> sink(str);
+        Write(node, sink, scope);
+    }
+
+private:
+    template <typename Writer>
+    static void Put(Writer& writer, const std::wstring& str) {
+        writer.Put(str.data(), str.size());
+    }
+
+    template <typename Writer>
+    static void Outer(const HtmlElement& node, Writer& writer);
+
+    template <typename Writer>
+    static void Inner(const HtmlElement& node, Writer& writer);
+
+    template <typename Writer>
+    static size_t OuterSize(const HtmlElement& node);
+
+    template <typename Writer>
+    static size_t InnerSize(const HtmlElement& node);
+};
+
+template <typename Writer>
+inline void HtmlSerializer::Outer(const HtmlElement& node, Writer& writer) {
+    if (node.atom == HtmlAtom::NONE) {
+        for (size_t i = 0; i < node.children.size(); i++) Outer(*node.children[i], writer);
+        return;
+    }
+    if (node.atom == HtmlAtom::PLAIN) {
+        node.EnsureValue();
+        Put(writer, node.value);
+        return;
+    }
+
+    node.EnsureAttributes();
+    writer.Put(L"<", 1);
+    Put(writer, node.name);
+    for (HtmlAttributes::const_iterator it = node.attribute.begin(); it != node.attribute.end(); ++it) {
+        writer.Put(L" ", 1);
+        Put(writer, it->first);
+        writer.Put(L"=\"", 2);
+        Put(writer, it->second);
+        writer.Put(L"\"", 1);
+    }
+    writer.Put(L">", 1);
+    Inner(node, writer);
+    writer.Put(L"</", 2);
+    Put(writer, node.name);
+    writer.Put(L">", 1);
+}
+
+template <typename Writer>
+inline void HtmlSerializer::Inner(const HtmlElement& node, Writer& writer) {
+    if (node.children.empty()) {
+        node.EnsureValue();
+        Put(writer, node.value);
+        return;
+    }
+    for (size_t i = 0; i < node.children.size(); i++) Outer(*node.children[i], writer);
+}
+
+template <typename Writer>
+inline size_t HtmlSerializer::OuterSize(const HtmlElement& node) {
+    if (node.atom == HtmlAtom::NONE) {
+        size_t size = 0;
+        for (size_t i = 0; i < node.children.size(); i++) size += OuterSize<Writer>(*node.children[i]);
+        return size;
+    }
+    if (node.atom == HtmlAtom::PLAIN) {
+        node.EnsureValue();
+        return Writer::Length(node.value.data(), node.value.size());
+    }
+
+    node.EnsureAttributes();
+    // "<" name ">" ... "</" name ">", every name is written twice
+    size_t size = 5 + 2 * Writer::Length(node.name.data(), node.name.size());
+    for (HtmlAttributes::const_iterator it = node.attribute.begin(); it != node.attribute.end(); ++it) {
+        // " " key "=\"" value "\""
+        size += 4 + Writer::Length(it->first.data(), it->first.size()) + Writer::Length(it->second.data(), it->second.size());
+    }
+    return size + InnerSize<Writer>(node);
+}
+
+template <typename Writer>
+inline size_t HtmlSerializer::InnerSize(const HtmlElement& node) {
+    if (node.children.empty()) {
+        node.EnsureValue();
+        return Writer::Length(node.value.data(), node.value.size());
+    }
+    size_t size = 0;
+    for (size_t i = 0; i < node.children.size(); i++) size += OuterSize<Writer>(*node.children[i]);
+    return size;
+}
+
+/**
+ * class HtmlTextExtractor
+ * text() of a subtree: the text nodes in order, outside script, style and
+ * the like, a tab before table cells and a line break before block
+ * elements (the separator flags of HtmlAtom). writes to a sink like
+ * HtmlSerializer, or to a string sized by a first pass
+ */
+class HtmlTextExtractor {
+public:
+    struct Options {
+        /**
+         * runs of white space become one space and white space next to a
+         * tab or line break goes, so does white space at either end
+         */
+        bool collapse_whitespace;
+
+        /**
+         * stop after this many wchar_t of text
+         */
+        size_t max_length;
+
+        Options() : collapse_whitespace(false), max_length(static_cast<size_t>(-1)) {}
+    };
+
+    HtmlTextExtractor() {}
+
+    explicit HtmlTextExtractor(const Options& options) : options_(options) {}
+
+    /**
+     * @return false when the text was cut at max_length
+     */
+    template <typename Sink>
+    bool Write(const HtmlElement& node, Sink& sink) const {
+        HtmlSinkWriter<typename Sink::char_type, Sink> writer(sink);
+        bool complete = Run(node, writer);
+        writer.Finish();
+        return complete;
+    }
+
+    /**
+     * length of the text in CharT: wchar_t, or char for UTF-8 bytes
+     */
+    template <typename CharT>
+    size_t Size(const HtmlElement& node) const {
+        Counter<CharT> counter;
+        Run(node, counter);
+        return counter.size;
+    }
+
+    std::wstring Extract(const HtmlElement& node) const {
+        std::wstring str;
+        Append(node, str);
+        return str;
+    }
+
+    template <typename CharT>
+    void Append(const HtmlElement& node, std::basic_string<CharT>& str) const {
+        str.reserve(str.size() + Size<CharT>(node));
+        HtmlStringSink<CharT> sink(str);
+        Write(node, sink);
+    }
+
+private:
+    template <typename CharT>
+    struct Counter {
+        Counter() : size(0) {}
+
+        void Put(const wchar_t* data, size_t len) {
+            size += HtmlSinkWriter<CharT, HtmlStringSink<CharT> >::Length(data, len);
+        }
+
+        size_t size;
+    };
+
+    // separators, a stronger one wins where several meet
+    enum Gap {
+        GAP_NONE,
+        GAP_SPACE,
+        GAP_TAB,
+        GAP_LINE
+    };
+
+    template <typename Writer>
+    class Walk {
+    public:
+        Walk(const Options& options, Writer& writer)
+            : options_(options), writer_(writer), left_(options.max_length), gap_(GAP_NONE), started_(false) {
+        }
+
+        // false once max_length is reached
+        bool Node(const HtmlElement& node) {
+            if (HtmlAtom::Is(node.atom, HtmlAtom::FLAG_NO_TEXT)) return true;
+
+            if (node.atom == HtmlAtom::PLAIN) {
+                node.EnsureValue();
+                return Text(node.value.data(), node.value.size());
+            }
+
+            for (size_t i = 0; i < node.children.size();) {
+                if (!Node(*node.children[i])) return false;
+                if (++i < node.children.size()) {
+                    unsigned flags = HtmlAtom::Flags(node.children[i]->atom);
+                    if (flags & HtmlAtom::FLAG_TAB) {
+                        if (!Separate(GAP_TAB)) return false;
+                    }
+                    else if (flags & HtmlAtom::FLAG_LINE) {
+                        if (!Separate(GAP_LINE)) return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+    private:
+        static bool IsSpace(wchar_t c) {
+            return c == L' ' || c == L'\t' || c == L'\n' || c == L'\r' || c == L'\f';
+        }
+
+        bool Separate(Gap gap) {
+            if (!options_.collapse_whitespace) {
+                return Put(gap == GAP_TAB ? L"\t" : L"\n", 1);
+            }
+            if (gap > gap_) gap_ = gap;
+            return true;
+        }
+
+        bool Text(const wchar_t* data, size_t len) {
+            if (!options_.collapse_whitespace) return Put(data, len);
+
+            size_t i = 0;
+            while (i < len) {
+                if (IsSpace(data[i])) {
+                    if (gap_ < GAP_SPACE) gap_ = GAP_SPACE;
+                    i++;
+                    continue;
+                }
+                size_t end = i + 1;
+                while (end < len && !IsSpace(data[end])) end++;
+                if (started_ && gap_ != GAP_NONE) {
+                    static const wchar_t gaps[] = { L' ', L' ', L'\t', L'\n' };
+                    if (!Put(&gaps[gap_], 1)) return false;
+                }
+                gap_ = GAP_NONE;
+                started_ = true;
+                if (!Put(data + i, end - i)) return false;
+                i = end;
+            }
+            return true;
+        }
+
+        bool Put(const wchar_t* data, size_t len) {
+            if (len <= left_) {
+                writer_.Put(data, len);
+                left_ -= len;
+                return true;
+            }
+            len = left_;
+            // do not cut a surrogate pair in two
+            if (sizeof(wchar_t) == 2 && len > 0 && data[len - 1] >= 0xD800 && data[len - 1] <= 0xDBFF) len--;
+            writer_.Put(data, len);
+            left_ = 0;
+            return false;
+        }
+
+        const Options& options_;
+        Writer& writer_;
+        size_t left_;
+        Gap gap_;
+        bool started_;
+    };
+
+    template <typename Writer>
+    bool Run(const HtmlElement& node, Writer& writer) const {
+        Walk<Writer> walk(options_, writer);
+        return walk.Node(node);
+    }
+
+    Options options_;
+};
+
+template <typename Sink>
+inline void HtmlElement::WriteHTML(Sink& sink, bool outer) const {
+    HtmlSerializer::Write(*this, sink, outer ? HtmlSerializer::OUTER : HtmlSerializer::INNER);
+}
+
+inline std::wstring HtmlElement::text() {
+    return HtmlTextExtractor().Extract(*this);
+}
+
+inline void HtmlElement::PlainStylize(std::wstring& str) {
+    // no sizing pass, the callers reuse str
+    HtmlStringSink<wchar_t> sink(str);
+    HtmlTextExtractor().Write(*this, sink);
+}
+
+inline std::wstring HtmlElement::OuterHTML() {
+    return HtmlSerializer::ToString<wchar_t>(*this);
+}
+
+inline std::wstring HtmlElement::InnerHTML() {
+    return HtmlSerializer::ToString<wchar_t>(*this, HtmlSerializer::INNER);
+}
+
+inline void HtmlElement::HtmlStylize(std::wstring& str) {
+    HtmlSerializer::Append(*this, str);
+}
+
+/**
+ * class HtmlDocument
+ * Html Doc struct
+ */
+class HtmlDocument {
+public:
+    HtmlDocument(shared_ptr<HtmlElement>& root)
+        : warnings_(), root_(root) {
+    }
+
+    HtmlDocument(shared_ptr<HtmlElement>& root, const shared_ptr<HtmlArena>& arena)
+        : warnings_(), root_(root), arena_(arena) {
+    }
+
+    HtmlDocument(shared_ptr<HtmlElement>& root, const shared_ptr<HtmlArena>& arena, const shared_ptr<HtmlIndex>& index)
+        : warnings_(), root_(root), arena_(arena), index_(index) {
+    }
+
+    std::shared_ptr<HtmlElement> GetRoot() {
+        return root_;
+    }
+
+    /**
+     * arena holding the nodes, null unless parsed in arena mode
+     */
+    shared_ptr<HtmlArena> GetArena() {
+        return arena_;
+    }
+
+    /**
+     * build (or rebuild) the id, class and tag index of the document, as
+     * HtmlParser::SetIndexMode does while parsing. GetElementById,
+     * GetElementsById, GetElementsByClassName and GetElementByTagName then
+     * cost a hash lookup plus the size of the result.
+     */
+    void BuildIndex() {
+        if (!index_) index_ = std::make_shared<HtmlIndex>(root_.get());
+        index_->Rebuild();
+    }
+
+    /**
+     * index of the document, null unless built
+     */
+    shared_ptr<HtmlIndex> GetIndex() {
+        return index_;
+    }
+
+    shared_ptr<HtmlElement> GetElementById(const std::wstring& id) {
+        return root_->GetElementById(id);
+    }
+
+    std::vector<shared_ptr<HtmlElement> >  GetElementsById(const std::wstring& id) {
+        return root_->GetElementsById(id);
+    }
+
+    std::vector<shared_ptr<HtmlElement> > GetElementsByClassName(const std::wstring& name) {
+        return root_->GetElementsByClassName(name);
+    }
+    std::vector<shared_ptr<HtmlElement> > GetElementByTagName(const std::wstring& name) {
+        return root_->GetElementByTagName(name);
+    }
+
+    void SelectElement(const std::wstring& rule, std::vector<std::shared_ptr<HtmlElement>>& result) {
+        SelectElement(*CompiledXPathCache::Global().Get(rule), result);
+    }
+
+    /**
+     * select with a rule compiled beforehand
+     * @param xpath
+     * @param result matches are appended
+     */
+    void SelectElement(const CompiledXPath& xpath, std::vector<std::shared_ptr<HtmlElement>>& result) {
+        xpath.Evaluate(*root_, result);
+    }
+
+    shared_ptr<HtmlElement> SelectFirst(const std::wstring& rule) {
+        return root_->SelectFirst(rule);
+    }
+
+    shared_ptr<HtmlElement> SelectFirst(const CompiledXPath& xpath) {
+        return root_->SelectFirst(xpath);
+    }
+
+    bool SelectAny(const std::wstring& rule) {
+        return root_->SelectAny(rule);
+    }
+
+    bool SelectAny(const CompiledXPath& xpath) {
+        return root_->SelectAny(xpath);
+    }
+
+    size_t SelectCount(const std::wstring& rule) {
+        return root_->SelectCount(rule);
+    }
+
+    size_t SelectCount(const CompiledXPath& xpath) {
+        return root_->SelectCount(xpath);
+    }
+
+    HtmlElement::XPathRange Select(const std::wstring& rule) {
+        return root_->Select(rule);
+    }
+
+    HtmlElement::XPathRange Select(const CompiledXPath& xpath) {
+        return root_->Select(xpath);
+    }
+
+    std::vector<shared_ptr<HtmlElement> > SelectElement(std::vector<std::wstring> ruleToken, size_t rtSize, std::vector<shared_ptr<HtmlElement>>& result) {
+        root_->SelectElement(ruleToken, rtSize, result);
+        return result;
+    }
+
+    shared_ptr<HtmlElement> QuerySelector(const std::wstring& selector) {
+        return root_->QuerySelector(selector);
+    }
+
+    shared_ptr<HtmlElement> QuerySelector(const CompiledSelector& selector) {
+        return root_->QuerySelector(selector);
+    }
+
+    std::vector<shared_ptr<HtmlElement>> QuerySelectorAll(const std::wstring& selector) {
+        return root_->QuerySelectorAll(selector);
+    }
+
+    std::vector<shared_ptr<HtmlElement>> QuerySelectorAll(const CompiledSelector& selector) {
+        return root_->QuerySelectorAll(selector);
+    }
+
+    std::wstring OuterHTML() {
+        return root_->OuterHTML();
+    }
+    std::wstring InnerHTML() {
+        return root_->InnerHTML();
+    }
+
+    /**
+     * writes the document markup to a sink, see HtmlSerializer
+     */
+    template <typename Sink>
+    void WriteHTML(Sink& sink) const {
+        root_->WriteHTML(sink);
+    }
+    std::wstring text() {
+        return root_->text();
+    }
+
+    /**
+     * diagnostics the parse that built this document counted, reported to
+     * a sink or not (see HtmlParser::SetDiagnostics)
+     */
+    size_t GetWarningCount() const {
+        size_t total = 0;
+        for (size_t i = 0; i < HtmlDiagnostic::CODE_COUNT; i++) total += warnings_[i];
+        return total;
+    }
+
+    size_t GetWarningCount(HtmlDiagnostic::Code code) const {
+        return warnings_[code];
+    }
+
+#if defined(HTMLPARSER_STATS)
+    /**
+     * what the parse that built this document did
+     */
+    const ParseStats& GetStats() const {
+        return stats_;
+    }
+#endif
+
+private:
+    template <typename CharT> friend class HtmlParseContext;
+
+    size_t warnings_[HtmlDiagnostic::CODE_COUNT];
+#if defined(HTMLPARSER_STATS)
+    ParseStats stats_;
+#endif
+    shared_ptr<HtmlElement> root_;
+    shared_ptr<HtmlArena> arena_;
+    shared_ptr<HtmlIndex> index_;   // last member, released while the tree is still alive
+};
+
+/**
+ * class HtmlThreadPool
+ * work-stealing pool behind HtmlParser::ParseMany and ParseAsync. every
+ * worker has its own queue: it runs its newest task first and, when that
+ * is empty, steals the oldest task of another worker. a task submitted
+ * from a worker goes to that worker's queue, others are dealt out in
+ * turn. a thread waiting on the pool can run queued tasks itself (RunOne),
+ * so waiting from inside a task does not deadlock.
+ */
+class HtmlThreadPool {
+public:
+    /**
+     * @param threads 0: one per hardware thread
+     */
+    explicit HtmlThreadPool(size_t threads = 0) : pending_(0), next_(0), stop_(false) {
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; i++) {
+            queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+        }
+        for (size_t i = 0; i < threads; i++) {
+            workers_.push_back(std::thread(&HtmlThreadPool::Work, this, i));
+        }
+    }
+
+    /**
+     * runs what is still queued, then joins the workers
+     */
+    ~HtmlThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (size_t i = 0; i < workers_.size(); i++) {
+            workers_[i].join();
+        }
+    }
+
+    void Submit(std::function<void()> task) {
+        size_t queue = Self() ? Worker() : next_++ % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+            queues_[queue]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_++;
+        }
+        wake_.notify_one();
+    }
+
+    /**
+     * run one queued task on the calling thread
+     * @return false if there was none
+     */
+    bool RunOne() {
+        return TryRun(Self() ? Worker() : 0);
+    }
+
+    size_t Size() const {
+        return workers_.size();
+    }
+
+    /**
+     * the process wide pool, one worker per hardware thread
+     */
+    static HtmlThreadPool& Global() {
+        static HtmlThreadPool pool;
+        return pool;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // the pool the calling thread works for, and its queue
+    static HtmlThreadPool*& CurrentPool() {
+        static thread_local HtmlThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    static size_t& CurrentWorker() {
+        static thread_local size_t worker = 0;
+        return worker;
+    }
+
+    bool Self() const {
+        return CurrentPool() == this;
+    }
+
+    size_t Worker() const {
+        return CurrentWorker();
+    }
+
+    bool TryRun(size_t self) {
+        std::function<void()> task;
+        size_t n = queues_.size();
+        for (size_t i = 0; i < n && !task; i++) {
+            Queue& queue = *queues_[(self + i) % n];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task) return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_--;
+        }
+        task();
+        return true;
+    }
+
+    void Work(size_t self) {
+        CurrentPool() = this;
+        CurrentWorker() = self;
+        for (;;) {
+            if (TryRun(self)) continue;
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this] { return stop_ || pending_ > 0; });
+            if (stop_ && pending_ == 0) return;
+        }
+    }
+
+    HtmlThreadPool(const HtmlThreadPool&);
+    HtmlThreadPool& operator=(const HtmlThreadPool&);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    size_t pending_;                // queued, not yet taken
+    std::atomic<size_t> next_;      // queue for the next outside task
+    bool stop_;
+};
+
+/**
+ * class HtmlParser
+ * html parser and only one interface. the state of a parse lives in a
+ * context of its own, so one parser can run any number of parses at once
+ * from several threads; only the Set... options must not change meanwhile.
+ */
+class HtmlParser {
+public:
+    template <typename CharT> friend class HtmlTreeBuilder;
+
+    template <typename CharT, typename Handler> friend class HtmlTokenizer;
+    template <typename CharT> friend class HtmlParseContext;
+
+    HtmlParser() : arena_mode_(false), zero_copy_(false), borrow_input_(false), index_mode_(false),
+        threads_(1), min_piece_(1 << 16), diagnostic_limit_(static_cast<size_t>(-1)) {
+    }
+
+    /**
+     * parse html by C-Style data
+     * @param data
+     * @param len
+     * @return html document object
+     */
+    shared_ptr<HtmlDocument> Parse(const wchar_t* data, size_t len) const {
+        return ParseDocument(data, len);
+    }
+
+    /**
+     * parse html by string data
+     * @param data
+     * @return html document object
+     */
+    shared_ptr<HtmlDocument> Parse(const std::wstring& data) const {
+        return Parse(data.data(), data.size());
+    }
+
+    /**
+     * parse UTF-8 html without widening the input first. the tokenizer
+     * scans the bytes directly; only names, text runs and attributes are
+     * decoded when they are stored. a leading byte order mark is skipped.
+     * this saves the wide copy of the whole input, not time: the tree
+     * still holds wide strings and a character costs what it costs on
+     * the wide path.
+     * @param data
+     * @param len
+     * @return html document object
+     */
+    shared_ptr<HtmlDocument> Parse(const char* data, size_t len) const {
+        size_t bom = Utf8BomLength(data, len);
+        return ParseDocument(data + bom, len - bom);
+    }
+
+    /**
+     * parse UTF-8 html by string data
+     * @param data
+     * @return html document object
+     */
+    shared_ptr<HtmlDocument> Parse(const std::string& data) const {
+        return Parse(data.data(), data.size());
+    }
+
+    /**
+     * parse a UTF-8 file straight from a read-only mapping of it, without
+     * reading it into a string first. in zero-copy mode the document
+     * keeps the mapping as its source (alive as long as any node);
+     * otherwise it is released once the tree is built.
+     * @param path
+     * @return html document object, null if the file cannot be read
+     */
+    shared_ptr<HtmlDocument> ParseFile(const std::string& path) const {
+        shared_ptr<HtmlFileMapping> file = std::make_shared<HtmlFileMapping>(path);
+        if (!file->IsOpen()) {
+            if (diagnostics_) {
+                HtmlDiagnostic diagnostic;
+                diagnostic.code = HtmlDiagnostic::CANNOT_READ_FILE;
+                diagnostic.name = Utf8ToWide(path);
+                diagnostics_->OnDiagnostic(diagnostic);
+            }
+            return shared_ptr<HtmlDocument>();
+        }
+        size_t bom = Utf8BomLength(file->Data(), file->Size());
+        return ParseDocument(file->Data() + bom, file->Size() - bom, file);
+    }
+
+    /**
+     * parse without building a tree. handler (an HtmlSaxHandler<wchar_t>)
+     * sees the start tags, end tags, text and comments the tree builder
+     * would, with the same void element and implied close handling;
+     * elements still open at the end of the input get no OnEndTag.
+     * @param data
+     * @param len
+     * @param handler
+     */
+    template <typename Handler>
+    void ParseSax(const wchar_t* data, size_t len, Handler& handler) const {
+        ParseEvents(data, len, handler);
+    }
+
+    template <typename Handler>
+    void ParseSax(const std::wstring& data, Handler& handler) const {
+        ParseSax(data.data(), data.size(), handler);
+    }
+
+    /**
+     * parse UTF-8 html without building a tree, handler is an
+     * HtmlSaxHandler<char>. text and comments are handed over as bytes.
+     * @param data
+     * @param len
+     * @param handler
+     */
+    template <typename Handler>
+    void ParseSax(const char* data, size_t len, Handler& handler) const {
+        size_t bom = Utf8BomLength(data, len);
+        ParseEvents(data + bom, len - bom, handler);
+    }
+
+    template <typename Handler>
+    void ParseSax(const std::string& data, Handler& handler) const {
+        ParseSax(data.data(), data.size(), handler);
+    }
+
+    /**
+     * parse several documents on pool. the largest are started first, so
+     * a big page does not start last and hold up the batch; the calling
+     * thread runs queued parses too while it waits. done(i, document) is
+     * called for each input as soon as it is parsed, on the thread that
+     * parsed it. an exception from a parse or from done is thrown here
+     * once all are finished.
+     * @param inputs std::string (UTF-8) or std::wstring
+     * @param count
+     * @param done
+     * @param pool
+     * @return the documents, in the order of inputs
+     */
+    template <typename Input, typename Callback>
+    std::vector<shared_ptr<HtmlDocument>> ParseMany(const Input* inputs, size_t count, Callback done,
+        HtmlThreadPool& pool = HtmlThreadPool::Global()) const {
+        std::vector<shared_ptr<HtmlDocument>> documents(count);
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; i++) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [inputs](size_t a, size_t b) {
+            return inputs[a].size() > inputs[b].size();
+        });
+
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t left = count;
+        std::exception_ptr error;
+        for (size_t k = 0; k < count; k++) {
+            size_t i = order[k];
+            pool.Submit([&, i] {
+                try {
+                    documents[i] = Parse(inputs[i]);
+                    done(i, documents[i]);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--left == 0) finished.notify_all();
+            });
+        }
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (left == 0) break;
+            }
+            if (pool.RunOne()) continue;
+            // the rest is running on the workers
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&left] { return left == 0; });
+            break;
+        }
+        if (error) std::rethrow_exception(error);
+        return documents;
+    }
+
+    template <typename Input>
+    std::vector<shared_ptr<HtmlDocument>> ParseMany(const Input* inputs, size_t count,
+        HtmlThreadPool& pool = HtmlThreadPool::Global()) const {
+        return ParseMany(inputs, count, [](size_t, const shared_ptr<HtmlDocument>&) {}, pool);
+    }
+
+    template <typename Input>
+    std::vector<shared_ptr<HtmlDocument>> ParseMany(const std::vector<Input>& inputs,
+        HtmlThreadPool& pool = HtmlThreadPool::Global()) const {
+        return ParseMany(inputs.data(), inputs.size(), pool);
+    }
+
+    template <typename Input, typename Callback>
+    std::vector<shared_ptr<HtmlDocument>> ParseMany(const std::vector<Input>& inputs, Callback done,
+        HtmlThreadPool& pool = HtmlThreadPool::Global()) const {
+        return ParseMany(inputs.data(), inputs.size(), done, pool);
+    }
+
+    /**
+     * parse on pool, with a copy of this parser's options
+     * @param data std::string (UTF-8) or std::wstring, moved into the task
+     * @param pool
+     * @return the document once parsed
+     */
+    template <typename Input>
+    std::future<shared_ptr<HtmlDocument>> ParseAsync(Input data, HtmlThreadPool& pool = HtmlThreadPool::Global()) const {
+        shared_ptr<std::packaged_task<shared_ptr<HtmlDocument>()>> task =
+            std::make_shared<std::packaged_task<shared_ptr<HtmlDocument>()>>(
+                std::bind([](const HtmlParser& parser, const Input& input) { return parser.Parse(input); },
+                    *this, std::move(data)));
+        std::future<shared_ptr<HtmlDocument>> result = task->get_future();
+        pool.Submit([task] { (*task)(); });
+        return result;
+    }
+
+    /**
+     * arena mode: every node of a parsed document and its shared_ptr
+     * control block are carved from one arena owned by the document, one
+     * heap allocation fewer per node, released in bulk with the document.
+     * the children vectors and the name, value and attribute strings are
+     * still on the heap.
+     * @param enable
+     */
+    void SetArenaMode(bool enable) {
+        arena_mode_ = enable;
+    }
+
+    bool GetArenaMode() const {
+        return arena_mode_;
+    }
+
+    /**
+     * zero-copy mode: the document keeps the input buffer and text runs
+     * and attribute text stay offset/length views into it; the strings
+     * are only built when an accessor (GetValue, GetAttribute, text(),
+     * ...) or an edit needs them. implies arena mode, the arena keeps the
+     * buffer alive. lazy fields make const accessors on one node unsafe
+     * to call from several threads at once.
+     * @param enable
+     */
+    void SetZeroCopyMode(bool enable) {
+        zero_copy_ = enable;
+    }
+
+    bool GetZeroCopyMode() const {
+        return zero_copy_;
+    }
+
+    /**
+     * with zero-copy mode, borrow the caller's buffer instead of copying
+     * it. the buffer must then outlive the document and every node taken
+     * from it.
+     * @param borrow
+     */
+    void SetBorrowInput(bool borrow) {
+        borrow_input_ = borrow;
+    }
+
+    bool GetBorrowInput() const {
+        return borrow_input_;
+    }
+
+    /**
+     * index mode: the document gets its id, class and tag index (see
+     * HtmlDocument::BuildIndex) in the same pass that builds the tree.
+     * attributes are parsed as each element opens, so in zero-copy mode
+     * they are materialized rather than left as views.
+     * @param enable
+     */
+    void SetIndexMode(bool enable) {
+        index_mode_ = enable;
+    }
+
+    bool GetIndexMode() const {
+        return index_mode_;
+    }
+
+    /**
+     * parallel mode: a large document is cut at start tags into up to
+     * threads pieces, found by a quick scan that skips comments, raw text
+     * and tag bodies. each piece is parsed on its own thread and the pieces
+     * are joined in order, replaying close tags that belong to elements
+     * opened in an earlier piece. the tree is the one a sequential parse
+     * builds: where a piece read something differently from what the
+     * pieces before it imply (a stray close tag that closes an element
+     * opened earlier, a wrong cut), that part is read again sequentially.
+     * @param threads 0 or 1: sequential
+     */
+    void SetThreads(size_t threads) {
+        threads_ = threads;
+    }
+
+    size_t GetThreads() const {
+        return threads_;
+    }
+
+    /**
+     * parallel mode: the smallest piece worth a thread, in characters;
+     * shorter documents are parsed sequentially
+     * @param chars default 64K, at least 1
+     */
+    void SetMinPiece(size_t chars) {
+        min_piece_ = chars ? chars : 1;
+    }
+
+    /**
+     * where warnings about the input go (unexpected close tags, elements
+     * closed by an outer close tag, stray quotes in attributes); by
+     * default they are only counted, see HtmlDocument::GetWarningCount.
+     * HtmlStderrDiagnostics prints them as earlier versions did. a
+     * parallel parse (SetThreads) reports the same ones, not always in
+     * input order.
+     * @param sink null: none
+     * @param limit at most this many reach the sink per document
+     */
+    void SetDiagnostics(const shared_ptr<HtmlDiagnosticSink>& sink, size_t limit = static_cast<size_t>(-1)) {
+        diagnostics_ = sink;
+        diagnostic_limit_ = limit;
+    }
+
+#if defined(HTMLPARSER_STATS)
+    /**
+     * called with the ParseStats of every document this parser builds,
+     * push parsers made from it included
+     * @param hook null: none
+     */
+    void SetParseHook(const shared_ptr<HtmlParseHook>& hook) {
+        hook_ = hook;
+    }
+#endif
+
+    static size_t Utf8BomLength(const char* data, size_t len) {
+        if (len >= 3 && static_cast<unsigned char>(data[0]) == 0xEF &&
+            static_cast<unsigned char>(data[1]) == 0xBB && static_cast<unsigned char>(data[2]) == 0xBF) {
+            return 3;
+        }
+        return 0;
+    }
+
+private:
+    // owner: storage of stream, kept by a zero-copy document instead of a copy
+    template <typename CharT>
+    shared_ptr<HtmlDocument> ParseDocument(const CharT* stream, size_t length, const shared_ptr<void>& owner = shared_ptr<void>()) const;
+
+    template <typename CharT, typename Handler>
+    void ParseEvents(const CharT* stream, size_t length, Handler& handler) const;
+
+    template <typename CharT>
+    void FindCuts(const CharT* s, size_t length, size_t pieces, std::vector<size_t>& cuts) const;
+
+    template <typename CharT>
+    void ParsePieces(HtmlParseContext<CharT>& context, const CharT* s, size_t length,
+        const std::vector<size_t>& cuts, const shared_ptr<HtmlSource>& source) const;
+
+private:
+    bool arena_mode_;
+    bool zero_copy_;
+    bool borrow_input_;
+    bool index_mode_;
+    size_t threads_;
+    size_t min_piece_;  // smallest piece worth a thread
+    shared_ptr<HtmlDiagnosticSink> diagnostics_;
+    size_t diagnostic_limit_;   // per document
+#if defined(HTMLPARSER_STATS)
+    shared_ptr<HtmlParseHook> hook_;
+#endif
+};
+
+/**
+ * attribute text of a start tag as the tokenizer hands it over: a copy
+ * when the input arrives in chunks, else a view into the input buffer
+ */
+template <typename CharT>
+struct HtmlTagAttributes {
+    HtmlTagAttributes() : text(nullptr), data(nullptr), offset(0), length(0), tag(std::wstring::npos) {}
+
+    bool Empty() const {
+        return text ? text->empty() : length == 0;
+    }
+
+    void AppendTo(std::wstring& out) const {
+        if (text) out += *text;
+        else AppendChars(out, data + offset, length);
+    }
+
+    const std::wstring* text;
+    const CharT* data;
+    size_t offset;
+    size_t length;
+    size_t tag;     // offset of the start tag in the whole input
+};
+
+/**
+ * class HtmlTokenizer
+ * the parse state machine. the tokenizer used to keep its state on the C++
+ * stack (one ParseElement call per open element); here it is an explicit
+ * stack of open elements, so Run can stop at the end of the available input
+ * and carry on with the next chunk, mid-tag or mid-</script> included.
+ * what it reads goes to Handler:
+ *   StartElement(name, atom, attributes,   start tag read; empty when the
+ *                empty)                    element is void or self-closing
+ *   EndElement(name, attributes)           the element is closed, by its
+ *                                          close tag or implied
+ *   Text(data, len, offset)                run of element text
+ *   TextEnd()                              markup after element text
+ *   RawText(data, len, offset)             script/noscript/style content
+ *   Comment(data, len)                     <!-- comment --> content
+ *   OuterOpen(offset)                      fragment mode only, see
+ *   OuterClose(name, atom, offset)         SetFragment
+ *   OuterUnmatched(name, atom, offset)
+ * runs can come in several pieces; offset is the position in the buffer
+ * handed to Run. in view mode attributes are views into that buffer, which
+ * must then be the whole input (single call to Run).
+ */
+template <typename CharT, typename Handler>
+class HtmlTokenizer {
+public:
+    HtmlTokenizer(const HtmlParser& parser, Handler& handler, bool views)
+        : parser_(parser), handler_(handler), views_(views), depth_(1),
+        skip_(SKIP_NONE), comment_(0), text_(false), done_(false), wait_(false),
+        fragment_(false), diagnostics_(parser.diagnostics_.get(), parser.diagnostic_limit_), base_(0) {
+#if defined(HTMLPARSER_STATS)
+        unclosed_ = 0;
+#endif
+        frames_.resize(16);
+        frames_[0].Reset(STATE_TOP);
+    }
+
+    void SetViews(bool views) {
+        views_ = views;
+    }
+
+    /**
+     * where the buffer handed to the next Run starts in the whole input,
+     * for the offsets of diagnostics
+     */
+    void SetOffset(size_t base) {
+        base_ = base;
+    }
+
+    HtmlDiagnostics& GetDiagnostics() {
+        return diagnostics_;
+    }
+
+    /**
+     * fragment mode (parallel parsing, HtmlElement::ParseInnerHTML): the
+     * input starts inside elements this tokenizer does not know, frame 0
+     * stands for them. the handler gets OuterOpen for each tag opened
+     * with none of the fragment's own elements open. a close tag matching
+     * none of those goes to it as OuterClose when none is open; otherwise
+     * it is taken as matching no outer element either, which whoever
+     * joins the fragment has to check (OuterUnmatched).
+     */
+    void SetFragment() {
+        fragment_ = true;
+        frames_[0].Reset(STATE_VALUE);
+        diagnostics_.SetDeferred();
+    }
+
+    /**
+     * between two tokens in element text or at the top level, where
+     * tokenizing can go on from another tokenizer's state (see Adopt)
+     */
+    bool AtRest() const {
+        State state = frames_[depth_ - 1].state;
+        return !done_ && skip_ == SKIP_NONE && (state == STATE_VALUE || state == STATE_TOP);
+    }
+
+    bool AtTop() const {
+        return depth_ == 1;
+    }
+
+    /**
+     * whether a close tag for name would match an open element
+     */
+    bool IsOpen(uint32_t atom, const std::wstring& name) const {
+        for (size_t i = depth_; i-- > 0;) {
+            if (HtmlAtom::Equal(atom, name, frames_[i].atom, frames_[i].name)) return true;
+        }
+        return false;
+    }
+
+    /**
+     * end the text run as the '<' after it would
+     */
+    void EndText() {
+        if (text_) {
+            handler_.TextEnd();
+            text_ = false;
+        }
+    }
+
+    /**
+     * a close tag a fragment read with no element of its own open, handled
+     * against the open elements as CloseTag would
+     * @param atom of name
+     * @param name
+     * @param s the buffer handed to Run
+     * @param offset of the tag in s
+     * @return false, and nothing done, when it would take the parse back to
+     *         the top level, where the tag is read differently
+     */
+    bool CloseOuter(uint32_t atom, const std::wstring& name, const CharT* s, size_t offset) {
+        size_t match = depth_;
+        for (size_t i = depth_; i-- > 0;) {
+            if (HtmlAtom::Equal(atom, name, frames_[i].atom, frames_[i].name)) {
+                match = i;
+                break;
+            }
+        }
+        if (depth_ == 1 || match == 0) return false;
+        if (match == depth_) {
+            diagnostics_.Report(HtmlDiagnostic::UNEXPECTED_CLOSE_TAG, base_ + offset, name, frames_[depth_ - 1].name);
+            return true;
+        }
+        while (depth_ - 1 > match) {
+            diagnostics_.Report(HtmlDiagnostic::ELEMENT_NOT_CLOSED, base_ + offset, frames_[depth_ - 1].name);
+            EndElement(s);
+        }
+        EndElement(s);
+        return true;
+    }
+
+    /**
+     * take over the elements a fragment left open and its text run, as if
+     * this tokenizer had read the fragment itself
+     */
+    void Adopt(const HtmlTokenizer& fragment) {
+        for (size_t i = 1; i < fragment.depth_; i++) {
+            if (depth_ == frames_.size()) frames_.resize(depth_ * 2);
+            frames_[depth_++] = fragment.frames_[i];
+        }
+        text_ = fragment.text_;
+    }
+
+    /**
+     * tokenize s[index, length)
+     * @param final no more input after this
+     * @return position of the first character still needed; everything
+     *         before it has been consumed and can be dropped
+     */
+    size_t Run(const CharT* s, size_t length, size_t index, bool final) {
+        while (!done_) {
+            if (skip_ != SKIP_NONE) {
+                index = Skip(s, length, index, final);
+                if (skip_ != SKIP_NONE) return index;
+                continue;
+            }
+            if (index >= length) return index;
+
+            Frame& f = frames_[depth_ - 1];
+            size_t next = index;
+            switch (f.state) {
+            case STATE_TOP: {
+                CharT input = s[index];
+                if (input == '\r' || input == '\n' || input == '\t' || input == ' ') {
+                    next = index + 1;
+                }
+                else if (input == '<') {
+                    next = OpenMarkup(s, length, index, final);
+                }
+                else {
+                    done_ = true;
+                }
+            }
+                          break;
+
+            case STATE_TAG: {
+                CharT input = s[index];
+                if (input == ' ' || input == '\r' || input == '\n' || input == '\t') {
+                    if (!f.name.empty()) {
+                        f.atom = HtmlAtom::Of(f.name);
+                        f.state = STATE_ATTR;
+                    }
+                    next = index + 1;
+                }
+                else if (input == '/') {
+                    f.atom = HtmlAtom::Of(f.name);
+                    StartElement(f, s, true);
+                    EndElement(s);
+                    skip_ = SKIP_GT;
+                }
+                else if (input == '>') {
+                    next = index + 1;
+                    f.atom = HtmlAtom::Of(f.name);
+                    if (HtmlAtom::Is(f.atom, HtmlAtom::FLAG_VOID)) {
+                        StartElement(f, s, true);
+                        EndElement(s);
+                    }
+                    else {
+                        StartElement(f, s, false);
+                        EnterValue(f);
+                    }
+                }
+                else {
+                    // whole run of name characters at once
+                    size_t end = index + 1;
+                    while (length > end && s[end] != ' ' && s[end] != '\r' && s[end] != '\n' &&
+                        s[end] != '\t' && s[end] != '/' && s[end] != '>') {
+                        end++;
+                    }
+                    end = RunEnd(s, index, end, length, final);
+                    AppendChars(f.name, s + index, end - index);
+                    next = end;
+                    wait_ = end == index;
+                }
+            }
+                          break;
+
+            case STATE_ATTR: {
+                CharT input = s[index];
+                if (input == '>') {
+                    next = index + 1;
+                    if (f.attrLast == '/') {
+                        if (views_) f.attrEnd--;
+                        else f.attr.erase(f.attr.size() - 1);
+                        StartElement(f, s, true);
+                        EndElement(s);
+                    }
+                    else if (HtmlAtom::Is(f.atom, HtmlAtom::FLAG_VOID)) {
+                        StartElement(f, s, true);
+                        EndElement(s);
+                    }
+                    else {
+                        StartElement(f, s, false);
+                        EnterValue(f);
+                    }
+                }
+                else {
+                    size_t end = RunEnd(s, index, HtmlScanner::Find(s, index + 1, length, CharT('>')), length, final);
+                    if (views_) {
+                        if (f.attrStart == std::wstring::npos) f.attrStart = index;
+                        f.attrEnd = end;
+                    }
+                    else {
+                        AppendChars(f.attr, s + index, end - index);
+                    }
+                    if (end > index) f.attrLast = s[end - 1];
+                    next = end;
+                    wait_ = end == index;
+                }
+            }
+                           break;
+
+            case STATE_VALUE: {
+                CharT input = s[index];
+                if (input == '<') {
+                    if (text_) {
+                        handler_.TextEnd();
+                        text_ = false;
+                    }
+                    if (index + 1 >= length && !final) {
+                        return index;
+                    }
+                    if (index + 1 < length && s[index + 1] == '/') {
+                        next = CloseTag(s, length, index, final);
+                    }
+                    else {
+                        next = OpenMarkup(s, length, index, final);
+                    }
+                }
+                else if (input != '\r' && input != '\n' && input != '\t') {
+                    // the whole text run up to the next markup or line break
+                    size_t end = RunEnd(s, index, HtmlScanner::FindTextBreak(s, index + 1, length), length, final);
+                    if (end > index) {
+                        handler_.Text(s + index, end - index, index);
+                        text_ = true;
+                    }
+                    next = end;
+                    wait_ = end == index;
+                }
+                else {
+                    next = index + 1;
+                }
+            }
+                            break;
+
+            case STATE_RAW: {
+                // raw text up to "</name>", matched ignoring case
+                size_t close = raw_.size() + 3;
+                size_t end = HtmlScanner::FindCloseTag(s, index, length, raw_);
+                if (end == length && !final) {
+                    // keep what could be the start of the close tag
+                    end = length - index > close - 1 ? CharBoundary(s, index, length - (close - 1)) : index;
+                    if (end > index) handler_.RawText(s + index, end - index, index);
+                    return end;
+                }
+                if (end > index) handler_.RawText(s + index, end - index, index);
+                next = end == length ? length : end + close;
+                EndElement(s);
+            }
+                          break;
+            }
 
-    const std::wstring& GetName() {
-        return name;
+            if (wait_) {
+                wait_ = false;
+                return index; // the rest of this token is in the next chunk
+            }
+            index = next;
+        }
+
+        return length;
     }
 
-    std::wstring text() {
-        std::wstring str;
-        PlainStylize(str);
-        return str;
+    /**
+     * end of the input of a fragment (see SetFragment): the elements still
+     * open are closed as if their close tags followed, a start tag not
+     * yet read to its '>' is dropped
+     * @param s the buffer handed to Run
+     */
+    void CloseAll(const CharT* s) {
+        EndText();
+        State state = frames_[depth_ - 1].state;
+        if (depth_ > 1 && (state == STATE_TAG || state == STATE_ATTR)) depth_--;
+        while (depth_ > 1) {
+            HTMLPARSER_STATS_ADD(unclosed_, 1);
+            EndElement(s);
+        }
+        done_ = true;
     }
 
-    void PlainStylize(std::wstring& str) {
-        if (name == L"head" || name == L"meta" || name == L"style" || name == L"script" || name == L"link") {
-            return;
+    /**
+     * ignore any further input
+     */
+    void Stop() {
+        HTMLPARSER_STATS_ADD(unclosed_, done_ ? 0 : depth_ - 1);
+        done_ = true;
+    }
+
+#if defined(HTMLPARSER_STATS)
+    /**
+     * elements closed by CloseAll or left open at Stop; the other
+     * recovered tags are the ones reported
+     */
+    size_t Unclosed() const {
+        return unclosed_;
+    }
+#endif
+
+private:
+    enum State {
+        STATE_TOP,
+        STATE_TAG,
+        STATE_ATTR,
+        STATE_VALUE,
+        STATE_RAW
+    };
+
+    enum SkipMode {
+        SKIP_NONE,
+        SKIP_GT,
+        SKIP_COMMENT,
+        SKIP_PI
+    };
+
+    // frames are reused from element to element, strings keep their capacity
+    struct Frame {
+        Frame() : atom(HtmlAtom::NONE), state(STATE_TOP), attrLast(0), attrStart(std::wstring::npos), attrEnd(0),
+            start(std::wstring::npos) {}
+
+        void Reset(State s) {
+            name.clear();
+            attr.clear();
+            atom = HtmlAtom::NONE;
+            state = s;
+            attrLast = 0;
+            attrStart = std::wstring::npos;
+            attrEnd = 0;
         }
 
-        if (name == L"plain") {
-            str.append(value);
-            return;
+        std::wstring name;
+        std::wstring attr;
+        uint32_t atom;      // of name, once it is read
+        State state;
+        CharT attrLast;
+        // view mode: input range instead of attr
+        size_t attrStart, attrEnd;
+        size_t start;       // of the start tag in the whole input
+    };
+
+    // '<' of anything but a close tag inside an element
+    size_t OpenMarkup(const CharT* s, size_t length, size_t index, bool final) {
+        static const CharT kCommentOpen[] = { '<', '!', '-', '-' };
+
+        if (index + 1 >= length && !final) return Wait(index);
+        CharT input = index + 1 < length ? s[index + 1] : CharT(0);
+        if (input == '!') {
+            if (length - index < 4 && !final) return Wait(index);
+            if (MatchAt(s, length, index, kCommentOpen, 4)) {
+                skip_ = SKIP_COMMENT;
+                comment_ = 2; // the search for "-->" starts on the "--" of "<!--"
+            }
+            else {
+                skip_ = SKIP_GT;
+            }
+            return index + 2;
+        }
+        else if (input == '/') {
+            skip_ = SKIP_GT;
+            return index;
+        }
+        else if (input == '?') {
+            skip_ = SKIP_PI;
+            return index;
         }
 
-        for (size_t i = 0; i < children.size();) {
-            children[i]->PlainStylize(str);
+        if (fragment_ && depth_ == 1) handler_.OuterOpen(index);
+        if (depth_ == frames_.size()) frames_.resize(depth_ * 2);
+        frames_[depth_].Reset(STATE_TAG);
+        frames_[depth_++].start = base_ + index;
+        return index + 1;
+    }
 
-            if (++i < children.size()) {
-                std::wstring ele = children[i]->GetName();
-                if (ele == L"td") {
-                    str.append(L"\t");
-                }
-                else if (ele == L"tr" || ele == L"br" || ele == L"div" || ele == L"p" || ele == L"hr" || ele == L"area" ||
-                    ele == L"h1" || ele == L"h2" || ele == L"h3" || ele == L"h4" || ele == L"h5" || ele == L"h6" || ele == L"h7") {
-                    str.append(L"\n");
-                }
+    // "</name>" inside an element
+    size_t CloseTag(const CharT* s, size_t length, size_t index, bool final) {
+        size_t end = index + 2; // skip "</"
+
+        // Read tag name only (stop at space, tab, newline, or '>')
+        size_t nameStart = end;
+        while (length > end && s[end] != '>' && s[end] != ' ' && s[end] != '\t' && s[end] != '\r' && s[end] != '\n') {
+            end++;
+        }
+        size_t nameEnd = end;
+
+        // Skip any whitespace before '>'
+        while (length > end && (s[end] == ' ' || s[end] == '\t' || s[end] == '\r' || s[end] == '\n')) {
+            end++;
+        }
+        if (end == length && !final) return Wait(index);
+
+        // Expect '>' to end the closing tag
+        if (length > end && s[end] == '>') {
+            end++; // move past '>'
+        }
+
+        std::wstring& closeTag = closeTag_;
+        closeTag.clear();
+        AppendChars(closeTag, s + nameStart, nameEnd - nameStart);
+        uint32_t atom = HtmlAtom::Of(closeTag);
+
+        if (fragment_ && depth_ == 1) {
+            handler_.OuterClose(closeTag, atom, index);
+            return end;
+        }
+
+        Frame& f = frames_[depth_ - 1];
+        if (HtmlAtom::Equal(atom, closeTag, f.atom, f.name)) {
+            // Correct closing tag for this element
+            EndElement(s);
+            return end;
+        }
+
+        // Check if this closing tag actually belongs to a parent
+        size_t bottom = fragment_ ? 1 : 0;
+        for (size_t i = depth_ - 1; i-- > bottom;) {
+            if (HtmlAtom::Equal(atom, closeTag, frames_[i].atom, frames_[i].name)) {
+                diagnostics_.Report(HtmlDiagnostic::ELEMENT_NOT_CLOSED, base_ + index, f.name);
+                EndElement(s);
+                return index; // the parent sees the same "</" again
+            }
+        }
+
+        if (fragment_) handler_.OuterUnmatched(closeTag, atom, index);
+
+        // Unexpected closing tag
+        diagnostics_.Report(HtmlDiagnostic::UNEXPECTED_CLOSE_TAG, base_ + index, closeTag, f.name);
+        return end;
+    }
+
+    size_t Wait(size_t index) {
+        wait_ = true;
+        return index;
+    }
+
+    HtmlTagAttributes<CharT> Attributes(const Frame& f, const CharT* s) const {
+        HtmlTagAttributes<CharT> attr;
+        if (views_) {
+            attr.data = s;
+            if (f.attrStart != std::wstring::npos && f.attrEnd > f.attrStart) {
+                attr.offset = f.attrStart;
+                attr.length = f.attrEnd - f.attrStart;
             }
         }
+        else {
+            attr.text = &f.attr;
+        }
+        attr.tag = f.start;
+        return attr;
     }
 
-    std::wstring OuterHTML() {
-        std::wstring str;
-        HtmlStylize(str);
-        return str;
+    void StartElement(const Frame& f, const CharT* s, bool empty) {
+        handler_.StartElement(f.name, f.atom, Attributes(f, s), empty);
     }
 
-    std::wstring InnerHTML() {
-        std::wstring str;
+    // close the innermost open element
+    void EndElement(const CharT* s) {
+        const Frame& f = frames_[depth_ - 1];
+        handler_.EndElement(f.name, Attributes(f, s));
+        depth_--;
+    }
 
-        // Add inner text if there are no children
-        if (children.empty()) {
-            str.append(value);
+    void EnterValue(Frame& f) {
+        if (HtmlAtom::Is(f.atom, HtmlAtom::FLAG_RAW)) {
+            raw_.assign(f.name);
+            for (size_t i = 0; i < raw_.size(); i++) raw_[i] = static_cast<wchar_t>(std::towlower(raw_[i]));
+            f.state = STATE_RAW;
         }
         else {
-            for (size_t i = 0; i < children.size(); ++i) {
-                children[i]->HtmlStylize(str);
-            }
+            f.state = STATE_VALUE;
         }
+    }
 
-        return str;
+    size_t Skip(const CharT* s, size_t length, size_t index, bool final) {
+        static const CharT kCommentClose[] = { '-', '-', '>' };
+        static const CharT kPiClose[] = { '?', '>' };
+
+        const CharT* data = nullptr;
+        size_t n = 1;
+        CharT gt = '>';
+        if (skip_ == SKIP_GT) data = &gt;
+        else if (skip_ == SKIP_COMMENT) { data = kCommentClose; n = 3; }
+        else { data = kPiClose; n = 2; }
+
+        size_t pos = index < length ? HtmlScanner::Find(s, index, length, data, n) : length;
+        size_t end;
+        if (pos < length) end = pos + n;
+        else if (final) end = length;
+        else end = length - index > n - 1 ? CharBoundary(s, index, length - (n - 1)) : index; // keep what could be the start of the terminator
+
+        if (skip_ == SKIP_COMMENT) {
+            size_t stop = pos < length ? pos : end;
+            size_t from = index + comment_;
+            if (stop > from) handler_.Comment(s + from, stop - from);
+            comment_ = from > stop ? from - stop : 0;
+        }
+        if (pos < length || final) {
+            skip_ = SKIP_NONE;
+        }
+        return end;
     }
 
+    // end of a run that stops at end; cut back to a whole character when
+    // the run reaches the end of a chunk that more input will follow
+    static size_t RunEnd(const CharT* s, size_t index, size_t end, size_t length, bool final) {
+        if (final || end < length) return end;
+        return CharBoundary(s, index, end);
+    }
 
-    void HtmlStylize(std::wstring& str) {
-        if (name.empty()) {
-            for (size_t i = 0; i < children.size(); i++) {
-                children[i]->HtmlStylize(str);
-            }
+    static size_t CharBoundary(const wchar_t*, size_t, size_t end) {
+        return end;
+    }
 
-            return;
+    static size_t CharBoundary(const char* s, size_t index, size_t end) {
+        // back over an incomplete UTF-8 sequence at the end of the run
+        size_t lead = end;
+        while (lead > index && end - lead < 4 && (static_cast<unsigned char>(s[lead - 1]) & 0xC0) == 0x80) lead--;
+        if (lead == index) return end;
+        unsigned char c = static_cast<unsigned char>(s[lead - 1]);
+        size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return end - (lead - 1) < need ? lead - 1 : end;
+    }
+
+    static bool MatchAt(const CharT* s, size_t length, size_t index, const CharT* data, size_t n) {
+        if (length < index || length - index < n) return false;
+        for (size_t i = 0; i < n; i++) {
+            if (s[index + i] != data[i]) return false;
         }
-        else if (name == L"plain") {
-            str.append(value);
-            return;
+        return true;
+    }
+
+private:
+    HtmlTokenizer(const HtmlTokenizer&);
+    HtmlTokenizer& operator=(const HtmlTokenizer&);
+
+    const HtmlParser& parser_;
+    Handler& handler_;
+    bool views_;
+    std::vector<Frame> frames_;
+    size_t depth_;
+    std::wstring closeTag_;
+    std::wstring raw_;      // lower case name of the raw text element open
+    SkipMode skip_;
+    size_t comment_;
+    bool text_;
+    bool done_;
+    bool wait_;
+    bool fragment_;
+    HtmlDiagnostics diagnostics_;
+    size_t base_;           // offset of the buffer handed to Run in the whole input
+#if defined(HTMLPARSER_STATS)
+    size_t unclosed_;
+#endif
+};
+
+/**
+ * class HtmlTreeBuilder
+ * tokenizer handler that builds the HtmlElement tree. an element is
+ * attached to its parent once it is closed; everything still open at the
+ * end of the input is dropped, as the recursive parser did.
+ */
+template <typename CharT>
+class HtmlTreeBuilder {
+public:
+    // what a fragment's root got, see SetFragment
+    struct OuterEvent {
+        enum Kind {
+            OPEN,       // a start tag
+            CHILD,      // a closed element or a text node
+            TEXT,       // a text run starts
+            CLOSE,      // close tag for an outer element
+            UNMATCHED   // close tag inside the fragment's own elements,
+                        // taken as matching no outer element
+        };
+
+        OuterEvent(Kind k, size_t o) : kind(k), atom(HtmlAtom::NONE), offset(o) {}
+
+        Kind kind;
+        shared_ptr<HtmlElement> node;   // CHILD
+        std::wstring name;              // CLOSE, UNMATCHED
+        uint32_t atom;                  // of name
+        size_t offset;                  // position in the input
+    };
+
+    HtmlTreeBuilder(const HtmlParser& parser, size_t sizeHint)
+        : source_(nullptr), diagnostics_(nullptr), textStart_(std::wstring::npos), textEnd_(0),
+        openAttributes_(parser.index_mode_), fragment_(false), target_(false), label_(HtmlElement::kOrderSpacing) {
+        if (parser.arena_mode_ || parser.zero_copy_) {
+            arena_ = std::make_shared<HtmlArena>(sizeHint * sizeof(CharT) * 2);
+        }
+        shared_ptr<HtmlElement> none;
+        root_ = NewElement(none, std::wstring::npos);
+        root_->order = 0;
+        root_->orderEnd = HtmlElement::kOrderMax;
+        if (parser.index_mode_) {
+            index_ = std::make_shared<HtmlIndex>(root_.get());
+        }
+        stack_.reserve(64);
+        stack_.push_back(root_);
+    }
+
+    /**
+     * build into target, an element of a tree, instead of a new document
+     * (see HtmlElement::ParseInnerHTML). the nodes of the target's level
+     * are kept for TakeNodes instead of being added to it; their labels
+     * and index are for whoever adds them. text of that level is
+     * gathered in the target's value, which must be empty.
+     */
+    explicit HtmlTreeBuilder(const shared_ptr<HtmlElement>& target)
+        : source_(nullptr), diagnostics_(nullptr), root_(target), textStart_(std::wstring::npos), textEnd_(0),
+        openAttributes_(false), fragment_(false), target_(true), label_(HtmlElement::kOrderSpacing) {
+        stack_.reserve(16);
+        stack_.push_back(root_);
+    }
+
+    /**
+     * zero-copy mode: text and attributes become views into source
+     */
+    void SetSource(const shared_ptr<HtmlSource>& source) {
+        arena_->Retain(source);
+        source_ = source.get();
+    }
+
+    /**
+     * where attribute problems go, null: unreported. attributes parsed
+     * later (zero-copy mode) are never reported
+     */
+    void SetDiagnostics(HtmlDiagnostics* diagnostics) {
+        diagnostics_ = diagnostics;
+    }
+
+    /**
+     * fragment mode (parallel parsing): the root stands for the elements
+     * open where the fragment starts. what reaches it is kept as a list of
+     * outer events, in order, for HtmlParseContext::Join. no index, the
+     * document's is rebuilt once the fragments are joined.
+     */
+    void SetFragment() {
+        fragment_ = true;
+        index_.reset();
+    }
+
+    const std::vector<OuterEvent>& GetOuterEvents() const {
+        return events_;
+    }
+
+    /**
+     * target mode: the nodes of the target's level, in order
+     */
+    void TakeNodes(std::vector<shared_ptr<HtmlElement>>& nodes) {
+        nodes.swap(nodes_);
+    }
+
+    /**
+     * a closed element or text node of a fragment's outer level
+     */
+    void Append(const shared_ptr<HtmlElement>& node) {
+        node->parent = stack_.back();
+        node->position = stack_.back()->children.size();
+        stack_.back()->children.push_back(node);
+        label_ = std::max(label_, node->orderEnd + 1);
+        if (index_) index_->Invalidate();
+    }
+
+    /**
+     * take over the elements a fragment left open and its text run
+     */
+    void Adopt(HtmlTreeBuilder& fragment) {
+        if (fragment.stack_.size() > 1) {
+            fragment.stack_[1]->parent = stack_.back();
+            stack_.insert(stack_.end(), fragment.stack_.begin() + 1, fragment.stack_.end());
+            if (index_) index_->Invalidate();
+        }
+        else if (!source_) {
+            stack_.back()->value += fragment.root_->value;
+        }
+        if (source_) {
+            textStart_ = fragment.textStart_;
+            textEnd_ = fragment.textEnd_;
+        }
+        else if (textStart_ == std::wstring::npos) {
+            textStart_ = fragment.textStart_;
+        }
+        label_ = std::max(label_, fragment.label_);
+    }
+
+    void StartElement(const std::wstring& name, uint32_t atom, const HtmlTagAttributes<CharT>& attr, bool) {
+        HTMLPARSER_STATS_TIME(stats_.build_seconds);
+        shared_ptr<HtmlElement> element = NewElement(stack_.back(), attr.tag);
+        element->name = name;
+        element->atom = atom;
+        if (openAttributes_) SetAttributes(element, attr);
+        if (index_) {
+            // the index is filled in document order, as elements open
+            element->index = index_.get();
+            index_->Add(element.get());
         }
+        stack_.push_back(std::move(element));
+    }
+
+    // attributes are parsed once the element is closed, as the recursive
+    // parser did; it keeps the allocations of one element together
+    void EndElement(const std::wstring&, const HtmlTagAttributes<CharT>& attr) {
+        HTMLPARSER_STATS_TIME(stats_.build_seconds);
+        shared_ptr<HtmlElement>& element = stack_.back();
+        if (!openAttributes_) SetAttributes(element, attr);
+        if (!source_) element->TrimValue();
+        AddChild(stack_[stack_.size() - 2], std::move(element));
+        stack_.pop_back();
+    }
 
-        str.append(L"<" + name);
-        std::map<std::wstring, std::wstring>::const_iterator it = attribute.begin();
-        for (; it != attribute.end(); it++) {
-            str.append(L" " + it->first + L"=\"" + it->second + L"\"");
+    void Text(const CharT* s, size_t len, size_t offset) {
+        HTMLPARSER_STATS_TIME(stats_.build_seconds);
+        if (fragment_ && stack_.size() == 1 && (source_ ? textStart_ == std::wstring::npos : root_->value.empty())) {
+            events_.push_back(OuterEvent(OuterEvent::TEXT, offset));
+        }
+        if (textStart_ == std::wstring::npos) textStart_ = offset;
+        if (source_) {
+            textEnd_ = offset + len;
         }
-        str.append(L">");
+        else {
+            AppendChars(stack_.back()->value, s, len);
+        }
+    }
 
-        if (children.empty()) {
-            str.append(value);
+    // text gathered so far becomes a "plain" child
+    void TextEnd() {
+        HTMLPARSER_STATS_TIME(stats_.build_seconds);
+        shared_ptr<HtmlElement>& element = stack_.back();
+        size_t start = textStart_;
+        textStart_ = std::wstring::npos;
+        if (source_ ? start == std::wstring::npos : element->value.empty()) return;
+
+        shared_ptr<HtmlElement> child = NewElement(element, start);
+        child->name = L"plain";
+        child->atom = HtmlAtom::PLAIN;
+        if (source_) {
+            HtmlElement::LazyFields* lazy = LazyOf(child);
+            lazy->value_offset = start;
+            lazy->value_length = textEnd_ - start;
+            lazy->value_pending = true;
         }
         else {
-            for (size_t i = 0; i < children.size(); i++) {
-                children[i]->HtmlStylize(str);
+            child->value.swap(element->value);
+        }
+        if (index_) {
+            child->index = index_.get();
+            index_->Add(child.get());
+        }
+        AddChild(element, std::move(child));
+    }
+
+    void RawText(const CharT* s, size_t len, size_t offset) {
+        HTMLPARSER_STATS_TIME(stats_.build_seconds);
+        HTMLPARSER_STATS_ADD(stats_.raw_text_bytes, len * sizeof(CharT));
+        if (source_) {
+            HtmlElement::LazyFields* lazy = LazyOf(stack_.back());
+            if (!lazy->value_pending) {
+                lazy->value_offset = offset;
+                lazy->value_pending = true;
+                lazy->raw_value = true;
             }
+            lazy->value_length = offset + len - lazy->value_offset;
+        }
+        else {
+            AppendChars(stack_.back()->value, s, len);
         }
+    }
 
-        str.append(L"</" + name + L">");
+    void Comment(const CharT*, size_t) {
     }
 
-private:
+    void OuterOpen(size_t offset) {
+        if (target_) return;
+        events_.push_back(OuterEvent(OuterEvent::OPEN, offset));
+    }
 
+    void OuterClose(const std::wstring& name, uint32_t atom, size_t offset) {
+        if (target_) return;
+        events_.push_back(OuterEvent(OuterEvent::CLOSE, offset));
+        events_.back().name = name;
+        events_.back().atom = atom;
+    }
 
-    void GetElementsByClassName(const std::wstring& cls, const std::wstring& tag, std::vector<std::shared_ptr<HtmlElement>>& result)
-    {
+    void OuterUnmatched(const std::wstring& name, uint32_t atom, size_t offset) {
+        if (target_) return;
+        events_.push_back(OuterEvent(OuterEvent::UNMATCHED, offset));
+        events_.back().name = name;
+        events_.back().atom = atom;
+    }
 
-        if (HasClass(cls))
-        {
-            if (tag != L"" && toLower(tag) == toLower(this->GetName()))
-                InsertIfNotExists(result, shared_from_this());
-            if (tag == L"")
-                InsertIfNotExists(result, shared_from_this());
-        }
-        for (ChildIterator it = ChildBegin(); it != ChildEnd(); ++it) {
-            (*it)->GetElementsByClassName(cls, tag, result);
+    shared_ptr<HtmlDocument> Finish() {
+#if defined(HTMLPARSER_STATS)
+        Count(*root_, 0);
+        if (arena_) stats_.allocations += arena_->BlockCount();
+#endif
+        // the index still lists the elements dropped below
+        if (index_ && stack_.size() > 1) index_->Invalidate();
+        // lookups on the root go through the index from now on; before,
+        // it would also list elements not yet closed
+        if (index_) root_->index = index_.get();
+        shared_ptr<HtmlDocument> doc(new HtmlDocument(root_, arena_, index_));
+        stack_.clear();
+        index_.reset();
+        root_.reset();
+        arena_.reset();
+        source_ = nullptr;
+        return doc;
+    }
+
+    shared_ptr<HtmlElement> GetRoot() const {
+        return root_;
+    }
+
+#if defined(HTMLPARSER_STATS)
+    const ParseStats& GetStats() const {
+        return stats_;
+    }
+#endif
+
+private:
+#if defined(HTMLPARSER_STATS)
+    void Count(const HtmlElement& node, size_t depth) {
+        if (node.atom == HtmlAtom::PLAIN) stats_.text_nodes++;
+        else if (depth > 0) stats_.elements++;
+        if (depth > stats_.max_depth && node.atom != HtmlAtom::PLAIN) stats_.max_depth = depth;
+
+        // the node and its control block, one block unless in the arena
+        if (!arena_) stats_.allocations++;
+        stats_.allocations += HeapBlocks(node.name) + HeapBlocks(node.value);
+        if (node.children.capacity()) stats_.allocations++;
+        if (!node.lazy || !node.lazy->attr_pending) {
+            stats_.attributes += node.attribute.size();
+            if (!node.attribute.empty()) stats_.allocations++;
+            for (HtmlAttributes::const_iterator it = node.attribute.begin(); it != node.attribute.end(); ++it) {
+                stats_.allocations += HeapBlocks(it->second);
+            }
         }
+        if (node.classlist.capacity()) stats_.allocations++;
+        for (size_t i = 0; i < node.classlist.size(); i++) stats_.allocations += HeapBlocks(node.classlist[i]);
+
+        for (size_t i = 0; i < node.children.size(); i++) Count(*node.children[i], depth + 1);
     }
 
+    static size_t HeapBlocks(const std::wstring& str) {
+        static const size_t small = std::wstring().capacity();
+        return str.capacity() > small ? 1 : 0;
+    }
+#endif
 
-    void GetElementsById(const std::wstring& id, std::vector<shared_ptr<HtmlElement> >& result) {
-        std::wstring xpath = L"//*[@id='" + EscapeForXPath(id) + L"']";
-        std::vector<std::wstring> ruleToken = TokenizeXPath(xpath);
-        SelectElement(ruleToken, ruleToken.size(), result);
-        return;
+    // nodes are made in document order. labels follow the input offset,
+    // so fragments parsed apart are labeled as one document; where the
+    // offset is not of the whole input the label is the next one up
+    shared_ptr<HtmlElement> NewElement(shared_ptr<HtmlElement>& parent, size_t offset) {
+        shared_ptr<HtmlElement> element = arena_
+            ? std::allocate_shared<HtmlElement>(HtmlArenaAllocator<HtmlElement>(arena_), parent)
+            : std::make_shared<HtmlElement>(parent);
+        if (offset != std::wstring::npos) label_ = std::max(label_, static_cast<uint64_t>(offset + 1) * HtmlElement::kOrderSpacing);
+        element->order = label_;
+        label_ += HtmlElement::kOrderSpacing;
+        return element;
     }
 
-    void GetElementByTagName(const std::wstring& name, std::vector<shared_ptr<HtmlElement>>& result) {
-        for (HtmlElement::ChildIterator it = children.begin(); it != children.end(); ++it) {
-            if (_wcsicmp((*it)->name.c_str(), name.c_str()) == 0)
-                InsertIfNotExists(result, *it);
-            
-            (*it)->GetElementByTagName(name, result);
+    void AddChild(shared_ptr<HtmlElement>& parent, shared_ptr<HtmlElement> child) {
+        // all of the subtree is labeled by now
+        child->orderEnd = label_ - 1;
+        if (target_ && parent == root_) {
+            nodes_.push_back(std::move(child));
+            return;
         }
+        if (fragment_ && parent == root_) {
+            events_.push_back(OuterEvent(OuterEvent::CHILD, 0));
+            events_.back().node = std::move(child);
+            return;
+        }
+        child->position = parent->children.size();
+        parent->children.push_back(std::move(child));
     }
 
+    void SetAttributes(shared_ptr<HtmlElement>& element, const HtmlTagAttributes<CharT>& attr) {
+        HTMLPARSER_STATS_TIME(stats_.attribute_seconds);
+        if (source_) {
+            if (!attr.Empty()) {
+                HtmlElement::LazyFields* lazy = LazyOf(element);
+                lazy->attr_offset = attr.offset;
+                lazy->attr_length = attr.length;
+                lazy->attr_pending = true;
+            }
+        }
+        else if (attr.text) {
+            element->ParseAttributes(*attr.text, diagnostics_, attr.tag);
+        }
+        else {
+            std::wstring text;
+            attr.AppendTo(text);
+            element->ParseAttributes(text, diagnostics_, attr.tag);
+        }
+    }
 
-    void GetAllElement(std::vector<shared_ptr<HtmlElement> >& result) {
-        for (size_t i = 0; i < children.size(); ++i) {
-            InsertIfNotExists(result, children[i]);
-            children[i]->GetAllElement(result);
+    HtmlElement::LazyFields* LazyOf(shared_ptr<HtmlElement>& element) {
+        if (!element->lazy) {
+            element->lazy = arena_->New<HtmlElement::LazyFields>();
+            element->lazy->source = source_;
         }
+        return element->lazy;
     }
 
-    void Parse(const std::wstring& attr) {
-        size_t index = 0;
-        std::wstring k;
-        std::wstring v;
-        wchar_t split = L' ';
-        bool quota = false;
-
-        enum ParseAttrState {
-            PARSE_ATTR_KEY,
-            PARSE_ATTR_VALUE_BEGIN,
-            PARSE_ATTR_VALUE_END,
-        };
+private:
+    HtmlTreeBuilder(const HtmlTreeBuilder&);
+    HtmlTreeBuilder& operator=(const HtmlTreeBuilder&);
+
+    shared_ptr<HtmlArena> arena_;
+    const HtmlSource* source_;
+    HtmlDiagnostics* diagnostics_;
+    shared_ptr<HtmlElement> root_;
+    std::vector<shared_ptr<HtmlElement>> stack_;
+    shared_ptr<HtmlIndex> index_;   // released before the tree
+    size_t textStart_, textEnd_;
+    bool openAttributes_;   // index mode: parsed as the element opens
+    bool fragment_;
+    bool target_;
+    uint64_t label_;        // smallest order label of the next node
+    std::vector<OuterEvent> events_;
+    std::vector<shared_ptr<HtmlElement>> nodes_;    // target mode
+#if defined(HTMLPARSER_STATS)
+    ParseStats stats_;
+#endif
+};
+
+/**
+ * class HtmlParseContext
+ * state of one parse into a tree: the tokenizer driving a tree builder.
+ * one-shot and chunked parsing go through it and build the same tree.
+ */
+template <typename CharT>
+class HtmlParseContext {
+public:
+    HtmlParseContext(const HtmlParser& parser, size_t sizeHint)
+        : builder_(parser, sizeHint), tokenizer_(parser, builder_, false) {
+        builder_.SetDiagnostics(&tokenizer_.GetDiagnostics());
+#if defined(HTMLPARSER_STATS)
+        hook_ = parser.hook_;
+        start_ = std::chrono::steady_clock::now();
+        consumed_ = raw_text_bytes_ = 0;
+        tokenize_seconds_ = attribute_seconds_ = build_seconds_ = 0;
+#endif
+    }
+
+    /**
+     * zero-copy mode: text and attributes become views into source, which
+     * must be the buffer handed to Run (whole input, single call)
+     */
+    void SetSource(const shared_ptr<HtmlSource>& source) {
+        builder_.SetSource(source);
+        tokenizer_.SetViews(true);
+    }
+
+    /**
+     * tokenize s[index, length)
+     * @param final no more input after this
+     * @return position of the first character still needed
+     */
+    size_t Run(const CharT* s, size_t length, size_t index, bool final) {
+        HTMLPARSER_STATS_TIME(tokenize_seconds_);
+        size_t next = tokenizer_.Run(s, length, index, final);
+        HTMLPARSER_STATS_ADD(consumed_, next - index);
+        return next;
+    }
+
+    /**
+     * fragment mode, see HtmlTokenizer::SetFragment
+     */
+    void SetFragment() {
+        builder_.SetFragment();
+        tokenizer_.SetFragment();
+    }
+
+    /**
+     * see HtmlTokenizer::SetOffset
+     */
+    void SetOffset(size_t base) {
+        tokenizer_.SetOffset(base);
+    }
+
+    /**
+     * tokenize s[index, end), taking over what fragment read of it where
+     * this context would have read the same. at each outer level start tag
+     * of the fragment where this context stands between two tokens, the
+     * fragment's outer events are replayed until one this context reads
+     * differently; from there it tokenizes itself up to the next such
+     * start tag. the fragment's open elements are taken over when all of
+     * it was replayed and it ended between two tokens.
+     * @param fragment run on s to end from a start tag at index or after
+     * @param reached what its Run returned
+     * @param final no more input after end
+     * @return as Run
+     */
+    size_t Join(HtmlParseContext& fragment, const CharT* s, size_t index, size_t end, size_t reached, bool final) {
+        // what the fragment read counts as read by this context
+        HTMLPARSER_STATS_ADD(raw_text_bytes_, fragment.builder_.GetStats().raw_text_bytes);
+        HTMLPARSER_STATS_ADD(attribute_seconds_, fragment.builder_.GetStats().attribute_seconds);
+        HTMLPARSER_STATS_ADD(build_seconds_, fragment.builder_.GetStats().build_seconds);
+        HTMLPARSER_STATS_ADD(tokenize_seconds_, fragment.tokenize_seconds_);
+        HTMLPARSER_STATS_TIME(tokenize_seconds_);
+        size_t next = Replay(fragment, s, index, end, reached, final);
+        HTMLPARSER_STATS_ADD(consumed_, next - index);
+        return next;
+    }
+
+    /**
+     * everything still open at the end of the input is dropped
+     */
+    shared_ptr<HtmlDocument> Finish() {
+        tokenizer_.Stop();
+        shared_ptr<HtmlDocument> doc = builder_.Finish();
+        const size_t* counts = tokenizer_.GetDiagnostics().Counts();
+        std::copy(counts, counts + HtmlDiagnostic::CODE_COUNT, doc->warnings_);
+#if defined(HTMLPARSER_STATS)
+        FinishStats(doc->stats_);
+#endif
+        return doc;
+    }
+
+    /**
+     * the tree built so far; elements are attached to their parent once
+     * they are closed
+     */
+    shared_ptr<HtmlElement> GetRoot() const {
+        return builder_.GetRoot();
+    }
 
-        ParseAttrState state = PARSE_ATTR_KEY;
+private:
+    // Join without the bookkeeping
+    size_t Replay(HtmlParseContext& fragment, const CharT* s, size_t index, size_t end, size_t reached, bool final) {
+        typedef typename HtmlTreeBuilder<CharT>::OuterEvent OuterEvent;
+
+        const std::vector<OuterEvent>& events = fragment.builder_.GetOuterEvents();
+        bool whole = reached == end && fragment.tokenizer_.AtRest();
+        size_t count = events.size();
+        if (!whole) {
+            // only up to the last outer level start tag
+            while (count > 0 && events[count - 1].kind != OuterEvent::OPEN) count--;
+            if (count > 0) count--;
+        }
 
-        while (attr.size() > index) {
-            wchar_t input = attr.at(index);
-            switch (state) {
-            case PARSE_ATTR_KEY: {
-                if (input == L'\t' || input == L'\r' || input == L'\n') {
+        for (size_t i = 0; i < count; i++) {
+            if (events[i].kind != OuterEvent::OPEN || events[i].offset < index) continue;
+            index = tokenizer_.Run(s, events[i].offset, index, false);
+            if (index != events[i].offset || !tokenizer_.AtRest()) continue;
+
+            tokenizer_.EndText();
+            size_t from = index;
+            size_t open = i;
+            for (; i < count; i++) {
+                const OuterEvent& e = events[i];
+                if (e.kind == OuterEvent::OPEN) {
+                    open = i;
                 }
-                else if (input == L'\'' || input == L'"') {
-                    std::wcerr << L"WARN : attribute unexpected " << input << std::endl;
+                else if (e.kind == OuterEvent::CHILD) {
+                    builder_.Append(e.node);
                 }
-                else if (input == L' ') {
-                    if (!k.empty()) {
-                        attribute[k] = v;
-                        k.clear();
+                else if (e.kind == OuterEvent::UNMATCHED) {
+                    // it closes an outer element after all: the element it
+                    // is in has to be read again
+                    if (tokenizer_.IsOpen(e.atom, e.name)) {
+                        index = events[open].offset;
+                        break;
                     }
                 }
-                else if (input == L'=') {
-                    state = PARSE_ATTR_VALUE_BEGIN;
-                }
-                else {
-                    k.append(attr.c_str() + index, 1);
+                else if (tokenizer_.AtTop() || (e.kind == OuterEvent::CLOSE && !tokenizer_.CloseOuter(e.atom, e.name, s, e.offset))) {
+                    index = e.offset;
+                    break;
                 }
             }
-                               break;
-
-            case PARSE_ATTR_VALUE_BEGIN: {
-                if (input == L'\t' || input == L'\r' || input == L'\n' || input == L' ') {
-                    if (!k.empty()) {
-                        attribute[k] = v;
-                        k.clear();
-                    }
-                    state = PARSE_ATTR_KEY;
-                }
-                else if (input == L'\'' || input == L'"') {
-                    split = input;
-                    quota = true;
-                    state = PARSE_ATTR_VALUE_END;
-                }
-                else {
-                    v.append(attr.c_str() + index, 1);
-                    quota = false;
-                    state = PARSE_ATTR_VALUE_END;
-                }
+            if (i < count) {
+                Take(fragment, from, index);
+                continue;
+            }
+            if (!whole) {
+                index = events[count].offset;
+                Take(fragment, from, index);
+                break;
             }
-                                       break;
+            Take(fragment, from, end);
+            tokenizer_.Adopt(fragment.tokenizer_);
+            builder_.Adopt(fragment.builder_);
+            return end;
+        }
+        return tokenizer_.Run(s, end, index, final);
+    }
 
-            case PARSE_ATTR_VALUE_END: {
-                if ((quota && input == split) || (!quota && (input == L'\t' || input == L'\r' || input == L'\n' || input == L' '))) {
-                    attribute[k] = v;
-                    k.clear();
-                    v.clear();
-                    state = PARSE_ATTR_KEY;
-                }
-                else {
-                    v.append(attr.c_str() + index, 1);
-                }
+    // the fragment's diagnostics in s[from, to), replayed here; the rest
+    // of what it read is read again and reported by this context
+    void Take(HtmlParseContext& fragment, size_t from, size_t to) {
+        tokenizer_.GetDiagnostics().Merge(fragment.tokenizer_.GetDiagnostics(), from, to);
+    }
+
+#if defined(HTMLPARSER_STATS)
+    void FinishStats(ParseStats& stats) {
+        stats = builder_.GetStats();
+        stats.bytes = consumed_ * sizeof(CharT);
+        const HtmlDiagnostics& diagnostics = tokenizer_.GetDiagnostics();
+        stats.recovered_tags = diagnostics.Count(HtmlDiagnostic::UNEXPECTED_CLOSE_TAG) +
+            diagnostics.Count(HtmlDiagnostic::ELEMENT_NOT_CLOSED) + tokenizer_.Unclosed();
+        stats.raw_text_bytes += raw_text_bytes_;
+        stats.attribute_seconds += attribute_seconds_;
+        stats.build_seconds += build_seconds_;
+        stats.tokenize_seconds = tokenize_seconds_;
+        // the timers nest: tokenizing holds building, building attributes
+        stats.build_seconds -= stats.attribute_seconds;
+        stats.tokenize_seconds -= stats.build_seconds + stats.attribute_seconds;
+        if (stats.tokenize_seconds < 0) stats.tokenize_seconds = 0;
+        stats.total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        if (hook_) hook_->OnParsed(stats);
+    }
+#endif
+
+    HtmlTreeBuilder<CharT> builder_;
+    HtmlTokenizer<CharT, HtmlTreeBuilder<CharT>> tokenizer_;
+#if defined(HTMLPARSER_STATS)
+    shared_ptr<HtmlParseHook> hook_;
+    std::chrono::steady_clock::time_point start_;
+    size_t consumed_;
+    // fragments joined into this context
+    size_t raw_text_bytes_;
+    double tokenize_seconds_, attribute_seconds_, build_seconds_;
+#endif
+};
+
+template <typename CharT>
+shared_ptr<HtmlDocument> HtmlParser::ParseDocument(const CharT* stream, size_t length, const shared_ptr<void>& owner) const {
+    HtmlParseContext<CharT> context(*this, length);
+    shared_ptr<HtmlSource> source;
+    if (zero_copy_) {
+        source = std::make_shared<HtmlSource>(stream, length, borrow_input_ || owner);
+        source->Hold(owner);
+        context.SetSource(source);
+        stream = source->Data<CharT>();
+    }
+    std::vector<size_t> cuts;
+    size_t pieces = std::min(threads_, length / min_piece_);
+    if (pieces > 1) FindCuts(stream, length, pieces, cuts);
+    if (cuts.empty()) context.Run(stream, length, 0, true);
+    else ParsePieces(context, stream, length, cuts, source);
+    return context.Finish();
+}
+
+/**
+ * start tags to cut s at for a parallel parse, about length / pieces
+ * apart. reads the input the way the tokenizer does inside an element
+ * (comments, <!...>, <?...?>, close tags, attributes up to the first '>',
+ * script/noscript/style raw text), without a stack of open elements;
+ * HtmlParseContext::Join checks each cut.
+ */
+template <typename CharT>
+void HtmlParser::FindCuts(const CharT* s, size_t length, size_t pieces, std::vector<size_t>& cuts) const {
+    static const CharT kCommentClose[] = { '-', '-', '>' };
+    static const CharT kPiClose[] = { '?', '>' };
+
+    size_t step = length / pieces;
+    size_t target = step;
+    size_t index = 0;
+    std::wstring name;
+    while (cuts.size() + 1 < pieces && length > target && length - target > step / 2) {
+        size_t open = HtmlScanner::Find(s, index, length, CharT('<'));
+        if (length - open < 2) break;
+        CharT input = s[open + 1];
+        size_t end;
+        if (input == '!') {
+            if (length - open >= 4 && s[open + 2] == '-' && s[open + 3] == '-') {
+                end = HtmlScanner::Find(s, open + 2, length, kCommentClose, 3);
+                index = end < length ? end + 3 : length;
             }
-                                     break;
+            else {
+                end = HtmlScanner::Find(s, open + 2, length, CharT('>'));
+                index = end < length ? end + 1 : length;
             }
-
-            index++;
+            continue;
         }
-
-        if (!k.empty()) {
-            attribute[k] = v;
+        if (input == '?') {
+            end = HtmlScanner::Find(s, open, length, kPiClose, 2);
+            index = end < length ? end + 2 : length;
+            continue;
+        }
+        if (input == '/') {
+            end = open + 2;
+            while (length > end && s[end] != '>' && s[end] != ' ' && s[end] != '\t' && s[end] != '\r' && s[end] != '\n') end++;
+            while (length > end && (s[end] == ' ' || s[end] == '\t' || s[end] == '\r' || s[end] == '\n')) end++;
+            index = length > end && s[end] == '>' ? end + 1 : end;
+            continue;
         }
 
-        //trim
-        if (!value.empty()) {
-            value.erase(0, value.find_first_not_of(L" "));
-            value.erase(value.find_last_not_of(L" ") + 1);
+        if (open >= target) {
+            cuts.push_back(open);
+            target = open + step;
         }
 
-        // After parsing attributes into `attribute`
-        auto it = attribute.find(L"class");
-        if (it != attribute.end()) {
-            classlist.clear();
-            std::wistringstream iss(it->second);
-            std::wstring token;
-            while (iss >> token) {
-                classlist.push_back(token);
-            }
+        // start tag: name, then attributes up to the first '>'
+        end = open + 1;
+        while (length > end && (s[end] == ' ' || s[end] == '\t' || s[end] == '\r' || s[end] == '\n')) end++;
+        size_t nameStart = end;
+        while (length > end && s[end] != ' ' && s[end] != '\t' && s[end] != '\r' && s[end] != '\n' &&
+            s[end] != '/' && s[end] != '>') {
+            end++;
+        }
+        size_t nameEnd = end;
+        bool empty = length > end && s[end] == '/';
+        if (length > end && s[end] != '>') {
+            size_t attr = end + 1;
+            end = HtmlScanner::Find(s, empty ? end : attr, length, CharT('>'));
+            if (!empty) empty = end > attr && end < length && s[end - 1] == '/';
+        }
+        if (end >= length) break;
+        index = end + 1;
+        if (empty || nameEnd - nameStart < 5 || nameEnd - nameStart > 8) continue;
+
+        if (HtmlAtom::Is(HtmlAtom::Of(s + nameStart, nameEnd - nameStart), HtmlAtom::FLAG_RAW)) {
+            name = toLower(std::wstring(s + nameStart, s + nameEnd));
+            end = HtmlScanner::FindCloseTag(s, index, length, name);
+            index = end < length ? end + name.size() + 3 : length;
         }
+    }
+}
+
+/**
+ * parse s cut at cuts: piece 0 into context on this thread, the others
+ * into fragments on threads of their own, joined into context in order
+ */
+template <typename CharT>
+void HtmlParser::ParsePieces(HtmlParseContext<CharT>& context, const CharT* s, size_t length,
+    const std::vector<size_t>& cuts, const shared_ptr<HtmlSource>& source) const {
+    std::vector<size_t> bounds(1, 0);
+    bounds.insert(bounds.end(), cuts.begin(), cuts.end());
+    bounds.push_back(length);
+    size_t pieces = bounds.size() - 1;
+
+    std::vector<std::unique_ptr<HtmlParseContext<CharT>>> fragments(pieces);
+    std::vector<size_t> reached(pieces);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < pieces; i++) {
+        HtmlParseContext<CharT>* fragment = new HtmlParseContext<CharT>(*this, bounds[i + 1] - bounds[i]);
+        fragments[i].reset(fragment);
+        fragment->SetFragment();
+        if (source) fragment->SetSource(source);
+        size_t* out = &reached[i];
+        size_t begin = bounds[i], end = bounds[i + 1];
+        bool final = i + 1 == pieces;
+        threads.push_back(std::thread([=] { *out = fragment->Run(s, end, begin, final); }));
+    }
 
+    size_t index = context.Run(s, bounds[1], 0, false);
+    for (size_t i = 1; i < pieces; i++) {
+        threads[i - 1].join();
+        index = context.Join(*fragments[i], s, index, bounds[i + 1], reached[i], i + 1 == pieces);
+        fragments[i].reset();
     }
+}
 
+/**
+ * class HtmlSaxTag
+ * start tag handed to HtmlSaxHandler::OnStartTag. the attributes are
+ * parsed the first time they are asked for, into storage reused from tag
+ * to tag; valid during the callback only.
+ */
+template <typename CharT>
+class HtmlSaxTag {
+public:
+    template <typename C, typename Handler> friend class HtmlSaxAdapter;
 
-    static void InsertIfNotExists(std::vector<std::shared_ptr<HtmlElement>>& vec, const std::shared_ptr<HtmlElement>& ele) {
-        for (size_t i = 0; i < vec.size(); i++) {
-            if (vec[i] == ele) return;
-        }
+    HtmlSaxTag() : name_(nullptr), raw_(nullptr), empty_(false), parsed_(false), count_(0) {}
 
-        vec.push_back(ele);
+    const std::wstring& GetName() const {
+        return *name_;
+    }
+
+    /**
+     * void element or "<x/>": no OnEndTag pairs with it but the one
+     * that follows right away
+     */
+    bool IsEmpty() const {
+        return empty_;
+    }
+
+    size_t GetAttributeCount() const {
+        Parse();
+        return count_;
+    }
+
+    const std::wstring& GetAttributeName(size_t i) const {
+        Parse();
+        return attrs_[i].first;
+    }
+
+    const std::wstring& GetAttributeValue(size_t i) const {
+        Parse();
+        return attrs_[i].second;
+    }
+
+    bool HasAttribute(const std::wstring& k) const {
+        return Find(k) != count_;
+    }
+
+    std::wstring GetAttribute(const std::wstring& k) const {
+        size_t i = Find(k);
+        return i != count_ ? attrs_[i].second : std::wstring();
+    }
+
+    /**
+     * the unparsed attribute text
+     */
+    const HtmlTagAttributes<CharT>& GetRawAttributes() const {
+        return *raw_;
     }
 
-    // Private helper to sync classlist attribute["class"]
 private:
-    void UpdateClassAttribute() {
-        if (classlist.empty()) {
-            attribute.erase(L"class");
-            return;
-        }
-        std::wstring combined;
-        for (size_t i = 0; i < classlist.size(); ++i) {
-            if (i > 0) combined += L" ";
-            combined += classlist[i];
+    void Reset(const std::wstring& name, const HtmlTagAttributes<CharT>& raw, bool empty) {
+        name_ = &name;
+        raw_ = &raw;
+        empty_ = empty;
+        parsed_ = false;
+    }
+
+    size_t Find(const std::wstring& k) const {
+        Parse();
+        size_t i = 0;
+        while (i < count_ && attrs_[i].first != k) i++;
+        return i;
+    }
+
+    void Parse() const {
+        if (parsed_) return;
+        parsed_ = true;
+        count_ = 0;
+        const std::wstring* text = raw_->text;
+        if (!text) {
+            text_.clear();
+            raw_->AppendTo(text_);
+            text = &text_;
         }
-        attribute[L"class"] = combined;
+        // same rules as HtmlElement attributes, later duplicates win
+        ParseAttributeText(*text, [this](const std::wstring& k, const std::wstring& v) {
+            size_t i = 0;
+            while (i < count_ && attrs_[i].first != k) i++;
+            if (i == count_) {
+                if (count_ == attrs_.size()) attrs_.resize(count_ + 1);
+                attrs_[count_++].first = k;
+            }
+            attrs_[i].second = v;
+        });
     }
-private:
-    std::wstring name;
-    std::wstring value;
-    std::map<std::wstring, std::wstring> attribute;
-    std::vector<std::wstring> classlist;
-    weak_ptr<HtmlElement> parent;
-    std::vector<shared_ptr<HtmlElement> > children;
+
+    const std::wstring* name_;
+    const HtmlTagAttributes<CharT>* raw_;
+    bool empty_;
+    mutable bool parsed_;
+    mutable size_t count_;
+    mutable std::vector<std::pair<std::wstring, std::wstring>> attrs_;
+    mutable std::wstring text_;
 };
 
 /**
- * class HtmlDocument
- * Html Doc struct
+ * class HtmlSaxHandler
+ * base of HtmlParser::ParseSax handlers: derive and hide the callbacks you
+ * need. callbacks left to the base are found at compile time and the
+ * parser skips the work behind them. text and comments come as the input
+ * characters (UTF-8 bytes for char input, see AppendChars), text without
+ * the \r \n \t the tree drops, and may be split over several calls.
  */
-class HtmlDocument {
+template <typename CharT>
+class HtmlSaxHandler {
 public:
-    HtmlDocument(shared_ptr<HtmlElement>& root)
-        : root_(root) {
-    }
+    void OnStartTag(const HtmlSaxTag<CharT>&) {}
+    void OnEndTag(const std::wstring&) {}
+    void OnText(const CharT*, size_t) {}
+    void OnComment(const CharT*, size_t) {}
+};
 
-    std::shared_ptr<HtmlElement> GetRoot() {
-        return root_;
-    }
-    shared_ptr<HtmlElement> GetElementById(const std::wstring& id) {
-        return root_->GetElementById(id);
-    }
+/**
+ * the callbacks a handler implements itself; specialize it to say so
+ * explicitly
+ */
+template <typename Handler, typename CharT>
+struct HtmlSaxTraits {
+    typedef HtmlSaxHandler<CharT> Base;
+
+    static const bool kStartTag = !std::is_same<decltype(&Handler::OnStartTag), void (Base::*)(const HtmlSaxTag<CharT>&)>::value;
+    static const bool kEndTag = !std::is_same<decltype(&Handler::OnEndTag), void (Base::*)(const std::wstring&)>::value;
+    static const bool kText = !std::is_same<decltype(&Handler::OnText), void (Base::*)(const CharT*, size_t)>::value;
+    static const bool kComment = !std::is_same<decltype(&Handler::OnComment), void (Base::*)(const CharT*, size_t)>::value;
+};
 
-    std::vector<shared_ptr<HtmlElement> >  GetElementsById(const std::wstring& id) {
-        return root_->GetElementsById(id);
+/**
+ * tokenizer handler forwarding to an HtmlSaxHandler
+ */
+template <typename CharT, typename Handler>
+class HtmlSaxAdapter {
+public:
+    typedef HtmlSaxTraits<Handler, CharT> Traits;
+
+    explicit HtmlSaxAdapter(Handler& handler) : handler_(handler) {}
+
+    void StartElement(const std::wstring& name, uint32_t, const HtmlTagAttributes<CharT>& attr, bool empty) {
+        if (Traits::kStartTag) {
+            tag_.Reset(name, attr, empty);
+            handler_.OnStartTag(tag_);
+        }
     }
 
-    std::vector<shared_ptr<HtmlElement> > GetElementsByClassName(const std::wstring& name) {
-        return root_->GetElementsByClassName(name);
+    void EndElement(const std::wstring& name, const HtmlTagAttributes<CharT>&) {
+        if (Traits::kEndTag) handler_.OnEndTag(name);
     }
-    std::vector<shared_ptr<HtmlElement> > GetElementByTagName(const std::wstring& name) {
-        return root_->GetElementByTagName(name);
+
+    void Text(const CharT* s, size_t len, size_t) {
+        if (Traits::kText) handler_.OnText(s, len);
     }
 
-    void SelectElement(const std::wstring& rule, std::vector<std::shared_ptr<HtmlElement>>& result) {
-        std::vector<std::wstring> ruleToken = TokenizeXPath(rule);
-        this->SelectElement(ruleToken, 0, result);
+    void TextEnd() {
     }
 
- 
-    std::vector<shared_ptr<HtmlElement> > SelectElement(std::vector<std::wstring> ruleToken, size_t rtSize, std::vector<shared_ptr<HtmlElement>>& result) {
-        HtmlElement::ChildIterator it = root_->ChildBegin();
-        for (; it != root_->ChildEnd(); it++) {
-            (*it)->SelectElement(ruleToken, rtSize, result);
-        }
+    void RawText(const CharT* s, size_t len, size_t) {
+        if (Traits::kText) handler_.OnText(s, len);
+    }
 
-        return result;
+    void Comment(const CharT* s, size_t len) {
+        if (Traits::kComment) handler_.OnComment(s, len);
     }
 
-    std::wstring OuterHTML() {
-        return root_->OuterHTML();
+    void OuterOpen(size_t) {
     }
-    std::wstring InnerHTML() {
-        return root_->InnerHTML();
+
+    void OuterClose(const std::wstring&, uint32_t, size_t) {
     }
-    std::wstring text() {
-        return root_->text();
+
+    void OuterUnmatched(const std::wstring&, uint32_t, size_t) {
     }
 
 private:
-    shared_ptr<HtmlElement> root_;
+    Handler& handler_;
+    HtmlSaxTag<CharT> tag_;
 };
 
+template <typename CharT, typename Handler>
+void HtmlParser::ParseEvents(const CharT* stream, size_t length, Handler& handler) const {
+    HtmlSaxAdapter<CharT, Handler> adapter(handler);
+    HtmlTokenizer<CharT, HtmlSaxAdapter<CharT, Handler>> tokenizer(*this, adapter, true);
+    tokenizer.Run(stream, length, 0, true);
+}
+
 /**
- * class HtmlParser
- * html parser and only one interface
+ * class BasicHtmlPushParser
+ * chunked (push) parsing: Feed the input as it arrives, Finish for the
+ * document. the tokenizer state survives chunk boundaries; only the few
+ * characters of a token that is still undecided (a close tag, the tail of
+ * a chunk that could start "</script>" or "-->", a split UTF-8 sequence)
+ * are buffered between calls. builds the same document as a one-shot
+ * HtmlParser::Parse of the whole input. the parser must outlive it.
  */
-class HtmlParser {
+template <typename CharT>
+class BasicHtmlPushParser {
 public:
-    HtmlParser() {
-        static const std::wstring token[] = { L"br", L"hr", L"img", L"input", L"link", L"meta",
-        L"area", L"base", L"col", L"command", L"embed", L"keygen", L"param", L"source", L"track", L"wbr" };
-        self_closing_tags_.insert(token, token + sizeof(token) / sizeof(token[0]));
+    explicit BasicHtmlPushParser(const HtmlParser& parser)
+        : context_(parser, 0), offset_(0), started_(false) {
     }
 
     /**
-     * parse html by C-Style data
-     * @param data
-     * @param len
-     * @return html document object
+     * tokenize the next chunk of input
+     * @param chunk
+     * @param n
      */
-    shared_ptr<HtmlDocument> Parse(const wchar_t* data, size_t len) {
-        stream_ = data;
-        length_ = len;
-        size_t index = 0;
-        root_.reset(new HtmlElement());
-        while (length_ > index) {
-            wchar_t input = stream_[index];
-            if (input == L'\r' || input == L'\n' || input == L'\t' || input == L' ') {
-                index++;
-            }
-            else if (input == L'<') {
-                index = ParseElement(index, root_);
-            }
-            else {
-                break;
-            }
+    void Feed(const CharT* chunk, size_t n) {
+        if (!started_) {
+            // a UTF-8 byte order mark may itself be split
+            pending_.append(chunk, n);
+            if (pending_.size() < 3 && !IsWide()) return;
+            started_ = true;
+            size_t bom = IsWide() ? 0 : HtmlParser::Utf8BomLength(reinterpret_cast<const char*>(pending_.data()), pending_.size());
+            Consume(bom);
+            Consume(Run(pending_.data(), pending_.size(), false));
+            return;
+        }
+        if (pending_.empty()) {
+            // run straight on the caller's chunk, keep only the unconsumed tail
+            size_t pos = Run(chunk, n, false);
+            offset_ += pos;
+            pending_.assign(chunk + pos, n - pos);
+            return;
         }
+        pending_.append(chunk, n);
+        Consume(Run(pending_.data(), pending_.size(), false));
+    }
 
-        return shared_ptr<HtmlDocument>(new HtmlDocument(root_));
+    void Feed(const std::basic_string<CharT>& chunk) {
+        Feed(chunk.data(), chunk.size());
     }
 
     /**
-     * parse html by string data
-     * @param data
+     * end of input
      * @return html document object
      */
-    shared_ptr<HtmlDocument> Parse(const std::wstring& data) {
-        return Parse(data.data(), data.size());
+    shared_ptr<HtmlDocument> Finish() {
+        if (!started_) {
+            started_ = true;
+            size_t bom = IsWide() ? 0 : HtmlParser::Utf8BomLength(reinterpret_cast<const char*>(pending_.data()), pending_.size());
+            Consume(bom);
+        }
+        Run(pending_.data(), pending_.size(), true);
+        pending_.clear();
+        return context_.Finish();
     }
 
-private:
-    size_t ParseElement(size_t index, shared_ptr<HtmlElement>& element) {
-        while (length_ > index) {
-            wchar_t input = stream_[index + 1];
-            if (input == L'!') {
-                if (wcsncmp(stream_ + index, L"<!--", 4) == 0) {
-                    return SkipUntil(index + 2, L"-->");
-                }
-                else {
-                    return SkipUntil(index + 2, L'>');
-                }
-            }
-            else if (input == L'/') {
-                return SkipUntil(index, L'>');
-            }
-            else if (input == L'?') {
-                return SkipUntil(index, L"?>");
-            }
-
-            shared_ptr<HtmlElement> self(new HtmlElement(element));
-
-            enum ParseElementState {
-                PARSE_ELEMENT_TAG,
-                PARSE_ELEMENT_ATTR,
-                PARSE_ELEMENT_VALUE,
-                PARSE_ELEMENT_TAG_END
-            };
-
-            ParseElementState state = PARSE_ELEMENT_TAG;
-            index++;
-            wchar_t split = 0;
-            std::wstring attr;
-
-            while (length_ > index) {
-                switch (state) {
-                case PARSE_ELEMENT_TAG: {
-                    wchar_t input = stream_[index];
-                    if (input == L' ' || input == L'\r' || input == L'\n' || input == L'\t') {
-                        if (!self->name.empty()) {
-                            state = PARSE_ELEMENT_ATTR;
-                        }
-                        index++;
-                    }
-                    else if (input == L'/') {
-                        self->Parse(attr);
-                        element->children.push_back(self);
-                        return SkipUntil(index, L'>');
-                    }
-                    else if (input == L'>') {
-                        if (self_closing_tags_.find(self->name) != self_closing_tags_.end()) {
-                            element->children.push_back(self);
-                            return ++index;
-                        }
-                        state = PARSE_ELEMENT_VALUE;
-                        index++;
-                    }
-                    else {
-                        self->name.append(stream_ + index, 1);
-                        index++;
-                    }
-                }
-                                      break;
-
-                case PARSE_ELEMENT_ATTR: {
-                    wchar_t input = stream_[index];
-                    if (input == L'>') {
-                        if (stream_[index - 1] == L'/') {
-                            attr.erase(attr.size() - 1);
-                            self->Parse(attr);
-                            element->children.push_back(self);
-                            return ++index;
-                        }
-                        else if (self_closing_tags_.find(self->name) != self_closing_tags_.end()) {
-                            self->Parse(attr);
-                            element->children.push_back(self);
-                            return ++index;
-                        }
-                        state = PARSE_ELEMENT_VALUE;
-                        index++;
-                    }
-                    else {
-                        attr.append(stream_ + index, 1);
-                        index++;
-                    }
-                }
-                                       break;
-
-                case PARSE_ELEMENT_VALUE: {
-                    if (self->name == L"script" || self->name == L"noscript" || self->name == L"style") {
-                        std::wstring close = L"</" + self->name + L">";
-
-                        size_t pre = index;
-                        index = SkipUntil(index, close.c_str());
-                        if (index > (pre + close.size()))
-                            self->value.append(stream_ + pre, index - pre - close.size());
+    /**
+     * the tree built so far; elements show up once they are closed
+     */
+    shared_ptr<HtmlElement> GetRoot() const {
+        return context_.GetRoot();
+    }
 
-                        self->Parse(attr);
-                        element->children.push_back(self);
-                        return index;
-                    }
+    /**
+     * characters held back between chunks
+     */
+    size_t Buffered() const {
+        return pending_.size();
+    }
 
-                    wchar_t input = stream_[index];
-                    if (input == L'<') {
-                        if (!self->value.empty()) {
-                            shared_ptr<HtmlElement> child(new HtmlElement(self));
-                            child->name = L"plain";
-                            child->value.swap(self->value);
-                            self->children.push_back(child);
-                        }
-
-                        if (stream_[index + 1] == L'/') {
-                            state = PARSE_ELEMENT_TAG_END;
-                        }
-                        else {
-                            index = ParseElement(index, self);
-                        }
-                    }
-                    else if (input != L'\r' && input != L'\n' && input != L'\t') {
-                        self->value.append(stream_ + index, 1);
-                        index++;
-                    }
-                    else {
-                        index++;
-                    }
-                }
-                                        break;
-
-                case PARSE_ELEMENT_TAG_END:
-                {
-                    index += 2; // skip "</"
-
-                    // Read tag name only (stop at space, tab, newline, or '>')
-                    size_t nameStart = index;
-                    while (length_ > index && stream_[index] != L'>' &&
-                        stream_[index] != L' ' && stream_[index] != L'\t' &&
-                        stream_[index] != L'\r' && stream_[index] != L'\n')
-                    {
-                        index++;
-                    }
-                    std::wstring closeTag(stream_ + nameStart, index - nameStart);
+private:
+    static bool IsWide() {
+        return sizeof(CharT) != 1;
+    }
 
-                    // Skip any whitespace before '>'
-                    while (length_ > index && (stream_[index] == L' ' || stream_[index] == L'\t' ||
-                        stream_[index] == L'\r' || stream_[index] == L'\n'))
-                    {
-                        index++;
-                    }
+    size_t Run(const CharT* s, size_t n, bool final) {
+        context_.SetOffset(offset_);
+        return context_.Run(s, n, 0, final);
+    }
 
-                    // Expect '>' to end the closing tag
-                    if (length_ > index && stream_[index] == L'>') {
-                        index++; // move past '>'
-                    }
+    void Consume(size_t pos) {
+        pending_.erase(0, pos);
+        offset_ += pos;
+    }
 
-                    if (toLower(closeTag) == toLower(self->name)) {
-                        // Correct closing tag for this element
-                        self->Parse(attr);
-                        element->children.push_back(self);
-                        return index;
-                    }
-                    else {
-                        // Check if this closing tag actually belongs to a parent
-                        shared_ptr<HtmlElement> parent = self->GetParent();
-                        while (parent) {
-                            if (toLower(parent->name) == toLower(closeTag)) {
-                                std::wcerr << L"WARN : element not closed <" << self->name << L">" << std::endl;
-                                self->Parse(attr);
-                                element->children.push_back(self);
-                                return nameStart - 2; // rewind to before "</"
-                            }
-                            parent = parent->GetParent();
-                        }
-
-                        // Unexpected closing tag
-                        std::wcerr << L"WARN : unexpected closed element </" << closeTag
-                            << L"> for <" << self->name << L">" << std::endl;
-                        state = PARSE_ELEMENT_VALUE;
-                    }
-                }
-                break;
+    HtmlParseContext<CharT> context_;
+    std::basic_string<CharT> pending_;
+    size_t offset_;     // of pending_ in the whole input
+    bool started_;
+};
 
-                break;
+typedef BasicHtmlPushParser<char> HtmlPushParser;
+typedef BasicHtmlPushParser<wchar_t> HtmlWidePushParser;
 
-                break;
-                }
-            }
-        }
+inline void HtmlElement::ParseChildren(size_t at, const wchar_t* data, size_t len) {
+    static const HtmlParser parser;     // no arena, no index, warnings only counted
 
-        return index;
+    std::vector<shared_ptr<HtmlElement>> nodes;
+    {
+        // the builder gathers the text of this level in value, an
+        // element's own is kept aside meanwhile
+        std::wstring own;
+        own.swap(value);
+        HtmlTreeBuilder<wchar_t> builder(shared_from_this());
+        HtmlTokenizer<wchar_t, HtmlTreeBuilder<wchar_t>> tokenizer(parser, builder, false);
+        tokenizer.SetFragment();
+        tokenizer.Run(data, len, 0, true);
+        tokenizer.CloseAll(data);
+        builder.TakeNodes(nodes);
+        value.swap(own);
+    }
+    if (nodes.empty()) return;
+
+    if (at > children.size()) at = children.size();
+    children.insert(children.begin() + at, nodes.begin(), nodes.end());
+    for (size_t i = at; i < children.size(); i++) children[i]->position = i;
+    LabelChildren(at, at + nodes.size());
+    if (index) {
+        for (size_t i = 0; i < nodes.size(); i++) HtmlIndex::Attach(nodes[i].get(), index);
+        index->InsertChildren(this, at, at + nodes.size());
     }
+}
 
-    size_t SkipUntil(size_t index, const wchar_t* data) {
-        while (length_ > index) {
-            if (wcsncmp(stream_ + index, data, wcslen(data)) == 0) {
-                return index + wcslen(data);
-            }
-            else {
-                index++;
-            }
-        }
+inline int HtmlElement::ParseInnerHTML(const wchar_t* data, size_t len) {
+    ClearChildren();
 
-        return index;
+    if (HtmlAtom::Is(atom, HtmlAtom::FLAG_RAW)) {
+        if (lazy) lazy->value_pending = false;
+        value.assign(data, len);
+        TrimValue();
+        return 0;
     }
+    ParseChildren(0, data, len);
+    return 0;
+}
 
-    size_t SkipUntil(size_t index, const wchar_t data) {
-        while (length_ > index) {
-            if (stream_[index] == data) {
-                return ++index;
-            }
-            else {
-                index++;
-            }
-        }
-
-        return index;
+inline int HtmlElement::InsertAdjacentHTML(AdjacentPosition where, const wchar_t* data, size_t len) {
+    if (where == BEFORE_BEGIN || where == AFTER_END) {
+        shared_ptr<HtmlElement> p = parent.lock();
+        if (!p) return -1;
+        p->ParseChildren(where == BEFORE_BEGIN ? position : position + 1, data, len);
+        return 0;
     }
 
-private:
-    const wchar_t* stream_;
-    size_t length_;
-    std::set<std::wstring> self_closing_tags_;
-    shared_ptr<HtmlElement> root_;
-};
+    if (HtmlAtom::Is(atom, HtmlAtom::FLAG_RAW)) {
+        EnsureValue();
+        value.insert(where == AFTER_BEGIN ? 0 : value.size(), data, len);
+        return 0;
+    }
+    ParseChildren(where == AFTER_BEGIN ? 0 : children.size(), data, len);
+    return 0;
+}
 
-static std::wstring toLower(const std::wstring& str)
+inline std::wstring toLower(const std::wstring& str)
 {
     std::wstring lowerStr = str;
     std::transform(lowerStr.begin(), lowerStr.end(), lowerStr.begin(),
@@ -1249,7 +7119,7 @@ static bool EndsWith(const std::wstring& str, const std::wstring& suffix) {
     return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
 }
 
-static std::wstring Trim(const std::wstring& s) {
+inline std::wstring Trim(const std::wstring& s) {
     size_t start = 0;
     while (start < s.size() && iswspace(s[start])) start++;
     size_t end = s.size();
@@ -1257,6 +7127,21 @@ static std::wstring Trim(const std::wstring& s) {
     return s.substr(start, end - start);
 }
 
+bool AttrContains(const HtmlAttributes& attrs, const std::wstring& name, const std::wstring& substring) {
+    const std::wstring* value = attrs.Find(name);
+    return value && value->find(substring) != std::wstring::npos;
+}
+
+bool AttrStartsWith(const HtmlAttributes& attrs, const std::wstring& name, const std::wstring& prefix) {
+    const std::wstring* value = attrs.Find(name);
+    return value && StartsWith(*value, prefix);
+}
+
+bool AttrEndsWith(const HtmlAttributes& attrs, const std::wstring& name, const std::wstring& suffix) {
+    const std::wstring* value = attrs.Find(name);
+    return value && EndsWith(*value, suffix);
+}
+
 bool AttrContains(const std::map<std::wstring, std::wstring>& attrs, const std::wstring& name, const std::wstring& substring) {
     auto it = attrs.find(name);
     if (it == attrs.end()) return false;
@@ -1315,6 +7200,133 @@ std::wstring ClearQuotes(std::wstring val)
 
 
 
+// UTF-8 helpers -------------------------------------------------------
+
+inline void AppendChars(std::wstring& out, const wchar_t* data, size_t len) {
+    out.append(data, len);
+}
+
+// Decode a UTF-8 run onto a wide string. Invalid sequences become U+FFFD;
+// code points above the BMP become surrogate pairs where wchar_t is 16 bit.
+inline void AppendChars(std::wstring& out, const char* data, size_t len) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + len;
+    while (p < end) {
+        unsigned int c = *p;
+        if (c < 0x80) {
+            // ASCII stretch, no decoding needed
+            const unsigned char* q = p + 1;
+            while (q < end && *q < 0x80) q++;
+            out.append(p, q);
+            p = q;
+            continue;
+        }
+
+        size_t extra;
+        unsigned int cp;
+        if (c >= 0xC2 && c <= 0xDF) { extra = 1; cp = c & 0x1F; }
+        else if (c >= 0xE0 && c <= 0xEF) { extra = 2; cp = c & 0x0F; }
+        else if (c >= 0xF0 && c <= 0xF4) { extra = 3; cp = c & 0x07; }
+        else { out.push_back(static_cast<wchar_t>(0xFFFD)); p++; continue; }
+
+        if (static_cast<size_t>(end - p) <= extra) {
+            out.push_back(static_cast<wchar_t>(0xFFFD));
+            p++;
+            continue;
+        }
+        size_t i = 1;
+        for (; i <= extra; i++) {
+            if ((p[i] & 0xC0) != 0x80) break;
+            cp = (cp << 6) | (p[i] & 0x3F);
+        }
+        if (i <= extra || (extra == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) ||
+            (extra == 3 && (cp < 0x10000 || cp > 0x10FFFF))) {
+            out.push_back(static_cast<wchar_t>(0xFFFD));
+            p++;
+            continue;
+        }
+        p += extra + 1;
+
+        if (sizeof(wchar_t) == 2 && cp >= 0x10000) {
+            cp -= 0x10000;
+            out.push_back(static_cast<wchar_t>(0xD800 + (cp >> 10)));
+            out.push_back(static_cast<wchar_t>(0xDC00 + (cp & 0x3FF)));
+        }
+        else {
+            out.push_back(static_cast<wchar_t>(cp));
+        }
+    }
+}
+
+inline std::wstring Utf8ToWide(const std::string& str) {
+    std::wstring out;
+    out.reserve(str.size());
+    AppendChars(out, str.data(), str.size());
+    return out;
+}
+
+// Encode the code point at data[i] onto out, moving i past it, and return
+// the bytes written (at most 4). A surrogate pair makes one code point.
+inline size_t EncodeUtf8(const wchar_t* data, size_t len, size_t& i, char* out) {
+    unsigned int cp = static_cast<unsigned int>(data[i++]);
+    if (sizeof(wchar_t) == 2 && cp >= 0xD800 && cp <= 0xDBFF && i < len) {
+        unsigned int lo = static_cast<unsigned int>(data[i]);
+        if (lo >= 0xDC00 && lo <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            i++;
+        }
+    }
+    if (cp < 0x80) {
+        out[0] = static_cast<char>(cp);
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = static_cast<char>(0xC0 | (cp >> 6));
+        out[1] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = static_cast<char>(0xE0 | (cp >> 12));
+        out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0 | (cp >> 18));
+    out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = static_cast<char>(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+// Bytes EncodeUtf8 writes for data[0, len).
+inline size_t Utf8Length(const wchar_t* data, size_t len) {
+    size_t size = len;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int cp = static_cast<unsigned int>(data[i]);
+        if (cp < 0x80) continue;
+        if (cp < 0x800) size += 1;
+        else if (sizeof(wchar_t) == 2 && cp >= 0xD800 && cp <= 0xDBFF && i + 1 < len &&
+            static_cast<unsigned int>(data[i + 1]) >= 0xDC00 && static_cast<unsigned int>(data[i + 1]) <= 0xDFFF) {
+            size += 2;  // 4 bytes for two units
+            i++;
+        }
+        else if (cp < 0x10000) size += 2;
+        else size += 3;
+    }
+    return size;
+}
+
+inline std::string WideToUtf8(const std::wstring& str) {
+    std::string out;
+    out.reserve(str.size());
+    char buffer[4];
+    for (size_t i = 0; i < str.size();) {
+        out.append(buffer, EncodeUtf8(str.data(), str.size(), i, buffer));
+    }
+    return out;
+}
+
+
 #endif
 
 
@@ -0,0 +1,1442 @@
+/*
+ * Differential tests: each one builds the same document two ways (chunked
+ * and one-shot, parallel and sequential, edited and parsed afresh, ...)
+ * on seeded random input and checks that the results agree.
+ *
+ *   cmake -S . -B build && cmake --build build --target html_test
+ *   ctest --test-dir build           (or ./build/html_test [name ...])
+ */
+
+#include "html_parser.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <cwctype>
+#include <future>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// xorshift32, the same sequence on every platform unlike std distributions
+class Random {
+public:
+    explicit Random(unsigned seed) : state_(seed ? seed : 0x9E3779B9u) {}
+
+    unsigned Next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+
+    unsigned Below(unsigned n) { return Next() % n; }
+
+private:
+    unsigned state_;
+};
+
+const char* const kTags[] = {
+    "div", "span", "p", "a", "b", "ul", "li", "table", "tr", "td", "br", "img", "script", "style", "DIV", "Br"
+};
+
+const char* const kWords[] = {
+    "lorem", "ipsum", "caf\xC3\xA9", "\xE6\x97\xA5\xE6\x9C\xAC", "a < b", "x&amp;y", "\xF0\x9F\x98\x80"
+};
+
+// UTF-8 markup with the usual damage: close tags missing, misnested or
+// for nothing open, comments, doctypes, raw text holding markup; all in
+// one closed <html>
+std::string RandomDocument(Random& rng, int tokens) {
+    const size_t tagCount = sizeof(kTags) / sizeof(kTags[0]);
+    const size_t wordCount = sizeof(kWords) / sizeof(kWords[0]);
+    std::string out;
+    std::vector<std::string> open;
+    out += "<html>";
+    for (int i = 0; i < tokens; i++) {
+        unsigned r = rng.Below(20);
+        if (r < 6) {
+            std::string tag = kTags[rng.Below(tagCount)];
+            out += "<" + tag;
+            if (rng.Below(3) == 0) out += " id=\"i" + std::to_string(rng.Below(20)) + "\" class=\"c" + std::to_string(rng.Below(4)) + " d\"";
+            if (rng.Below(4) == 0) out += " data-x='" + std::string(kWords[rng.Below(wordCount)]) + "'";
+            if (rng.Below(15) == 0) out += "/";
+            out += ">";
+            if (tag == "script" || tag == "style") {
+                out += "var s = '<div>' + (1 < 2); </di";
+                out += "</" + tag + ">";
+            }
+            else {
+                open.push_back(tag);
+            }
+        }
+        else if (r < 11) {
+            if (!open.empty()) {
+                out += "</" + open.back() + ">";
+                open.pop_back();
+            }
+        }
+        else if (r == 11) {
+            out += "</" + std::string(kTags[rng.Below(tagCount)]) + ">";
+        }
+        else if (r == 12) {
+            out += "<!-- c <div> -- -->";
+        }
+        else if (r == 13) {
+            out += " \r\n\t";
+        }
+        else if (r == 14 && open.size() > 2 && rng.Below(4) == 0) {
+            out += "</" + open[rng.Below(static_cast<unsigned>(open.size()))] + ">";
+        }
+        else if (r == 15 && rng.Below(10) == 0) {
+            out += "<!doctype html><?pi x?>";
+        }
+        else {
+            out += kWords[rng.Below(wordCount)];
+            out += " ";
+        }
+    }
+    while (!open.empty() && rng.Below(4)) {
+        out += "</" + open.back() + ">";
+        open.pop_back();
+    }
+    // what is still open at the end is dropped, keep the rest
+    out += "</html>";
+    return out;
+}
+
+template <typename PushParser, typename CharT>
+std::wstring PushInChunks(const HtmlParser& parser, const std::basic_string<CharT>& input, Random& rng, size_t maxChunk) {
+    PushParser push(parser);
+    size_t pos = 0;
+    while (pos < input.size()) {
+        size_t n = std::min(input.size() - pos, static_cast<size_t>(rng.Below(static_cast<unsigned>(maxChunk))) + 1);
+        push.Feed(input.data() + pos, n);
+        pos += n;
+    }
+    return push.Finish()->OuterHTML();
+}
+
+// chunked parsing builds what a one-shot parse of the whole input builds,
+// wherever the chunks are cut (mid-tag, mid-</script>, mid-character)
+void TestPushParser() {
+    Random rng(5);
+    HtmlParser parser;
+    for (int i = 0; i < 300; i++) {
+        std::string utf8 = RandomDocument(rng, 50 + rng.Below(600));
+        if (i % 10 == 0) utf8 = "\xEF\xBB\xBF" + utf8;
+        std::wstring wide = Utf8ToWide(utf8.substr(i % 10 == 0 ? 3 : 0));
+
+        std::wstring expected = parser.Parse(utf8)->OuterHTML();
+        EXPECT(parser.Parse(wide)->OuterHTML() == expected);
+        size_t maxChunk = i % 3 == 0 ? 4 : i % 3 == 1 ? 64 : 4096;
+        EXPECT((PushInChunks<HtmlPushParser>(parser, utf8, rng, maxChunk)) == expected);
+        EXPECT((PushInChunks<HtmlWidePushParser>(parser, wide, rng, maxChunk)) == expected);
+    }
+}
+
+// what a sink got, in input order
+std::vector<std::wstring> Delivered(HtmlDiagnosticLog& log) {
+    std::vector<HtmlDiagnostic> got = log.Get();
+    std::vector<std::wstring> lines;
+    for (size_t i = 0; i < got.size(); i++) {
+        wchar_t offset[24];
+        std::swprintf(offset, 24, L"%012zu ", got[i].offset);
+        lines.push_back(offset + got[i].ToString());
+    }
+    std::sort(lines.begin(), lines.end());
+    log.Clear();
+    return lines;
+}
+
+// a document cut into pieces parsed on several threads is the one a
+// sequential parse builds, with the same warnings, in every mode
+void TestParallel() {
+    Random rng(12);
+    shared_ptr<HtmlDiagnosticLog> log = std::make_shared<HtmlDiagnosticLog>();
+    for (int i = 0; i < 1500; i++) {
+        std::string utf8 = RandomDocument(rng, 200 + rng.Below(2000));
+        std::wstring wide = Utf8ToWide(utf8);
+        HtmlParser parser;
+        parser.SetZeroCopyMode(i % 4 == 1);
+        parser.SetIndexMode(i % 4 == 2);
+        parser.SetArenaMode(i % 4 == 3);
+        if (i % 3 == 0) parser.SetDiagnostics(log);
+        bool useWide = i % 2 == 1;
+        shared_ptr<HtmlDocument> expected = useWide ? parser.Parse(wide) : parser.Parse(utf8);
+        std::vector<std::wstring> expectedLines = Delivered(*log);
+
+        parser.SetThreads(2 + rng.Below(7));
+        parser.SetMinPiece(64 + rng.Below(512));
+        shared_ptr<HtmlDocument> doc = useWide ? parser.Parse(wide) : parser.Parse(utf8);
+        EXPECT(doc->OuterHTML() == expected->OuterHTML());
+        for (int code = 0; code < HtmlDiagnostic::CODE_COUNT; code++) {
+            HtmlDiagnostic::Code c = static_cast<HtmlDiagnostic::Code>(code);
+            EXPECT(doc->GetWarningCount(c) == expected->GetWarningCount(c));
+        }
+        EXPECT(Delivered(*log) == expectedLines);
+#if defined(HTMLPARSER_STATS)
+        EXPECT(doc->GetStats().recovered_tags == expected->GetStats().recovered_tags);
+#endif
+    }
+}
+
+// the tags HtmlAtom gives fixed atoms, less "plain"
+const wchar_t* const kKnownNames[] = {
+    L"a", L"abbr", L"address", L"area", L"article", L"aside", L"audio", L"b", L"base",
+    L"bdi", L"bdo", L"blockquote", L"body", L"br", L"button", L"canvas", L"caption", L"center", L"cite",
+    L"code", L"col", L"colgroup", L"command", L"data", L"datalist", L"dd", L"del", L"details", L"dfn",
+    L"dialog", L"div", L"dl", L"dt", L"em", L"embed", L"fieldset", L"figcaption", L"figure", L"font",
+    L"footer", L"form", L"frame", L"frameset", L"h1", L"h2", L"h3", L"h4", L"h5", L"h6",
+    L"h7", L"head", L"header", L"hgroup", L"hr", L"html", L"i", L"iframe", L"img", L"input",
+    L"ins", L"kbd", L"keygen", L"label", L"legend", L"li", L"link", L"main", L"map", L"mark",
+    L"menu", L"meta", L"meter", L"nav", L"noscript", L"object", L"ol", L"optgroup", L"option", L"output",
+    L"p", L"param", L"picture", L"pre", L"progress", L"q", L"rp", L"rt", L"ruby", L"s",
+    L"samp", L"script", L"section", L"select", L"slot", L"small", L"source", L"span", L"strong", L"style",
+    L"sub", L"summary", L"sup", L"svg", L"table", L"tbody", L"td", L"template", L"textarea", L"tfoot",
+    L"th", L"thead", L"time", L"title", L"tr", L"track", L"u", L"ul", L"var", L"video",
+    L"wbr"
+};
+
+std::wstring Lower(std::wstring s) {
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] >= L'A' && s[i] <= L'Z') s[i] = static_cast<wchar_t>(s[i] + (L'a' - L'A'));
+    }
+    return s;
+}
+
+// the tag names of a document, each letter upper or lower case at random
+std::string ScrambleTagCase(const std::string& doc, Random& rng) {
+    std::string out = doc;
+    for (size_t i = 0; i < out.size(); i++) {
+        if (out[i] != '<') continue;
+        size_t j = i + 1;
+        if (j < out.size() && out[j] == '/') j++;
+        for (; j < out.size() && std::isalnum(static_cast<unsigned char>(out[j])); j++) {
+            if (rng.Below(2)) out[j] = static_cast<char>(std::toupper(static_cast<unsigned char>(out[j])));
+        }
+    }
+    return out;
+}
+
+// every known tag has its own atom in any case, apart from the interned
+// ones and from names that only share its hashed letters; other names up
+// to kMaxInternedLength get one atom in any case on every thread, longer
+// ones OTHER and are still matched ignoring case; and documents parse to
+// the same tree whatever the case of their tag names
+void TestAtom() {
+    const size_t count = sizeof(kKnownNames) / sizeof(kKnownNames[0]);
+    uint32_t interned = HtmlAtom::Of(L"x-no-such-tag");
+    std::vector<uint32_t> atoms;
+    for (size_t i = 0; i < count; i++) {
+        std::wstring name = kKnownNames[i];
+        uint32_t atom = HtmlAtom::Of(name);
+        std::wstring upper = name, mixed = name;
+        for (size_t k = 0; k < name.size(); k++) {
+            upper[k] = static_cast<wchar_t>(std::towupper(name[k]));
+            if (k % 2 == 0) mixed[k] = upper[k];
+        }
+        EXPECT(atom > HtmlAtom::PLAIN && atom < interned);
+        EXPECT(HtmlAtom::Of(upper) == atom && HtmlAtom::Of(mixed) == atom);
+        std::string narrow(name.begin(), name.end());
+        EXPECT(HtmlAtom::Of(narrow.data(), narrow.size()) == atom);
+        EXPECT(std::find(atoms.begin(), atoms.end(), atom) == atoms.end());
+        atoms.push_back(atom);
+        if (name.size() > 3) {
+            // same length, first, second and last letters: the same slot
+            std::wstring near = name;
+            near[2] = near[2] == L'z' ? L'y' : L'z';
+            EXPECT(HtmlAtom::Of(near) != atom);
+        }
+    }
+    EXPECT(HtmlAtom::Is(HtmlAtom::Of(L"BR"), HtmlAtom::FLAG_VOID) && !HtmlAtom::Is(HtmlAtom::Of(L"div"), HtmlAtom::FLAG_VOID));
+    EXPECT(HtmlAtom::Is(HtmlAtom::Of(L"Script"), HtmlAtom::FLAG_RAW) && HtmlAtom::Is(HtmlAtom::Of(L"noscript"), HtmlAtom::FLAG_RAW));
+    EXPECT(HtmlAtom::Is(HtmlAtom::Of(L"td"), HtmlAtom::FLAG_TAB) && HtmlAtom::Is(HtmlAtom::Of(L"h7"), HtmlAtom::FLAG_LINE));
+    EXPECT(HtmlAtom::Flags(interned) == 0);
+
+    std::wstring longest(HtmlAtom::kMaxInternedLength, L'x'), tooLong = longest + L"x";
+    uint32_t atom = HtmlAtom::Of(longest);
+    EXPECT(atom > interned && HtmlAtom::Of(Lower(longest)) == atom);
+    EXPECT(HtmlAtom::Of(tooLong) == HtmlAtom::OTHER);
+    EXPECT(HtmlAtom::Equal(HtmlAtom::OTHER, tooLong, HtmlAtom::Of(L"X" + tooLong.substr(1)), L"X" + tooLong.substr(1)));
+    EXPECT(!HtmlAtom::Equal(HtmlAtom::OTHER, tooLong, HtmlAtom::OTHER, tooLong + L"y"));
+
+    std::vector<std::vector<uint32_t>> perThread(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < perThread.size(); t++) {
+        threads.push_back(std::thread([&perThread, t] {
+            for (int n = 0; n < 2000; n++) perThread[t].push_back(HtmlAtom::Of(L"x-thread-" + std::to_wstring(n % 700)));
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+    for (size_t t = 1; t < perThread.size(); t++) EXPECT(perThread[t] == perThread[0]);
+
+    HtmlParser longNames;
+    std::wstring tag = L"x-" + tooLong;
+    std::wstring upper = tag;
+    for (size_t k = 0; k < upper.size(); k++) upper[k] = static_cast<wchar_t>(std::towupper(upper[k]));
+    shared_ptr<HtmlDocument> custom = longNames.Parse(L"<div><" + upper + L" id=a>x</" + tag + L"><" + tag + L" id=b>y</" + upper + L"></div>");
+    EXPECT(custom->GetRoot()->GetChildren()[0]->GetChildCount() == 2);
+    EXPECT(custom->GetRoot()->SelectCount(L"//" + tag) == 2 && custom->QuerySelectorAll(upper).size() == 2);
+
+    Random rng(14);
+    HtmlParser parser;
+    for (int i = 0; i < 300; i++) {
+        std::string doc = RandomDocument(rng, 50 + rng.Below(400));
+        std::wstring expected = Lower(parser.Parse(doc)->OuterHTML());
+        EXPECT(Lower(parser.Parse(ScrambleTagCase(doc, rng))->OuterHTML()) == expected);
+    }
+}
+
+// the elements of a tree as <name id> ... </name>, text left out
+void Structure(HtmlElement& node, std::wstring& out) {
+    for (HtmlElement::ChildIterator it = node.ChildBegin(); it != node.ChildEnd(); ++it) {
+        HtmlElement& child = **it;
+        if (child.GetAtom() == HtmlAtom::PLAIN) continue;
+        out += L"<" + Lower(child.GetName()) + L" " + child.GetAttribute(L"id") + L">";
+        Structure(child, out);
+        out += L"</" + Lower(child.GetName()) + L">";
+    }
+}
+
+// the same from the events of a SAX parse; an element never ended is
+// dropped with what it holds, as the tree builder drops it
+template <typename CharT>
+class StructureHandler : public HtmlSaxHandler<CharT> {
+public:
+    StructureHandler() : open_(1) {}
+
+    void OnStartTag(const HtmlSaxTag<CharT>& tag) {
+        open_.push_back(L"<" + Lower(tag.GetName()) + L" " + tag.GetAttribute(L"id") + L">");
+    }
+
+    void OnEndTag(const std::wstring& name) {
+        std::wstring element = open_.back() + L"</" + Lower(name) + L">";
+        open_.pop_back();
+        open_.back() += element;
+    }
+
+    const std::wstring& Closed() const {
+        return open_[0];
+    }
+
+private:
+    std::vector<std::wstring> open_;
+};
+
+// a SAX parse sees the elements the tree builder builds, in order, with
+// their attributes
+void TestSax() {
+    Random rng(6);
+    HtmlParser parser;
+    for (int i = 0; i < 300; i++) {
+        std::string utf8 = RandomDocument(rng, 50 + rng.Below(600));
+        std::wstring expected;
+        Structure(*parser.Parse(utf8)->GetRoot(), expected);
+
+        StructureHandler<char> bytes;
+        parser.ParseSax(utf8, bytes);
+        EXPECT(bytes.Closed() == expected);
+        StructureHandler<wchar_t> wide;
+        parser.ParseSax(Utf8ToWide(utf8), wide);
+        EXPECT(wide.Closed() == expected);
+    }
+}
+
+typedef std::vector<shared_ptr<HtmlElement>> Nodes;
+
+// the elements of a tree, document order, excluding the root
+std::vector<HtmlElement*> Elements(HtmlElement& root) {
+    std::vector<HtmlElement*> all;
+    for (HtmlElement& node : root.Descendants()) {
+        if (node.GetAtom() != HtmlAtom::PLAIN) all.push_back(&node);
+    }
+    return all;
+}
+
+// an indexed lookup lists what a walk of the tree finds, in its order
+template <typename Match>
+bool SameAsWalk(const Nodes& found, HtmlElement& root, Match match) {
+    std::vector<HtmlElement*> all = Elements(root);
+    size_t n = 0;
+    for (size_t i = 0; i < all.size(); i++) {
+        if (!match(*all[i])) continue;
+        if (n == found.size() || found[n].get() != all[i]) return false;
+        n++;
+    }
+    return n == found.size();
+}
+
+// every child knows its parent, its position and its neighbours
+bool Linked(HtmlElement& root) {
+    std::vector<HtmlElement*> all(1, &root);
+    for (HtmlElement& node : root.Descendants()) all.push_back(&node);
+    for (size_t i = 0; i < all.size(); i++) {
+        Nodes children = all[i]->GetChildren();
+        for (size_t k = 0; k < children.size(); k++) {
+            HtmlElement& child = *children[k];
+            if (child.GetParent().get() != all[i] || child.GetPosition() != k) return false;
+            if (child.GetSiblingPrev() != (k > 0 ? children[k - 1] : nullptr)) return false;
+            if (child.GetSiblingNext() != (k + 1 < children.size() ? children[k + 1] : nullptr)) return false;
+        }
+    }
+    return true;
+}
+
+// SetInnerHTML keeps the sibling links of the tree right and leaves the
+// children it replaced with no parent and no siblings
+void TestSiblings() {
+    Random rng(21);
+    HtmlParser parser;
+    for (int i = 0; i < 60; i++) {
+        parser.SetIndexMode(i % 2 == 1);
+        shared_ptr<HtmlDocument> doc = parser.Parse(RandomDocument(rng, 100 + rng.Below(300)));
+        HtmlElement& root = *doc->GetRoot();
+        for (int edit = 0; edit < 12; edit++) {
+            std::vector<HtmlElement*> all = Elements(root);
+            if (all.empty()) break;
+            HtmlElement& el = *all[rng.Below(static_cast<unsigned>(all.size()))];
+            Nodes old = el.GetChildren();
+            HtmlParser fragment;
+            el.SetInnerHTML(fragment.Parse(RandomDocument(rng, 5 + rng.Below(40)))->GetRoot());
+            for (size_t k = 0; k < old.size(); k++) {
+                EXPECT(!old[k]->GetParent() && !old[k]->GetSiblingNext() && !old[k]->GetSiblingPrev());
+            }
+            EXPECT(Linked(root));
+        }
+    }
+}
+
+// IsBefore and IsAncestorOf, from the labels, agree with a walk
+bool Ordered(HtmlElement& root, Random& rng) {
+    std::vector<HtmlElement*> all(1, &root);
+    for (HtmlElement& node : root.Descendants()) all.push_back(&node);
+    for (size_t i = 0; i + 1 < all.size(); i++) {
+        if (!all[i]->IsBefore(*all[i + 1]) || all[i + 1]->IsBefore(*all[i])) return false;
+    }
+    for (size_t i = 0; i < all.size(); i++) {
+        HtmlElement& other = *all[rng.Below(static_cast<unsigned>(all.size()))];
+        bool above = false;
+        for (HtmlElement* p = other.GetParent().get(); p; p = p->GetParent().get()) above = above || p == all[i];
+        if (all[i]->IsAncestorOf(other) != above) return false;
+    }
+    return true;
+}
+
+// the labels stay right as SetInnerHTML and SetInnerText edit the tree,
+// also where the gaps run out: a chain grown one level at a time at its
+// bottom and a list refilled with more children each time
+void TestOrder() {
+    Random rng(24);
+    HtmlParser parser;
+    for (int i = 0; i < 40; i++) {
+        shared_ptr<HtmlDocument> doc = parser.Parse(RandomDocument(rng, 100 + rng.Below(300)));
+        HtmlElement& root = *doc->GetRoot();
+        for (int edit = 0; edit < 30; edit++) {
+            std::vector<HtmlElement*> all = Elements(root);
+            if (all.empty()) break;
+            HtmlElement& el = *all[rng.Below(static_cast<unsigned>(all.size()))];
+            if (rng.Below(4) == 0) el.SetInnerText(L"text");
+            else el.SetInnerHTML(parser.Parse(RandomDocument(rng, 5 + rng.Below(40)))->GetRoot());
+            EXPECT(Ordered(root, rng));
+        }
+    }
+
+    shared_ptr<HtmlDocument> chain = parser.Parse("<html><div></div><p>after</p></html>");
+    shared_ptr<HtmlElement> bottom = chain->GetRoot()->GetChildren()[0]->GetChildren()[0];
+    for (int depth = 0; depth < 300; depth++) {
+        bottom->SetInnerHTML(parser.Parse("<html><div></div><b>x</b></html>")->GetRoot()->GetChildren()[0]);
+        bottom = bottom->GetChildren()[0];
+    }
+    EXPECT(Ordered(*chain->GetRoot(), rng));
+
+    shared_ptr<HtmlDocument> list = parser.Parse("<html><ul></ul><p>after</p></html>");
+    shared_ptr<HtmlElement> ul = list->GetRoot()->GetChildren()[0]->GetChildren()[0];
+    std::string items = "<html>";
+    for (int n = 0; n < 200; n++) {
+        items += "<li><a>" + std::to_string(n) + "</a></li>";
+        ul->SetInnerHTML(parser.Parse(items + "</html>")->GetRoot()->GetChildren()[0]);
+        ul->GetChildren().back()->GetChildren()[0]->SetInnerText(L"last");
+    }
+    EXPECT(ul->GetChildCount() == 200);
+    EXPECT(Ordered(*list->GetRoot(), rng));
+}
+
+// content markup as ParseInnerHTML takes it, and closed: the same with
+// the close tags of what it leaves open appended
+void RandomFragment(Random& rng, int tokens, std::wstring& raw, std::wstring& closed) {
+    const wchar_t* const tags[] = { L"div", L"p", L"span", L"a", L"b", L"br", L"img" };
+    std::vector<std::wstring> open;
+    raw.clear();
+    for (int i = 0; i < tokens; i++) {
+        unsigned r = rng.Below(12);
+        if (r < 5) {
+            std::wstring tag = tags[rng.Below(7)];
+            raw += L"<" + tag;
+            if (rng.Below(3) == 0) raw += L" id=\"i" + std::to_wstring(rng.Below(4)) + L"\" class=\"c\"";
+            raw += L">";
+            if (tag != L"br" && tag != L"img") open.push_back(tag);
+        }
+        else if (r < 8 && !open.empty()) {
+            raw += L"</" + open.back() + L">";
+            open.pop_back();
+        }
+        else if (r == 8) {
+            raw += L"</zz>";
+        }
+        else if (r == 9) {
+            raw += L"<!-- c -->";
+        }
+        else {
+            raw += L"t" + std::to_wstring(rng.Below(3));
+        }
+    }
+    closed = raw;
+    for (size_t i = open.size(); i-- > 0;) closed += L"</" + open[i] + L">";
+}
+
+// what a document parse makes of content inside an element
+std::wstring Wrapped(const std::wstring& content) {
+    HtmlParser parser;
+    return parser.Parse(L"<wrap>" + content + L"</wrap>")->GetRoot()->GetChildren()[0]->InnerHTML();
+}
+
+// ParseInnerHTML and InsertAdjacentHTML build what a document parse of
+// the content in place builds, keep the links, labels and index of the
+// tree right, and detach the children they replace
+void TestFragment() {
+    Random rng(25);
+    for (int i = 0; i < 200; i++) {
+        std::wstring raw, closed;
+        RandomFragment(rng, 50 + rng.Below(300), raw, closed);
+        HtmlParser parser;
+        parser.SetIndexMode(i % 3 == 1);
+        parser.SetZeroCopyMode(i % 3 == 2);
+        shared_ptr<HtmlDocument> doc = parser.Parse(L"<body>" + closed + L"</body>");
+        HtmlElement& root = *doc->GetRoot();
+        for (int edit = 0; edit < 8; edit++) {
+            std::vector<HtmlElement*> all;
+            for (HtmlElement* el : Elements(root)) {
+                if (!HtmlAtom::Is(el->GetAtom(), HtmlAtom::FLAG_VOID)) all.push_back(el);
+            }
+            HtmlElement& el = *all[rng.Below(static_cast<unsigned>(all.size()))];
+            RandomFragment(rng, 1 + rng.Below(30), raw, closed);
+            unsigned op = rng.Below(5);
+            if (op == 0) {
+                Nodes old = el.GetChildren();
+                el.ParseInnerHTML(raw);
+                EXPECT(el.InnerHTML() == Wrapped(closed));
+                for (size_t k = 0; k < old.size(); k++) EXPECT(!old[k]->GetParent());
+            }
+            else if (op <= 2) {
+                std::wstring before = el.InnerHTML();
+                el.InsertAdjacentHTML(op == 1 ? HtmlElement::AFTER_BEGIN : HtmlElement::BEFORE_END, raw);
+                EXPECT(el.InnerHTML() == Wrapped(op == 1 ? closed + before : before + closed));
+            }
+            else {
+                shared_ptr<HtmlElement> parent = el.GetParent();
+                if (parent.get() == &root) continue;
+                std::wstring before, after;
+                Nodes siblings = parent->GetChildren();
+                size_t at = el.GetPosition() + (op == 4 ? 1 : 0);
+                for (size_t k = 0; k < siblings.size(); k++) (k < at ? before : after) += siblings[k]->OuterHTML();
+                el.InsertAdjacentHTML(op == 3 ? HtmlElement::BEFORE_BEGIN : HtmlElement::AFTER_END, raw);
+                EXPECT(parent->InnerHTML() == Wrapped(before + closed + after));
+            }
+            EXPECT(Linked(root));
+            EXPECT(Ordered(root, rng));
+            if (parser.GetIndexMode()) {
+                uint32_t span = HtmlAtom::Of(L"span");
+                EXPECT(SameAsWalk(doc->GetElementByTagName(L"span"), root, [span](HtmlElement& e) { return e.GetAtom() == span; }));
+            }
+        }
+    }
+
+    // raw text targets take the markup as text; stray close tags stay
+    // inside the target, what is left open is closed
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse(L"<div><script>var a;</script><p>x</p></div>");
+    shared_ptr<HtmlElement> script = doc->SelectFirst(L"//script");
+    script->ParseInnerHTML(L"if (a < b) { x = '<div>'; }");
+    EXPECT(script->GetChildCount() == 0 && script->GetValue() == L"if (a < b) { x = '<div>'; }");
+    shared_ptr<HtmlElement> div = doc->SelectFirst(L"//div");
+    div->ParseInnerHTML(L"a</div></div><b>c<i>d");
+    EXPECT(div->InnerHTML() == L"a<b>c<i>d</i></b>");
+}
+
+// id, class and tag lookups through the index stay right as the tree is
+// edited: SetInnerHTML, ParseInnerHTML and InsertAdjacentHTML cut out and
+// splice in the nodes they change, SetAttribute and class edits relink in
+// place
+void TestIndex() {
+    Random rng(9);
+    HtmlParser parser;
+    parser.SetIndexMode(true);
+    const wchar_t* const tags[] = { L"div", L"span", L"li", L"td", L"html" };
+    const wchar_t* const classes[] = { L"c0", L"c1", L"d", L"e" };
+    for (int i = 0; i < 60; i++) {
+        shared_ptr<HtmlDocument> doc = parser.Parse(RandomDocument(rng, 100 + rng.Below(300)));
+        HtmlElement& root = *doc->GetRoot();
+        for (int edit = 0; edit < 12; edit++) {
+            std::vector<HtmlElement*> all = Elements(root);
+            if (all.empty()) break;
+            HtmlElement& el = *all[rng.Below(static_cast<unsigned>(all.size()))];
+            std::wstring raw, closed;
+            switch (rng.Below(7)) {
+            case 0: {
+                HtmlParser fragment;
+                el.SetInnerHTML(fragment.Parse(RandomDocument(rng, 5 + rng.Below(40)))->GetRoot());
+                break;
+            }
+            case 1:
+                el.SetInnerText(L"text");
+                break;
+            case 2:
+                el.SetAttribute(L"id", L"i" + std::to_wstring(rng.Below(20)));
+                break;
+            case 3:
+                el.AddClass(classes[rng.Below(4)]);
+                break;
+            case 4:
+                el.RemoveClass(classes[rng.Below(4)]);
+                break;
+            case 5:
+                RandomFragment(rng, 1 + rng.Below(30), raw, closed);
+                el.ParseInnerHTML(raw);
+                break;
+            default:
+                RandomFragment(rng, 1 + rng.Below(30), raw, closed);
+                el.InsertAdjacentHTML(static_cast<HtmlElement::AdjacentPosition>(rng.Below(4)), raw);
+                break;
+            }
+
+            // tag lookups first: a stale index is rebuilt by whichever
+            // lookup comes next
+            const wchar_t* tag = tags[rng.Below(5)];
+            uint32_t atom = HtmlAtom::Of(tag);
+            EXPECT(SameAsWalk(doc->GetElementByTagName(tag), root, [atom](HtmlElement& e) { return e.GetAtom() == atom; }));
+            std::wstring cls = classes[rng.Below(4)];
+            EXPECT(SameAsWalk(doc->GetElementsByClassName(cls), root, [&cls](HtmlElement& e) { return e.HasClass(cls); }));
+            std::wstring id = L"i" + std::to_wstring(rng.Below(20));
+            EXPECT(SameAsWalk(doc->GetElementsById(id), root, [&id](HtmlElement& e) { return e.GetAttribute(L"id") == id; }));
+        }
+    }
+}
+
+// an XPath predicate as written, and what it tests
+struct XPathCondition {
+    enum Kind { EXISTS, EQUALS, CONTAINS, STARTS_WITH, ENDS_WITH, TEXT_CONTAINS, TEXT_STARTS_WITH };
+
+    const wchar_t* text;
+    Kind kind;
+    const wchar_t* key;
+    const wchar_t* literal;
+};
+
+const XPathCondition kXPathConditions[] = {
+    { L"[@id]", XPathCondition::EXISTS, L"id", L"" },
+    { L"[@data-x]", XPathCondition::EXISTS, L"data-x", L"" },
+    { L"[@id='i3']", XPathCondition::EQUALS, L"id", L"i3" },
+    { L"[@class='c1']", XPathCondition::EQUALS, L"class", L"c1" },
+    { L"[@class='d']", XPathCondition::EQUALS, L"class", L"d" },
+    { L"[contains(@class,'c')]", XPathCondition::CONTAINS, L"class", L"c" },
+    { L"[contains(@data-x,'o')]", XPathCondition::CONTAINS, L"data-x", L"o" },
+    { L"[starts-with(@id,'i1')]", XPathCondition::STARTS_WITH, L"id", L"i1" },
+    { L"[ends-with(@class,'2')]", XPathCondition::ENDS_WITH, L"class", L"2" },
+    { L"[text(contains, 'lorem')]", XPathCondition::TEXT_CONTAINS, L"", L"lorem" },
+    { L"[text(starts-with, 'ipsum')]", XPathCondition::TEXT_STARTS_WITH, L"", L"ipsum" }
+};
+
+struct XPathStep {
+    CompiledXPath::Axis axis;
+    std::wstring name;   // "*" for any node
+    std::vector<const XPathCondition*> conditions;
+};
+
+std::wstring XPathRule(const std::vector<XPathStep>& steps) {
+    const wchar_t* const axes[] = { L"/", L"//", L"/following-sibling::", L"/preceding-sibling::" };
+    std::wstring rule;
+    for (size_t i = 0; i < steps.size(); i++) {
+        rule += axes[steps[i].axis] + steps[i].name;
+        for (size_t k = 0; k < steps[i].conditions.size(); k++) rule += steps[i].conditions[k]->text;
+    }
+    return rule;
+}
+
+// one to three steps on any axis, mostly "//", with up to two predicates,
+// often none
+std::vector<XPathStep> RandomXPath(Random& rng) {
+    const wchar_t* const names[] = { L"div", L"span", L"p", L"li", L"b", L"td", L"DIV", L"*", L"*" };
+    const unsigned conditions = sizeof(kXPathConditions) / sizeof(kXPathConditions[0]);
+    std::vector<XPathStep> steps(1 + rng.Below(3));
+    for (size_t i = 0; i < steps.size(); i++) {
+        unsigned axis = rng.Below(6);
+        steps[i].axis = static_cast<CompiledXPath::Axis>(axis < 3 ? CompiledXPath::AXIS_DESCENDANT : axis - 2);
+        steps[i].name = names[rng.Below(9)];
+        for (unsigned k = rng.Below(5); k < 2; k++) steps[i].conditions.push_back(&kXPathConditions[rng.Below(conditions)]);
+    }
+    return steps;
+}
+
+bool SameNodes(const Nodes& a, const Nodes& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+// a cache hands out one compiled rule per string while it holds it, holds
+// no more than its capacity, least recently used out first, and compiles
+// a dropped rule again into one that selects the same nodes
+void TestRuleCache() {
+    Random rng(7);
+    HtmlParser parser;
+    CompiledRuleCache<CompiledXPath> cache(8);
+    typedef std::pair<std::wstring, shared_ptr<const CompiledXPath>> Held;
+    std::vector<Held> held;          // what the cache should hold, most recent first
+    std::vector<Held> handedOut;     // every rule compiled, kept alive
+    shared_ptr<HtmlDocument> doc;
+    for (int i = 0; i < 400; i++) {
+        if (i % 20 == 0) doc = parser.Parse(RandomDocument(rng, 100 + rng.Below(300)));
+        std::wstring rule = !held.empty() && rng.Below(3) == 0 ? held[rng.Below(static_cast<unsigned>(held.size()))].first : XPathRule(RandomXPath(rng));
+
+        shared_ptr<const CompiledXPath> got = cache.Get(rule);
+        EXPECT(got->GetRule() == rule);
+        std::vector<Held>::iterator it = held.begin();
+        while (it != held.end() && it->first != rule) ++it;
+        if (it != held.end()) {
+            EXPECT(got == it->second);
+            held.erase(it);
+        }
+        for (size_t k = 0; k < handedOut.size(); k++) {
+            if (handedOut[k].first == rule && handedOut[k].second != got) {
+                Nodes before, now;
+                handedOut[k].second->Evaluate(*doc->GetRoot(), before);
+                got->Evaluate(*doc->GetRoot(), now);
+                EXPECT(SameNodes(before, now));
+            }
+        }
+        held.insert(held.begin(), Held(rule, got));
+        if (held.size() > 8) held.pop_back();
+        handedOut.push_back(Held(rule, got));
+        EXPECT(cache.Size() == held.size());
+    }
+
+    cache.SetCapacity(3);
+    EXPECT(cache.Size() == 3);
+    for (size_t k = 0; k < 3; k++) EXPECT(cache.Get(held[k].first) == held[k].second);
+    cache.SetCapacity(0);
+    EXPECT(cache.Size() == 0);
+    EXPECT(cache.Get(held[0].first) != held[0].second && cache.Size() == 0);
+    EXPECT(CompiledXPathCache::Global().Get(held[0].first) == CompiledXPathCache::Global().Get(held[0].first));
+}
+
+bool Holds(HtmlElement& node, const XPathCondition& cond) {
+    std::map<std::wstring, std::wstring> attributes = node.GetAttributes();
+    std::map<std::wstring, std::wstring>::const_iterator found = attributes.find(cond.key);
+    std::vector<std::wstring> classes = node.GetClassList();
+    std::wstring want = cond.literal;
+    bool isClass = std::wstring(cond.key) == L"class";
+    switch (cond.kind) {
+    case XPathCondition::EXISTS:
+        return found != attributes.end();
+    case XPathCondition::EQUALS:
+        if (found == attributes.end()) return false;
+        return isClass ? std::find(classes.begin(), classes.end(), want) != classes.end() : found->second == want;
+    case XPathCondition::TEXT_CONTAINS:
+        return node.text().find(want) != std::wstring::npos;
+    case XPathCondition::TEXT_STARTS_WITH:
+        return node.text().compare(0, want.size(), want) == 0;
+    default:
+        break;
+    }
+    if (found == attributes.end()) return false;
+    if (!isClass) classes.assign(1, found->second);
+    for (size_t i = 0; i < classes.size(); i++) {
+        const std::wstring& v = classes[i];
+        if (cond.kind == XPathCondition::CONTAINS && v.find(want) != std::wstring::npos) return true;
+        if (cond.kind == XPathCondition::STARTS_WITH && v.compare(0, want.size(), want) == 0) return true;
+        if (cond.kind == XPathCondition::ENDS_WITH && v.size() >= want.size() && v.compare(v.size() - want.size(), want.size(), want) == 0) return true;
+    }
+    return false;
+}
+
+// the rule the slow way: each step from each context node on its own,
+// the union put in document order by a walk of the whole tree
+Nodes NaiveXPath(HtmlElement& root, HtmlElement& scope, const std::vector<XPathStep>& steps) {
+    std::vector<HtmlElement*> all(1, &root);
+    for (HtmlElement& node : root.Descendants()) all.push_back(&node);
+    std::vector<HtmlElement*> context(1, &scope);
+    for (size_t s = 0; s < steps.size(); s++) {
+        const XPathStep& step = steps[s];
+        std::set<HtmlElement*> found;
+        for (size_t c = 0; c < context.size(); c++) {
+            std::vector<HtmlElement*> candidates;
+            if (step.axis == CompiledXPath::AXIS_CHILD) {
+                for (HtmlElement& child : context[c]->Children()) candidates.push_back(&child);
+            }
+            else if (step.axis == CompiledXPath::AXIS_DESCENDANT) {
+                for (HtmlElement& node : context[c]->Descendants()) candidates.push_back(&node);
+            }
+            else if (context[c]->GetParent()) {
+                Nodes siblings = context[c]->GetParent()->GetChildren();
+                size_t at = context[c]->GetPosition();
+                bool following = step.axis == CompiledXPath::AXIS_FOLLOWING_SIBLING;
+                for (size_t k = following ? at + 1 : 0; k < (following ? siblings.size() : at); k++) candidates.push_back(siblings[k].get());
+            }
+            for (size_t k = 0; k < candidates.size(); k++) {
+                HtmlElement& node = *candidates[k];
+                bool match = step.name == L"*" || Lower(node.GetName()) == Lower(step.name);
+                for (size_t p = 0; match && p < step.conditions.size(); p++) match = Holds(node, *step.conditions[p]);
+                if (match) found.insert(&node);
+            }
+        }
+        context.clear();
+        for (size_t i = 0; i < all.size(); i++) {
+            if (found.count(all[i])) context.push_back(all[i]);
+        }
+    }
+    Nodes result;
+    for (size_t i = 0; i < context.size(); i++) result.push_back(context[i]->shared_from_this());
+    return result;
+}
+
+// set-at-a-time evaluation of random rules, from the root and from any
+// element, selects what the naive evaluation selects, in document order
+// and once each; so do Select, SelectFirst, SelectAny and SelectCount,
+// which match one node at a time
+void TestXPath() {
+    Random rng(8);
+    HtmlParser parser;
+    for (int i = 0; i < 150; i++) {
+        parser.SetIndexMode(i % 2 == 1);
+        shared_ptr<HtmlDocument> doc = parser.Parse(RandomDocument(rng, 100 + rng.Below(400)));
+        HtmlElement& root = *doc->GetRoot();
+        std::vector<HtmlElement*> all = Elements(root);
+        for (int q = 0; q < 20; q++) {
+            HtmlElement& scope = q % 2 == 0 || all.empty() ? root : *all[rng.Below(static_cast<unsigned>(all.size()))];
+            std::vector<XPathStep> steps = RandomXPath(rng);
+            std::wstring rule = XPathRule(steps);
+            Nodes expected = NaiveXPath(root, scope, steps);
+
+            Nodes byRule, compiled;
+            scope.SelectElement(rule, byRule);
+            EXPECT(SameNodes(byRule, expected));
+            CompiledXPath xpath(rule);
+            EXPECT(xpath.IsValid());
+            EXPECT(xpath.Evaluate(scope, compiled) == !expected.empty());
+            EXPECT(SameNodes(compiled, expected));
+
+            // the early-exit and lazy forms agree with the full result
+            Nodes lazy;
+            for (HtmlElement& node : scope.Select(rule)) lazy.push_back(node.shared_from_this());
+            EXPECT(SameNodes(lazy, expected));
+            lazy.clear();
+            for (HtmlElement& node : xpath.Select(scope)) lazy.push_back(node.shared_from_this());
+            EXPECT(SameNodes(lazy, expected));
+            EXPECT(scope.SelectCount(rule) == expected.size() && scope.SelectCount(xpath) == expected.size());
+            EXPECT(scope.SelectAny(rule) == !expected.empty() && scope.SelectAny(xpath) == !expected.empty());
+            shared_ptr<HtmlElement> first = expected.empty() ? nullptr : expected[0];
+            EXPECT(scope.SelectFirst(rule) == first && scope.SelectFirst(xpath) == first);
+        }
+    }
+}
+
+// a simple selector as written, and what it tests
+struct CssTest {
+    enum Kind { ID, CLASS, ATTR, NTH };
+
+    const wchar_t* text;
+    Kind kind;
+    const wchar_t* key;      // attribute; for ATTR the operator is op
+    wchar_t op;              // 0 for [a], '=', '^', '$', '*', '~'
+    const wchar_t* value;
+    int a, b;                // NTH: an+b
+};
+
+const CssTest kCssTests[] = {
+    { L"#i3", CssTest::ID, L"id", L'=', L"i3", 0, 0 },
+    { L".c1", CssTest::CLASS, L"class", 0, L"c1", 0, 0 },
+    { L".d", CssTest::CLASS, L"class", 0, L"d", 0, 0 },
+    { L"[data-x]", CssTest::ATTR, L"data-x", 0, L"", 0, 0 },
+    { L"[ID]", CssTest::ATTR, L"ID", 0, L"", 0, 0 },
+    { L"[id=i1]", CssTest::ATTR, L"id", L'=', L"i1", 0, 0 },
+    { L"[data-x^=lo]", CssTest::ATTR, L"data-x", L'^', L"lo", 0, 0 },
+    { L"[data-x$='m']", CssTest::ATTR, L"data-x", L'$', L"m", 0, 0 },
+    { L"[data-x*=\"o\"]", CssTest::ATTR, L"data-x", L'*', L"o", 0, 0 },
+    { L"[class~=d]", CssTest::ATTR, L"class", L'~', L"d", 0, 0 },
+    { L"[data-x~=b]", CssTest::ATTR, L"data-x", L'~', L"b", 0, 0 },
+    { L":first-child", CssTest::NTH, L"", 0, L"", 0, 1 },
+    { L":nth-child(3)", CssTest::NTH, L"", 0, L"", 0, 3 },
+    { L":nth-child(2n+1)", CssTest::NTH, L"", 0, L"", 2, 1 },
+    { L":nth-child(even)", CssTest::NTH, L"", 0, L"", 2, 0 },
+    { L":nth-child(-n+2)", CssTest::NTH, L"", 0, L"", -1, 2 }
+};
+
+struct CssCompound {
+    wchar_t combinator;      // to the compound on the left: ' ', '>', '+', '~'
+    std::wstring name;       // empty or "*" for any element
+    std::vector<const CssTest*> tests;
+};
+
+typedef std::vector<CssCompound> CssSelector;
+
+std::wstring SelectorText(const std::vector<CssSelector>& list) {
+    std::wstring text;
+    for (size_t s = 0; s < list.size(); s++) {
+        if (s > 0) text += L", ";
+        for (size_t i = 0; i < list[s].size(); i++) {
+            const CssCompound& compound = list[s][i];
+            if (i > 0) text += compound.combinator == L' ' ? std::wstring(L" ") : std::wstring(L" ") + compound.combinator + L" ";
+            text += compound.name;
+            for (size_t k = 0; k < compound.tests.size(); k++) text += compound.tests[k]->text;
+        }
+    }
+    return text;
+}
+
+// one or two selectors of one to three compounds, each a type, "*" or
+// nothing before up to two simple selectors
+std::vector<CssSelector> RandomSelector(Random& rng) {
+    const wchar_t* const names[] = { L"div", L"span", L"p", L"li", L"b", L"td", L"DIV", L"*", L"" };
+    const wchar_t combinators[] = { L' ', L' ', L'>', L'+', L'~' };
+    const unsigned tests = sizeof(kCssTests) / sizeof(kCssTests[0]);
+    std::vector<CssSelector> list(1 + (rng.Below(5) == 0));
+    for (size_t s = 0; s < list.size(); s++) {
+        list[s].resize(1 + rng.Below(3));
+        for (size_t i = 0; i < list[s].size(); i++) {
+            CssCompound& compound = list[s][i];
+            compound.combinator = combinators[rng.Below(5)];
+            compound.name = names[rng.Below(9)];
+            for (unsigned k = compound.name.empty() ? rng.Below(2) : rng.Below(5); k < 2; k++) {
+                compound.tests.push_back(&kCssTests[rng.Below(tests)]);
+            }
+        }
+    }
+    return list;
+}
+
+bool IsElement(HtmlElement& node) {
+    return node.GetAtom() != HtmlAtom::NONE && node.GetAtom() != HtmlAtom::PLAIN;
+}
+
+// the element siblings of node before it, nearest first
+std::vector<HtmlElement*> ElementsBefore(HtmlElement& node) {
+    std::vector<HtmlElement*> before;
+    shared_ptr<HtmlElement> parent = node.GetParent();
+    if (!parent) return before;
+    Nodes siblings = parent->GetChildren();
+    for (size_t k = node.GetPosition(); k-- > 0;) {
+        if (IsElement(*siblings[k])) before.push_back(siblings[k].get());
+    }
+    return before;
+}
+
+bool Passes(HtmlElement& node, const CssTest& test) {
+    std::map<std::wstring, std::wstring> attributes = node.GetAttributes();
+    std::map<std::wstring, std::wstring>::const_iterator found = attributes.find(test.key);
+    for (std::map<std::wstring, std::wstring>::const_iterator it = attributes.begin(); found == attributes.end() && it != attributes.end(); ++it) {
+        if (Lower(it->first) == Lower(test.key)) found = it;
+    }
+    std::wstring want = test.value;
+    if (test.kind == CssTest::NTH) {
+        if (!node.GetParent()) return false;
+        long p = static_cast<long>(ElementsBefore(node).size()) + 1;
+        for (long n = 0; n <= p + 2; n++) {
+            if (test.a * n + test.b == p) return true;
+        }
+        return false;
+    }
+    if (test.kind == CssTest::CLASS) return node.HasClass(want);
+    if (found == attributes.end()) return false;
+    const std::wstring& v = found->second;
+    switch (test.op) {
+    case 0:
+        return true;
+    case L'=':
+        return v == want;
+    case L'^':
+        return v.compare(0, want.size(), want) == 0;
+    case L'$':
+        return v.size() >= want.size() && v.compare(v.size() - want.size(), want.size(), want) == 0;
+    case L'*':
+        return v.find(want) != std::wstring::npos;
+    default: {
+        std::wistringstream words(v);
+        std::wstring word;
+        while (words >> word) {
+            if (word == want) return true;
+        }
+        return false;
+    }
+    }
+}
+
+// compound k of sel and those on its left match node and what is around
+// it, trying every ancestor and earlier sibling the combinators allow
+bool NaiveMatch(const CssSelector& sel, size_t k, HtmlElement& node) {
+    const CssCompound& compound = sel[k];
+    if (!IsElement(node)) return false;
+    if (!compound.name.empty() && compound.name != L"*" && Lower(node.GetName()) != Lower(compound.name)) return false;
+    for (size_t i = 0; i < compound.tests.size(); i++) {
+        if (!Passes(node, *compound.tests[i])) return false;
+    }
+    if (k == 0) return true;
+
+    if (compound.combinator == L' ' || compound.combinator == L'>') {
+        for (shared_ptr<HtmlElement> up = node.GetParent(); up; up = up->GetParent()) {
+            if (NaiveMatch(sel, k - 1, *up)) return true;
+            if (compound.combinator == L'>') break;
+        }
+        return false;
+    }
+    std::vector<HtmlElement*> before = ElementsBefore(node);
+    for (size_t i = 0; i < before.size() && (i == 0 || compound.combinator == L'~'); i++) {
+        if (NaiveMatch(sel, k - 1, *before[i])) return true;
+    }
+    return false;
+}
+
+// right to left matching with the Bloom filter, from the root and from
+// any element, finds what a naive recursive match of every element below
+// the scope finds; a class selector finds what GetElementsByClassName
+// finds below it
+void TestSelector() {
+    Random rng(10);
+    HtmlParser parser;
+    const wchar_t* const classes[] = { L"c0", L"c1", L"c2", L"d" };
+    const wchar_t* const tags[] = { L"", L"div", L"li", L"span" };
+    for (int i = 0; i < 150; i++) {
+        parser.SetIndexMode(i % 2 == 1);
+        shared_ptr<HtmlDocument> doc = parser.Parse(RandomDocument(rng, 100 + rng.Below(400)));
+        HtmlElement& root = *doc->GetRoot();
+        std::vector<HtmlElement*> all = Elements(root);
+        for (int q = 0; q < 20; q++) {
+            HtmlElement& scope = q % 2 == 0 || all.empty() ? root : *all[rng.Below(static_cast<unsigned>(all.size()))];
+            std::vector<CssSelector> list = RandomSelector(rng);
+            std::wstring text = SelectorText(list);
+            Nodes expected;
+            for (HtmlElement& node : scope.Descendants()) {
+                bool match = false;
+                for (size_t s = 0; s < list.size() && !match; s++) match = NaiveMatch(list[s], list[s].size() - 1, node);
+                if (match) expected.push_back(node.shared_from_this());
+            }
+
+            CompiledSelector selector(text);
+            EXPECT(selector.IsValid());
+            EXPECT(SameNodes(scope.QuerySelectorAll(text), expected));
+            EXPECT(SameNodes(scope.QuerySelectorAll(selector), expected));
+            EXPECT(scope.QuerySelector(text) == (expected.empty() ? nullptr : expected[0]));
+
+            std::wstring cls = classes[rng.Below(4)];
+            std::wstring tag = tags[rng.Below(4)];
+            // GetElementsByClassName counts the scope in, a selector does not
+            Nodes byClass = scope.GetElementsByClassName(cls, tag);
+            if (!byClass.empty() && byClass[0].get() == &scope) byClass.erase(byClass.begin());
+            EXPECT(SameNodes(scope.QuerySelectorAll(tag + L"." + cls), byClass));
+            if (&scope == &root) EXPECT(SameNodes(doc->QuerySelectorAll(L"." + cls), doc->GetElementsByClassName(cls)));
+        }
+    }
+}
+
+// ParseFile builds from the mapped file what Parse builds from the same
+// bytes in memory, in every mode, still after the file is removed (a
+// zero-copy document keeps the mapping); a path that cannot be read gives
+// null and a diagnostic
+void TestFile() {
+    Random rng(11);
+    const char* const path = "html_test_file.tmp";
+    for (int i = 0; i < 80; i++) {
+        std::string utf8 = i == 0 ? std::string() : RandomDocument(rng, 50 + rng.Below(3000));
+        if (i % 5 == 1) utf8 = "\xEF\xBB\xBF" + utf8;
+        FILE* file = std::fopen(path, "wb");
+        EXPECT(file != nullptr);
+        if (!file) return;
+        EXPECT(std::fwrite(utf8.data(), 1, utf8.size(), file) == utf8.size());
+        std::fclose(file);
+
+        HtmlParser parser;
+        parser.SetZeroCopyMode(i % 4 == 1);
+        parser.SetIndexMode(i % 4 == 2);
+        parser.SetArenaMode(i % 4 == 3);
+        shared_ptr<HtmlDocument> doc = parser.ParseFile(path);
+        std::remove(path);
+        EXPECT(doc && doc->OuterHTML() == parser.Parse(utf8)->OuterHTML());
+    }
+
+    shared_ptr<HtmlDiagnosticLog> log = std::make_shared<HtmlDiagnosticLog>();
+    HtmlParser parser;
+    parser.SetDiagnostics(log);
+    EXPECT(!parser.ParseFile("no such directory/page.html") && !parser.ParseFile("."));
+    std::vector<HtmlDiagnostic> got = log->Get();
+    EXPECT(got.size() == 2);
+    for (size_t i = 0; i < got.size(); i++) EXPECT(got[i].code == HtmlDiagnostic::CANNOT_READ_FILE);
+}
+
+// ParseMany and ParseAsync on a pool, and Parse from several threads at
+// once, all through one shared parser, build what Parse builds for each
+// input; done runs once per input, a batch waited for from inside a task
+// of the same pool finishes, and an exception thrown from done reaches
+// the caller once the batch is over
+void TestMany() {
+    Random rng(13);
+    std::vector<std::string> pages;
+    std::vector<std::wstring> widePages;
+    for (int i = 0; i < 120; i++) {
+        // uneven sizes, a few pages far larger than the rest
+        pages.push_back(RandomDocument(rng, i % 20 == 0 ? 20000 : 20 + rng.Below(800)));
+        widePages.push_back(Utf8ToWide(pages.back()));
+    }
+
+    HtmlThreadPool pool(4);
+    for (int mode = 0; mode < 4; mode++) {
+        HtmlParser parser;
+        parser.SetZeroCopyMode(mode == 1);
+        parser.SetIndexMode(mode == 2);
+        parser.SetArenaMode(mode == 3);
+        std::vector<std::wstring> expected;
+        for (size_t i = 0; i < pages.size(); i++) expected.push_back(parser.Parse(pages[i])->OuterHTML());
+
+        std::vector<int> calls(pages.size());
+        std::vector<shared_ptr<HtmlDocument>> docs = parser.ParseMany(pages,
+            [&calls](size_t i, const shared_ptr<HtmlDocument>&) { calls[i]++; }, pool);
+        EXPECT(docs.size() == pages.size());
+        for (size_t i = 0; i < docs.size(); i++) EXPECT(calls[i] == 1 && docs[i]->OuterHTML() == expected[i]);
+
+        docs = parser.ParseMany(widePages);
+        for (size_t i = 0; i < docs.size(); i++) EXPECT(docs[i]->OuterHTML() == expected[i]);
+
+        std::vector<std::future<shared_ptr<HtmlDocument>>> futures;
+        for (size_t i = 0; i < 30; i++) futures.push_back(i % 2 ? parser.ParseAsync(widePages[i], pool) : parser.ParseAsync(pages[i], pool));
+        for (size_t i = 0; i < futures.size(); i++) EXPECT(futures[i].get()->OuterHTML() == expected[i]);
+
+        std::vector<std::wstring> got(pages.size());
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 4; t++) {
+            threads.push_back(std::thread([&parser, &pages, &got, t] {
+                for (size_t i = t; i < pages.size(); i += 4) got[i] = parser.Parse(pages[i])->OuterHTML();
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+        EXPECT(got == expected);
+    }
+
+    HtmlParser parser;
+    HtmlThreadPool small(2);
+    std::vector<std::string> few(pages.begin(), pages.begin() + 8);
+    std::vector<size_t> nested(few.size());
+    parser.ParseMany(few, [&](size_t i, const shared_ptr<HtmlDocument>&) {
+        nested[i] = parser.ParseMany(few, small).size();
+    }, small);
+    EXPECT(std::count(nested.begin(), nested.end(), few.size()) == static_cast<long>(few.size()));
+
+    std::atomic<size_t> ran(0);
+    bool thrown = false;
+    try {
+        parser.ParseMany(pages, [&ran](size_t i, const shared_ptr<HtmlDocument>&) {
+            ran++;
+            if (i == 7) throw std::runtime_error("done");
+        }, pool);
+    }
+    catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    EXPECT(thrown && ran == pages.size());
+}
+
+typedef std::vector<std::pair<std::wstring, std::wstring>> Pairs;
+
+// the attributes in iteration order
+Pairs Listed(const HtmlAttributes& attributes) {
+    Pairs pairs;
+    for (HtmlAttributes::const_iterator it = attributes.begin(); it != attributes.end(); ++it) {
+        pairs.push_back(std::make_pair(it->first, it->second));
+    }
+    return pairs;
+}
+
+// HtmlAttributes, through random sets, erases and copies of short and
+// long keys, holds what a list of pairs in source order holds; a parsed
+// element keeps long keys of its own
+void TestAttributes() {
+    Random rng(15);
+    for (int i = 0; i < 300; i++) {
+        HtmlAttributes attributes;
+        Pairs model;
+        unsigned keys = 4 + rng.Below(i % 3 == 0 ? 60 : 12);
+        for (int op = 0; op < 300; op++) {
+            std::wstring key = L"k" + std::to_wstring(rng.Below(keys));
+            if (rng.Below(4) == 0) key += std::wstring(HtmlAttributes::kMaxInternedLength, L'-');
+            Pairs::iterator it = model.begin();
+            while (it != model.end() && it->first != key) ++it;
+
+            unsigned r = rng.Below(10);
+            if (r < 6) {
+                std::wstring value = L"v" + std::to_wstring(op);
+                attributes.Set(key, value);
+                if (it != model.end()) it->second = value;
+                else it = model.insert(model.end(), std::make_pair(key, value));
+            }
+            else if (r < 8) {
+                attributes.Erase(key);
+                if (it != model.end()) model.erase(it);
+                it = model.end();
+            }
+            else if (r == 8 && rng.Below(8) == 0) {
+                attributes.Clear();
+                model.clear();
+                it = model.end();
+            }
+            else {
+                HtmlAttributes copy(attributes);
+                attributes = copy;
+            }
+            const std::wstring* found = attributes.Find(key);
+            EXPECT(found ? it != model.end() && *found == it->second : it == model.end());
+            EXPECT(attributes.Has(key) == (found != nullptr));
+        }
+        EXPECT(Listed(attributes) == model && attributes.size() == model.size());
+        for (size_t k = 0; k < model.size(); k++) {
+            const std::wstring* found = attributes.FindIgnoreCase(L"K" + model[k].first.substr(1));
+            EXPECT(found && *found == model[k].second);
+        }
+    }
+
+    HtmlParser parser;
+    std::wstring markup = L"<div", longKey = L"data-" + std::wstring(HtmlAttributes::kMaxInternedLength, L'q');
+    Pairs expected;
+    for (int k = 0; k < 40; k++) {
+        std::wstring key = k % 2 ? L"a" + std::to_wstring(k) : longKey + std::to_wstring(k);
+        markup += L" " + key + L"=\"" + std::to_wstring(k) + L"\"";
+        expected.push_back(std::make_pair(key, std::to_wstring(k)));
+    }
+    shared_ptr<HtmlDocument> doc = parser.Parse(markup + L"></div>");
+    shared_ptr<HtmlElement> div = doc->GetRoot()->GetChildren()[0];
+    EXPECT(Listed(div->GetAttributeList()) == expected);
+    EXPECT(div->GetAttribute(longKey + L"38") == L"38");
+    div->SetAttribute(longKey + L"38", L"");
+    EXPECT(div->GetAttribute(longKey + L"38").empty() && div->GetAttributeList().size() == 39);
+
+    // a tag with many attributes parses in linear time: ten times the
+    // attributes may not take much more than ten times as long
+    double took[2];
+    for (int run = 0; run < 2; run++) {
+        size_t count = run ? 40000 : 4000;
+        std::string many = "<div";
+        for (size_t k = 0; k < count; k++) many += " a" + std::to_string(k) + "=v";
+        many += "></div>";
+        took[run] = 1e9;
+        for (int round = 0; round < 3; round++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            doc = parser.Parse(many);
+            took[run] = std::min(took[run], std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            div = doc->GetRoot()->GetChildren()[0];
+            EXPECT(div->GetAttributeList().size() == count && div->GetAttribute(L"a" + std::to_wstring(count - 1)) == L"v");
+        }
+    }
+    EXPECT(took[1] < took[0] * 30 + 0.05);
+}
+
+// HtmlSerializer: Size says how many wchar_t or UTF-8 bytes Write gives,
+// the bytes are the UTF-8 of the wide output, which is OuterHTML (or
+// InnerHTML), and a callback sink cutting it into small chunks delivers
+// the same; Append keeps what the string held
+void TestSerializer() {
+    Random rng(16);
+    for (int i = 0; i < 60; i++) {
+        HtmlParser parser;
+        parser.SetZeroCopyMode(i % 2 == 1);
+        shared_ptr<HtmlDocument> doc = parser.Parse(RandomDocument(rng, i % 10 == 0 ? 8000 : 20 + rng.Below(600)));
+        std::vector<HtmlElement*> nodes = Elements(*doc->GetRoot());
+        nodes.push_back(doc->GetRoot().get());
+        for (size_t n = 0; n < nodes.size(); n++) {
+            HtmlElement& node = *nodes[n];
+            for (int scope = 0; scope < 2; scope++) {
+                HtmlSerializer::Scope which = scope ? HtmlSerializer::INNER : HtmlSerializer::OUTER;
+                std::wstring wide = scope ? node.InnerHTML() : node.OuterHTML();
+                EXPECT(HtmlSerializer::Size<wchar_t>(node, which) == wide.size());
+
+                std::string bytes;
+                HtmlStringSink<char> sink(bytes);
+                HtmlSerializer::Write(node, sink, which);
+                EXPECT(HtmlSerializer::Size<char>(node, which) == bytes.size() && bytes == WideToUtf8(wide));
+
+                std::string chunked;
+                {
+                    HtmlCallbackSink<char> chunks([&chunked](const char* data, size_t len) { chunked.append(data, len); }, 1 + rng.Below(64));
+                    HtmlSerializer::Write(node, chunks, which);
+                }
+                EXPECT(chunked == bytes);
+
+                std::string appended = "prefix";
+                HtmlSerializer::Append(node, appended, which);
+                EXPECT(appended == "prefix" + bytes);
+            }
+        }
+    }
+}
+
+// text() as a spec: the text nodes in order, outside FLAG_NO_TEXT
+// elements, with tab and line separators marked by characters no
+// document here holds
+const wchar_t kTabMark = 0xE001, kLineMark = 0xE002;
+
+void MarkedText(HtmlElement& node, std::wstring& out) {
+    if (HtmlAtom::Is(node.GetAtom(), HtmlAtom::FLAG_NO_TEXT)) return;
+    if (node.GetAtom() == HtmlAtom::PLAIN) {
+        out += node.GetValue();
+        return;
+    }
+    std::vector<shared_ptr<HtmlElement>> children = node.GetChildren();
+    for (size_t i = 0; i < children.size(); i++) {
+        unsigned flags = HtmlAtom::Flags(children[i]->GetAtom());
+        if (i > 0 && (flags & HtmlAtom::FLAG_TAB)) out += kTabMark;
+        else if (i > 0 && (flags & HtmlAtom::FLAG_LINE)) out += kLineMark;
+        MarkedText(*children[i], out);
+    }
+}
+
+// collapse_whitespace: a run of white space and separators between words
+// becomes a line break if it holds one, else a tab if it holds one, else
+// a space; runs at either end go
+std::wstring Collapsed(const std::wstring& marked) {
+    std::wstring out;
+    size_t i = 0;
+    while (i < marked.size()) {
+        size_t end = i;
+        bool tab = false, line = false;
+        while (end < marked.size() && (std::wcschr(L" \t\n\r\f", marked[end]) || marked[end] == kTabMark || marked[end] == kLineMark)) {
+            tab |= marked[end] == kTabMark;
+            line |= marked[end] == kLineMark;
+            end++;
+        }
+        if (end == marked.size()) break;
+        if (end > i && !out.empty()) out += line ? L'\n' : tab ? L'\t' : L' ';
+        i = end;
+        while (i < marked.size() && !std::wcschr(L" \t\n\r\f", marked[i]) && marked[i] != kTabMark && marked[i] != kLineMark) out += marked[i++];
+    }
+    return out;
+}
+
+// what max_length keeps: the first max wchar_t, one fewer where that
+// would leave half a surrogate pair
+std::wstring Cut(const std::wstring& text, size_t max) {
+    if (text.size() <= max) return text;
+    if (sizeof(wchar_t) == 2 && max > 0 && text[max - 1] >= 0xD800 && text[max - 1] <= 0xDBFF) max--;
+    return text.substr(0, max);
+}
+
+// HtmlTextExtractor against the spec above, plain and collapsed, cut at
+// random lengths; Size against the wchar_t and UTF-8 bytes written
+void TestText() {
+    Random rng(17);
+    for (int i = 0; i < 80; i++) {
+        HtmlParser parser;
+        parser.SetZeroCopyMode(i % 2 == 1);
+        shared_ptr<HtmlDocument> doc = parser.Parse(RandomDocument(rng, 20 + rng.Below(i % 10 == 0 ? 6000 : 600)));
+        std::vector<HtmlElement*> nodes = Elements(*doc->GetRoot());
+        nodes.push_back(doc->GetRoot().get());
+        for (size_t n = 0; n < nodes.size(); n++) {
+            HtmlElement& node = *nodes[n];
+            std::wstring marked;
+            MarkedText(node, marked);
+            std::wstring plain = marked;
+            std::replace(plain.begin(), plain.end(), kTabMark, L'\t');
+            std::replace(plain.begin(), plain.end(), kLineMark, L'\n');
+            EXPECT(node.text() == plain);
+
+            for (int collapse = 0; collapse < 2; collapse++) {
+                HtmlTextExtractor::Options options;
+                options.collapse_whitespace = collapse == 1;
+                const std::wstring full = collapse ? Collapsed(marked) : plain;
+                EXPECT(HtmlTextExtractor(options).Extract(node) == full);
+
+                options.max_length = rng.Below(static_cast<unsigned>(full.size()) + 3);
+                HtmlTextExtractor cut(options);
+                std::wstring wide;
+                HtmlStringSink<wchar_t> wideSink(wide);
+                bool complete = cut.Write(node, wideSink);
+                EXPECT(wide == Cut(full, options.max_length) && complete == (full.size() <= options.max_length));
+                EXPECT(cut.Size<wchar_t>(node) == wide.size());
+
+                std::string bytes;
+                HtmlStringSink<char> sink(bytes);
+                cut.Write(node, sink);
+                EXPECT(bytes == WideToUtf8(wide) && cut.Size<char>(node) == bytes.size());
+            }
+        }
+    }
+
+    // a cut in the middle of a character outside the BMP keeps it whole
+    // or drops it, never half of it
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse("<p>\xF0\x9F\x98\x80\xF0\x9F\x98\x80</p>");
+    const std::wstring smiles = doc->GetRoot()->text();
+    for (size_t max = 0; max <= smiles.size(); max++) {
+        HtmlTextExtractor::Options options;
+        options.max_length = max;
+        std::wstring got = HtmlTextExtractor(options).Extract(*doc->GetRoot());
+        EXPECT(got == smiles.substr(0, sizeof(wchar_t) == 2 ? max & ~static_cast<size_t>(1) : max));
+        EXPECT(HtmlTextExtractor(options).Size<char>(*doc->GetRoot()) == WideToUtf8(got).size());
+    }
+}
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+const Test kTests[] = {
+    { "push", TestPushParser },
+    { "parallel", TestParallel },
+    { "sax", TestSax },
+    { "atom", TestAtom },
+    { "siblings", TestSiblings },
+    { "order", TestOrder },
+    { "fragment", TestFragment },
+    { "index", TestIndex },
+    { "cache", TestRuleCache },
+    { "xpath", TestXPath },
+    { "selector", TestSelector },
+    { "file", TestFile },
+    { "many", TestMany },
+    { "attributes", TestAttributes },
+    { "serializer", TestSerializer },
+    { "text", TestText },
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    for (size_t i = 0; i < sizeof(kTests) / sizeof(kTests[0]); i++) {
+        bool wanted = argc < 2;
+        for (int a = 1; a < argc; a++) wanted = wanted || std::strcmp(argv[a], kTests[i].name) == 0;
+        if (!wanted) continue;
+        int before = failures;
+        kTests[i].run();
+        std::printf("%-10s %s\n", kTests[i].name, failures == before ? "ok" : "FAILED");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}